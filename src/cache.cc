@@ -1,38 +1,243 @@
 #include "cache.h"
 
+#include "cache_manifest.h"
+#include "cache_storage.h"
+#include "config.h"
 #include "indexer.h"
 #include "language_server_api.h"
 #include "platform.h"
+#include "shared_mutex.h"
+#include "timer.h"
+#include "utils.h"
 
+#include <doctest/doctest.h>
 #include <loguru/loguru.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <unordered_set>
 
 namespace {
 
-std::string GetCachedBaseFileName(const std::string& cache_directory,
-                                  std::string source_file) {
-  assert(!cache_directory.empty());
-  std::replace(source_file.begin(), source_file.end(), '\\', '_');
-  std::replace(source_file.begin(), source_file.end(), '/', '_');
-  std::replace(source_file.begin(), source_file.end(), ':', '_');
+// Name of the cache entries for |source_file|, relative to the cache
+// directory.
+std::string GetCachedBaseName(const CachePathMapper& to_cache,
+                              const std::string& source_file) {
+  std::string name = to_cache.MapPath(source_file);
+  std::replace(name.begin(), name.end(), '\\', '_');
+  std::replace(name.begin(), name.end(), '/', '_');
+  std::replace(name.begin(), name.end(), ':', '_');
+  return name;
+}
+std::string GetCachedBaseName(Config* config, const std::string& source_file) {
+  return GetCachedBaseName(
+      CachePathMapper(config, CachePathMapper::Direction::ToCache),
+      source_file);
+}
+
+std::string GetCachedHeaderName(Config* config,
+                                const std::string& source_file) {
+  return GetCachedBaseName(config, source_file) + ".header" +
+         SerializeFormatExtension(config->cacheFormat);
+}
+
+CacheStorage* GetStorage(Config* config) {
+  assert(!config->cacheDirectory.empty());
+  return GetCacheStorage(config);
+}
+
+optional<IndexFileHeader> LoadHeaderEntry(CacheStorage* storage,
+                                          SerializeFormat format,
+                                          const std::string& name) {
+  std::unique_ptr<PlatformMappedFile> file_content = storage->Read(name);
+  IndexFileHeader header;
+  // Do not use a header with a bad version; the full index would be rejected
+  // anyways.
+  if (!file_content ||
+      !DeserializeValue(format, file_content->data, file_content->size,
+                        IndexFile::kCurrentVersion, &header) ||
+      header.version != IndexFile::kCurrentVersion) {
+    return nullopt;
+  }
+  return header;
+}
+
+// Loads the header stored next to the cached index of |filename|, without
+// falling back to the index itself.
+optional<IndexFileHeader> LoadHeaderFile(Config* config,
+                                         const std::string& filename) {
+  optional<IndexFileHeader> header =
+      LoadHeaderEntry(GetStorage(config), config->cacheFormat,
+                      GetCachedHeaderName(config, filename));
+  if (header)
+    CachePathMapper(config, CachePathMapper::Direction::FromCache)
+        .Map(&*header);
+  return header;
+}
+
+optional<std::string> ReadEntry(CacheStorage* storage,
+                                const std::string& name) {
+  std::unique_ptr<PlatformMappedFile> file_content = storage->Read(name);
+  if (!file_content)
+    return nullopt;
+  return std::string(file_content->data, file_content->size);
+}
+
+// File contents are stored in a content-addressed blob store, so identical
+// files (ie, the same header in several worktrees that share a cache
+// directory) are only stored once.
+const char kBlobPrefix[] = "@blobs/";
 
-  return cache_directory + source_file;
+std::string GetBlobName(const std::string& blob_id) {
+  return kBlobPrefix + blob_id;
+}
+
+// Blobs are named after the hash and the size of their contents.
+std::string GetBlobId(uint64_t hash, const std::string& contents) {
+  char id[64];
+  snprintf(id, sizeof(id), "%016llx-%llu", (unsigned long long)hash,
+           (unsigned long long)contents.size());
+  return id;
+}
+
+// Held shared while a file's blob, index and header are written, and
+// exclusively while the cache is collected. Otherwise a collection could
+// remove an old unreferenced blob just after WriteBlob decided to reuse it.
+SharedMutex gCollectionMutex;
+
+bool WriteBlob(CacheStorage* storage,
+               const std::string& blob_id,
+               const std::string& contents) {
+  std::string name = GetBlobName(blob_id);
+  if (storage->Exists(name))
+    return true;
+  return storage->Write(name, contents);
 }
 
 }  // namespace
 
+CachePathMapper::CachePathMapper(Config* config, Direction direction) {
+  if (!config->enableRelocatableCache)
+    return;
+
+  std::vector<std::string> roots;
+  roots.push_back(config->projectRoot);
+  roots.insert(roots.end(), config->relocatableCacheRoots.begin(),
+               config->relocatableCacheRoots.end());
+  for (size_t i = 0; i < roots.size(); ++i) {
+    std::string root = roots[i];
+    while (root.size() > 1 && root.back() == '/')
+      root.pop_back();
+    if (root.empty())
+      continue;
+    std::string placeholder = "$root" + std::to_string(i);
+    if (direction == Direction::ToCache)
+      replacements_.emplace_back(root, placeholder);
+    else
+      replacements_.emplace_back(placeholder, root);
+  }
+  // Prefer the longest match, so a root nested inside another root wins.
+  std::sort(replacements_.begin(), replacements_.end(),
+            [](const std::pair<std::string, std::string>& a,
+               const std::pair<std::string, std::string>& b) {
+              return a.first.size() > b.first.size();
+            });
+}
+
+std::string CachePathMapper::MapPath(const std::string& path) const {
+  for (auto& replacement : replacements_) {
+    if (IsComponentAt(path, 0, replacement.first))
+      return replacement.second + path.substr(replacement.first.size());
+  }
+  return path;
+}
+
+std::string CachePathMapper::MapArgument(std::string argument) const {
+  for (auto& replacement : replacements_) {
+    size_t start = argument.find(replacement.first);
+    while (start != std::string::npos) {
+      if (IsComponentAt(argument, start, replacement.first)) {
+        argument.replace(start, replacement.first.size(), replacement.second);
+        start += replacement.second.size();
+      } else {
+        start += replacement.first.size();
+      }
+      start = argument.find(replacement.first, start);
+    }
+  }
+  return argument;
+}
+
+void CachePathMapper::Map(IndexFile* file) const {
+  file->import_file = MapPath(file->import_file);
+  for (std::string& argument : file->args)
+    argument = MapArgument(argument);
+  for (IndexInclude& include : file->includes)
+    include.resolved_path = MapPath(include.resolved_path);
+  for (std::string& dependency : file->dependencies)
+    dependency = MapPath(dependency);
+}
+
+void CachePathMapper::Map(IndexFileHeader* header) const {
+  header->import_file = MapPath(header->import_file);
+  for (std::string& dependency : header->dependencies)
+    dependency = MapPath(dependency);
+}
+
+// static
+bool CachePathMapper::IsComponentAt(const std::string& value,
+                                    size_t offset,
+                                    const std::string& prefix) {
+  if (value.compare(offset, prefix.size(), prefix) != 0)
+    return false;
+  size_t end = offset + prefix.size();
+  return end == value.size() || value[end] == '/';
+}
+
+IndexFileHeader::IndexFileHeader(const IndexFile& file)
+    : version(IndexFile::kCurrentVersion),
+      last_modification_time(file.last_modification_time),
+      content_hash(file.content_hash),
+      import_file(file.import_file),
+      dependencies(file.dependencies) {}
+
 std::unique_ptr<IndexFile> LoadCachedIndex(Config* config,
                                            const std::string& filename) {
   if (!config->enableCacheRead)
     return nullptr;
 
-  optional<std::string> file_content = ReadContent(
-      GetCachedBaseFileName(config->cacheDirectory, filename) + ".json");
+  // Map the cache instead of reading it into a string so that the binary
+  // format can be decoded in place.
+  std::unique_ptr<PlatformMappedFile> file_content = GetStorage(config)->Read(
+      GetCachedBaseName(config, filename) +
+      SerializeFormatExtension(config->cacheFormat));
   if (!file_content)
     return nullptr;
 
-  return Deserialize(filename, *file_content, IndexFile::kCurrentVersion);
+  std::unique_ptr<IndexFile> file =
+      Deserialize(config->cacheFormat, filename, file_content->data,
+                  file_content->size, IndexFile::kCurrentVersion);
+  if (file)
+    CachePathMapper(config, CachePathMapper::Direction::FromCache)
+        .Map(file.get());
+  return file;
+}
+
+optional<IndexFileHeader> LoadCachedIndexHeader(Config* config,
+                                                const std::string& filename) {
+  if (!config->enableCacheRead)
+    return nullopt;
+
+  optional<IndexFileHeader> header = LoadHeaderFile(config, filename);
+  if (header)
+    return header;
+
+  std::unique_ptr<IndexFile> file = LoadCachedIndex(config, filename);
+  if (!file)
+    return nullopt;
+  return IndexFileHeader(*file);
 }
 
 optional<std::string> LoadCachedFileContents(Config* config,
@@ -40,32 +245,415 @@ optional<std::string> LoadCachedFileContents(Config* config,
   if (!config->enableCacheRead)
     return nullopt;
 
-  return ReadContent(GetCachedBaseFileName(config->cacheDirectory, filename));
+  CacheStorage* storage = GetStorage(config);
+  optional<IndexFileHeader> header = LoadHeaderFile(config, filename);
+  if (header && !header->contents_blob.empty())
+    return ReadEntry(storage, GetBlobName(header->contents_blob));
+
+  // Caches written before the blob store keep a copy next to the index.
+  return ReadEntry(storage, GetCachedBaseName(config, filename));
 }
 
-void WriteToCache(Config* config, IndexFile& file) {
+CacheWriteResult WriteToCache(Config* config, IndexFile& file) {
   if (!config->enableCacheWrite)
-    return;
+    return CacheWriteResult::Failed;
 
-  std::string cache_basename =
-      GetCachedBaseFileName(config->cacheDirectory, file.path);
+  CacheStorage* storage = GetStorage(config);
+  std::string cache_basename = GetCachedBaseName(config, file.path);
 
-  if (file.file_contents_.empty()) {
+  const std::string* contents = &file.file_contents_;
+  uint64_t contents_hash = file.content_hash;
+  optional<std::string> disk_contents;
+  if (contents->empty()) {
     LOG_S(ERROR) << "No cached file contents; performing potentially stale "
-                 << "file-copy for " << file.path;
-    CopyFileTo(cache_basename, file.path);
-  } else {
-    std::ofstream cache_content;
-    cache_content.open(cache_basename);
-    assert(cache_content.good());
-    cache_content << file.file_contents_;
-    cache_content.close();
-  }
-
-  std::string indexed_content = Serialize(file);
-  std::ofstream cache;
-  cache.open(cache_basename + ".json");
-  assert(cache.good());
-  cache << indexed_content;
-  cache.close();
+                 << "file read for " << file.path;
+    disk_contents = ReadContent(file.path);
+    if (disk_contents) {
+      contents = &*disk_contents;
+      contents_hash = HashContent(*contents);
+    }
+  }
+
+  // A relocatable cache is written with the paths of |file| temporarily
+  // rewritten; they are restored before returning.
+  CachePathMapper to_cache(config, CachePathMapper::Direction::ToCache);
+  if (to_cache.IsEnabled())
+    to_cache.Map(&file);
+  std::string indexed_content = Serialize(config->cacheFormat, file);
+  IndexFileHeader header(file);
+  if (to_cache.IsEnabled())
+    CachePathMapper(config, CachePathMapper::Direction::FromCache).Map(&file);
+  header.index_hash = HashContent(indexed_content);
+  if (!contents->empty())
+    header.contents_blob = GetBlobId(contents_hash, *contents);
+
+  // Reparsing a translation unit emits every file it owns again, even though
+  // most of them have not changed. Skip rewriting those.
+  optional<IndexFileHeader> previous = LoadHeaderFile(config, file.path);
+  if (previous && previous->index_hash == header.index_hash &&
+      !header.contents_blob.empty() &&
+      previous->contents_blob == header.contents_blob) {
+    return CacheWriteResult::Unchanged;
+  }
+
+  SharedLock collection_lock(gCollectionMutex);
+  if (!header.contents_blob.empty()) {
+    WriteBlob(storage, header.contents_blob, *contents);
+    // Remove the copy written by older versions.
+    if (storage->Exists(cache_basename))
+      storage->Remove(cache_basename);
+  }
+
+  if (!storage->Write(
+          cache_basename + SerializeFormatExtension(config->cacheFormat),
+          indexed_content)) {
+    return CacheWriteResult::Failed;
+  }
+
+  // Write the header after the index so that a header never refers to an
+  // index that has not been written yet.
+  std::string header_content =
+      SerializeValue(config->cacheFormat, header.version, header);
+  if (!storage->Write(GetCachedHeaderName(config, file.path),
+                      header_content)) {
+    return CacheWriteResult::Failed;
+  }
+  return CacheWriteResult::Written;
+}
+
+void FlushCache(Config* config) {
+  if (config->enableCacheWrite && !config->cacheDirectory.empty())
+    GetStorage(config)->Flush();
+}
+
+namespace {
+
+// CollectCacheGarbage with the current time given by |now|.
+CacheCollectionStats CollectCacheGarbageAt(
+    Config* config,
+    CacheManifest* cache_manifest,
+    const std::vector<std::string>& project_files,
+    int64_t now) {
+  CacheCollectionStats stats;
+  if (!config->enableCacheWrite || config->cacheDirectory.empty())
+    return stats;
+
+  // Only one collection runs at a time.
+  static std::atomic<bool> is_running(false);
+  if (is_running.exchange(true)) {
+    LOG_S(INFO) << "Skipping cache collection; one is already running";
+    return stats;
+  }
+
+  std::lock_guard<SharedMutex> collection_lock(gCollectionMutex);
+  Timer time;
+  CacheStorage* storage = GetStorage(config);
+
+  std::unordered_map<std::string, CacheManifest::Entry> manifest;
+  cache_manifest->ForEachEntry(
+      [&](const std::string& path, const CacheManifest::Entry& entry) {
+        manifest[path] = entry;
+      });
+  std::unordered_map<std::string, std::string> base_to_path;
+  CachePathMapper to_cache(config, CachePathMapper::Direction::ToCache);
+  for (auto& entry : manifest)
+    base_to_path[GetCachedBaseName(to_cache, entry.first)] = entry.first;
+
+  // The manifest only knows every cached file if it was loaded and has an
+  // entry for every project file. It does not if it was missing, invalid or
+  // not saved by the previous run; dependencies then come from the headers.
+  bool manifest_is_complete = cache_manifest->IsLoaded();
+  for (const std::string& path : project_files) {
+    if (!manifest_is_complete)
+      break;
+    manifest_is_complete = manifest.find(path) != manifest.end();
+  }
+
+  // Group the entries by the file they cache.
+  struct CachedFile {
+    std::vector<std::string> entries;
+    std::vector<std::pair<SerializeFormat, std::string>> headers;
+    uint64_t size = 0;
+    int64_t last_write_time = 0;
+  };
+  std::unordered_map<std::string, CachedFile> files;
+  std::unordered_map<std::string, CacheStorage::EntryInfo> blobs;
+  uint64_t total_size = 0;
+  // The storage cannot be read while it is being enumerated.
+  storage->ForEachEntry([&](const CacheStorage::EntryInfo& entry) {
+    total_size += entry.size;
+    if (StartsWith(entry.name, kBlobPrefix)) {
+      blobs[entry.name] = entry;
+      return;
+    }
+
+    // An entry is either the index, the header or (for older caches) the
+    // contents of a file. Prefer a base name which is known to the manifest,
+    // since a source file may itself end in ".json".
+    std::string base_name = entry.name;
+    optional<SerializeFormat> header_format;
+    if (base_to_path.find(entry.name) == base_to_path.end()) {
+      for (SerializeFormat format :
+           {SerializeFormat::Json, SerializeFormat::Binary}) {
+        std::string extension = SerializeFormatExtension(format);
+        std::string header_suffix = ".header" + extension;
+        if (EndsWith(entry.name, header_suffix)) {
+          base_name = entry.name.substr(
+              0, entry.name.size() - header_suffix.size());
+          header_format = format;
+          break;
+        }
+        if (EndsWith(entry.name, extension)) {
+          base_name =
+              entry.name.substr(0, entry.name.size() - extension.size());
+          break;
+        }
+      }
+    }
+
+    CachedFile& file = files[base_name];
+    file.entries.push_back(entry.name);
+    if (header_format)
+      file.headers.emplace_back(*header_format, entry.name);
+    file.size += entry.size;
+    file.last_write_time = std::max(file.last_write_time, entry.write_time);
+  });
+
+  // Count the references to every blob and collect the dependencies of every
+  // file. Headers in both formats are checked, since the cache directory may
+  // be shared with a client that uses a different cacheFormat.
+  std::unordered_map<std::string, int> blob_references;
+  std::unordered_map<std::string, std::vector<std::string>> file_blobs;
+  // Keyed by base name. Only has files whose header could be read.
+  std::unordered_map<std::string, std::vector<std::string>> file_dependencies;
+  CachePathMapper from_cache(config, CachePathMapper::Direction::FromCache);
+  for (auto& file : files) {
+    for (auto& header_name : file.second.headers) {
+      optional<IndexFileHeader> header =
+          LoadHeaderEntry(storage, header_name.first, header_name.second);
+      if (!header)
+        continue;
+      from_cache.Map(&*header);
+      std::vector<std::string>& dependencies = file_dependencies[file.first];
+      dependencies.insert(dependencies.end(), header->dependencies.begin(),
+                          header->dependencies.end());
+      if (!header->contents_blob.empty()) {
+        std::string blob_name = GetBlobName(header->contents_blob);
+        ++blob_references[blob_name];
+        file_blobs[file.first].push_back(blob_name);
+      }
+    }
+  }
+
+  // The project files and everything they depend on are still needed.
+  std::unordered_set<std::string> referenced_base_names;
+  std::vector<std::string> pending = project_files;
+  while (!pending.empty()) {
+    std::string path = std::move(pending.back());
+    pending.pop_back();
+    std::string base_name = GetCachedBaseName(to_cache, path);
+    if (!referenced_base_names.insert(base_name).second)
+      continue;
+    auto it = manifest.find(path);
+    if (it != manifest.end()) {
+      for (const std::string& dependency : it->second.dependencies)
+        pending.push_back(dependency);
+    }
+    auto dependencies = file_dependencies.find(base_name);
+    if (dependencies != file_dependencies.end()) {
+      for (const std::string& dependency : dependencies->second)
+        pending.push_back(dependency);
+    }
+  }
+
+  auto remove_blob = [&](const std::string& blob_name) {
+    auto it = blobs.find(blob_name);
+    if (it == blobs.end() || !storage->Remove(blob_name))
+      return;
+    stats.reclaimed_bytes += it->second.size;
+    total_size -= it->second.size;
+    ++stats.removed_blobs;
+    blobs.erase(it);
+  };
+  auto remove_file = [&](const std::string& base_name, const CachedFile& file) {
+    for (const std::string& name : file.entries)
+      storage->Remove(name);
+    stats.reclaimed_bytes += file.size;
+    total_size -= file.size;
+    for (const std::string& blob_name : file_blobs[base_name]) {
+      if (--blob_references[blob_name] == 0)
+        remove_blob(blob_name);
+    }
+    auto path = base_to_path.find(base_name);
+    if (path != base_to_path.end())
+      cache_manifest->Remove(path->second);
+  };
+
+  // Entries are written before the manifest and project are updated, so
+  // recently written entries are kept even if nothing refers to them yet.
+  const int64_t kMinimumEntryAgeSeconds = 60 * 60;
+
+  // Remove files which the project no longer needs. Skip this if the project
+  // is empty, ie, because the compilation database failed to load.
+  if (!project_files.empty()) {
+    for (auto it = files.begin(); it != files.end();) {
+      bool is_referenced = referenced_base_names.find(it->first) !=
+                           referenced_base_names.end();
+      // Without a complete manifest, a file whose header cannot be read may
+      // still be a dependency of a project file.
+      bool is_known = manifest_is_complete ||
+                      file_dependencies.find(it->first) !=
+                          file_dependencies.end();
+      if (is_referenced || !is_known ||
+          now - it->second.last_write_time < kMinimumEntryAgeSeconds) {
+        ++it;
+        continue;
+      }
+      remove_file(it->first, it->second);
+      ++stats.removed_files;
+      it = files.erase(it);
+    }
+  }
+
+  // Remove blobs which were not referenced to begin with.
+  std::vector<std::string> unreferenced_blobs;
+  for (auto& blob : blobs) {
+    if (blob_references[blob.first] == 0 &&
+        now - blob.second.write_time >= kMinimumEntryAgeSeconds) {
+      unreferenced_blobs.push_back(blob.first);
+    }
+  }
+  for (const std::string& blob_name : unreferenced_blobs)
+    remove_blob(blob_name);
+
+  // Evict the least recently used files until the cache fits in the budget.
+  uint64_t size_limit =
+      static_cast<uint64_t>(std::max(0, config->cacheSizeLimitMb)) * 1024 *
+      1024;
+  if (size_limit > 0 && total_size > size_limit) {
+    std::vector<std::pair<int64_t, std::string>> by_last_use;
+    for (auto& file : files) {
+      int64_t last_used_time = file.second.last_write_time;
+      auto path = base_to_path.find(file.first);
+      if (path != base_to_path.end())
+        last_used_time = std::max(last_used_time,
+                                  manifest[path->second].last_used_time);
+      by_last_use.emplace_back(last_used_time, file.first);
+    }
+    std::sort(by_last_use.begin(), by_last_use.end());
+    for (auto& entry : by_last_use) {
+      if (total_size <= size_limit)
+        break;
+      remove_file(entry.second, files[entry.second]);
+      ++stats.evicted_files;
+    }
+  }
+
+  stats.remaining_bytes = total_size;
+  time.ResetAndPrint(
+      "[perf] Collected cache garbage; removed " +
+      std::to_string(stats.removed_files) + " stale files, evicted " +
+      std::to_string(stats.evicted_files) + " files and removed " +
+      std::to_string(stats.removed_blobs) + " blobs, reclaiming " +
+      std::to_string(stats.reclaimed_bytes / 1024) + " KiB (" +
+      std::to_string(stats.remaining_bytes / 1024) + " KiB remaining)");
+  is_running = false;
+  return stats;
+}
+
+}  // namespace
+
+CacheCollectionStats CollectCacheGarbage(
+    Config* config,
+    CacheManifest* cache_manifest,
+    const std::vector<std::string>& project_files) {
+  return CollectCacheGarbageAt(config, cache_manifest, project_files,
+                               static_cast<int64_t>(std::time(nullptr)));
+}
+
+TEST_SUITE("CachePathMapper") {
+  TEST_CASE("disabled") {
+    Config config;
+    config.projectRoot = "/work/project/";
+    CachePathMapper mapper(&config, CachePathMapper::Direction::ToCache);
+    REQUIRE(!mapper.IsEnabled());
+    REQUIRE(mapper.MapPath("/work/project/a.cc") == "/work/project/a.cc");
+  }
+
+  TEST_CASE("round trip") {
+    Config config;
+    config.enableRelocatableCache = true;
+    config.projectRoot = "/work/project/";
+    config.relocatableCacheRoots = {"/opt/toolchain",
+                                    "/work/project/third_party"};
+    CachePathMapper to_cache(&config, CachePathMapper::Direction::ToCache);
+    REQUIRE(to_cache.MapPath("/work/project/a.cc") == "$root0/a.cc");
+    REQUIRE(to_cache.MapPath("/work/project/third_party/b.h") ==
+            "$root2/b.h");
+    REQUIRE(to_cache.MapPath("/opt/toolchain") == "$root1");
+    REQUIRE(to_cache.MapPath("/work/project2/a.cc") == "/work/project2/a.cc");
+    REQUIRE(to_cache.MapArgument("-I/opt/toolchain/include") ==
+            "-I$root1/include");
+    REQUIRE(to_cache.MapArgument("-DROOT=/work/project") ==
+            "-DROOT=$root0");
+
+    config.projectRoot = "/home/user/checkout/";
+    config.relocatableCacheRoots = {"/usr/local/toolchain",
+                                    "/home/user/checkout/third_party"};
+    CachePathMapper from_cache(&config, CachePathMapper::Direction::FromCache);
+    REQUIRE(from_cache.MapPath("$root0/a.cc") == "/home/user/checkout/a.cc");
+    REQUIRE(from_cache.MapPath("$root2/b.h") ==
+            "/home/user/checkout/third_party/b.h");
+    REQUIRE(from_cache.MapArgument("-I$root1/include") ==
+            "-I/usr/local/toolchain/include");
+  }
+}
+
+TEST_SUITE("CollectCacheGarbage") {
+  TEST_CASE("keeps dependencies without a manifest") {
+    Config config;
+    config.cacheDirectory = GetTemporaryDirectory() + "cquery_cache_gc_test/";
+    config.cacheFormat = SerializeFormat::Binary;
+    MakeDirectoryRecursive(config.cacheDirectory);
+
+    auto write = [&](const std::string& path,
+                     const std::vector<std::string>& dependencies) {
+      IndexFile file(path);
+      file.file_contents_ = "// " + path;
+      file.content_hash = HashContent(file.file_contents_);
+      file.dependencies = dependencies;
+      REQUIRE(WriteToCache(&config, file) == CacheWriteResult::Written);
+    };
+    write("/project/a.cc", {"/project/a.h"});
+    write("/project/a.h", {});
+
+    // The manifest was not loaded, ie, it was missing, or the previous run
+    // exited before saving it. Every entry is older than the minimum age.
+    CacheManifest manifest(&config);
+    const std::vector<std::string> project_files = {"/project/a.cc"};
+    int64_t tomorrow = static_cast<int64_t>(std::time(nullptr)) + 24 * 60 * 60;
+    CacheCollectionStats stats =
+        CollectCacheGarbageAt(&config, &manifest, project_files, tomorrow);
+    REQUIRE(stats.removed_files == 0);
+    REQUIRE(stats.removed_blobs == 0);
+    REQUIRE(LoadCachedIndexHeader(&config, "/project/a.cc"));
+    REQUIRE(LoadCachedIndexHeader(&config, "/project/a.h"));
+    REQUIRE(LoadCachedFileContents(&config, "/project/a.h"));
+
+    // Files which no project file depends on are still removed.
+    write("/project/removed.cc", {});
+    stats = CollectCacheGarbageAt(&config, &manifest, project_files, tomorrow);
+    REQUIRE(stats.removed_files == 1);
+    REQUIRE(stats.removed_blobs == 1);
+    REQUIRE(!LoadCachedIndexHeader(&config, "/project/removed.cc"));
+    REQUIRE(LoadCachedIndexHeader(&config, "/project/a.h"));
+
+    GetFilesInFolder(config.cacheDirectory, true /*recursive*/,
+                     true /*add_folder_to_path*/,
+                     [](const std::string& path) {
+                       std::remove(path.c_str());
+                     });
+    std::remove((config.cacheDirectory + "@blobs").c_str());
+    std::remove(config.cacheDirectory.c_str());
+  }
 }
@@ -1,19 +1,123 @@
 #pragma once
 
+#include "serializer.h"
+
 #include <optional.h>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 using std::experimental::nullopt;
 using std::experimental::optional;
 
+struct CacheManifest;
 struct Config;
 struct IndexFile;
 
+// The subset of an IndexFile that is needed to decide if a file has to be
+// reindexed. This is stored next to the full index so it can be loaded without
+// deserializing any symbols.
+struct IndexFileHeader {
+  int version = 0;
+  int64_t last_modification_time = 0;
+  uint64_t content_hash = 0;
+  // Hash of the serialized index. Used to skip rewriting an index that has
+  // not changed. 0 if unknown.
+  uint64_t index_hash = 0;
+  // Id of the blob which holds the file contents. Empty if the contents were
+  // not cached.
+  std::string contents_blob;
+  std::string import_file;
+  std::vector<std::string> dependencies;
+
+  IndexFileHeader() {}  // For serialization.
+  explicit IndexFileHeader(const IndexFile& file);
+};
+MAKE_REFLECT_STRUCT(IndexFileHeader,
+                    version,
+                    last_modification_time,
+                    content_hash,
+                    index_hash,
+                    contents_blob,
+                    import_file,
+                    dependencies);
+
+// Rewrites the paths stored in the cache between their absolute form and the
+// form stored in a relocatable cache (Config::enableRelocatableCache), where
+// every root is replaced by a placeholder: "$root0" for the project root,
+// "$root1" for the first entry of Config::relocatableCacheRoots, and so on.
+// Every mapping is the identity if the cache is not relocatable.
+struct CachePathMapper {
+  enum class Direction { ToCache, FromCache };
+
+  CachePathMapper(Config* config, Direction direction);
+
+  bool IsEnabled() const { return !replacements_.empty(); }
+
+  std::string MapPath(const std::string& path) const;
+  // Compiler arguments may embed a path anywhere, ie, "-I/project/include".
+  std::string MapArgument(std::string argument) const;
+  void Map(IndexFile* file) const;
+  void Map(IndexFileHeader* header) const;
+
+ private:
+  // Returns true if |prefix| occurs at |offset| in |value| and is followed by
+  // a path separator or the end of |value|.
+  static bool IsComponentAt(const std::string& value,
+                            size_t offset,
+                            const std::string& prefix);
+
+  // Pairs of (from, to), longest first.
+  std::vector<std::pair<std::string, std::string>> replacements_;
+};
+
 std::unique_ptr<IndexFile> LoadCachedIndex(Config* config,
                                            const std::string& filename);
 
+// Loads only the header for the cached index of |filename|. Falls back to
+// loading the full index if the header is missing (ie, caches written by an
+// older version).
+optional<IndexFileHeader> LoadCachedIndexHeader(Config* config,
+                                                const std::string& filename);
+
 optional<std::string> LoadCachedFileContents(Config* config,
                                              const std::string& filename);
 
-void WriteToCache(Config* config, IndexFile& file);
\ No newline at end of file
+enum class CacheWriteResult {
+  Written,
+  // The cache already contains an identical index and file contents.
+  Unchanged,
+  // The cache is disabled or could not be written.
+  Failed
+};
+
+CacheWriteResult WriteToCache(Config* config, IndexFile& file);
+
+// Persists cache state which is buffered in memory, ie, the index of the
+// packed cache. Call this when idle and before exiting.
+void FlushCache(Config* config);
+
+struct CacheCollectionStats {
+  // Files removed because the project no longer needs them.
+  int removed_files = 0;
+  // Files removed to fit the cache in Config::cacheSizeLimitMb.
+  int evicted_files = 0;
+  // Content blobs which are no longer referenced by any file.
+  int removed_blobs = 0;
+  uint64_t reclaimed_bytes = 0;
+  uint64_t remaining_bytes = 0;
+};
+
+// Removes the caches of files which are neither in |project_files| nor a
+// dependency of one, and content blobs which are no longer referenced.
+// Dependencies are taken from |cache_manifest| and from the cached headers; a
+// file is only considered unneeded if one of them knows about it. Then,
+// if the cache is larger than Config::cacheSizeLimitMb, evicts the least
+// recently used files until it fits. This reads the header of every cached
+// index, so it should be run on a background thread.
+CacheCollectionStats CollectCacheGarbage(
+    Config* config,
+    CacheManifest* cache_manifest,
+    const std::vector<std::string>& project_files);
@@ -0,0 +1,260 @@
+#include "cache_manifest.h"
+
+#include "cache.h"
+#include "config.h"
+#include "indexer.h"
+#include "platform.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <loguru/loguru.hpp>
+
+#include <ctime>
+
+namespace {
+
+// Bump this when the manifest layout changes.
+const int kManifestVersion = 2;
+
+// Last used times are only this precise, so that reading a cache does not
+// cause the manifest to be saved every time.
+const int64_t kLastUsedResolutionSeconds = 60 * 60;
+
+struct ManifestFile {
+  int version = 0;
+  std::vector<CacheManifest::Entry> entries;
+};
+MAKE_REFLECT_STRUCT(ManifestFile, version, entries);
+
+void MapPaths(const CachePathMapper& mapper, CacheManifest::Entry* entry) {
+  if (!mapper.IsEnabled())
+    return;
+  entry->path = mapper.MapPath(entry->path);
+  entry->import_file = mapper.MapPath(entry->import_file);
+  for (std::string& dependency : entry->dependencies)
+    dependency = mapper.MapPath(dependency);
+}
+
+std::string GetManifestFileName(Config* config) {
+  return config->cacheDirectory + "@manifest" +
+         SerializeFormatExtension(config->cacheFormat);
+}
+
+}  // namespace
+
+CacheManifest::CacheManifest(Config* config) : config_(config) {}
+
+bool CacheManifest::Load() {
+  if (!config_->enableCacheRead)
+    return false;
+
+  Timer timer;
+  std::unique_ptr<PlatformMappedFile> content =
+      CreatePlatformMappedFile(GetManifestFileName(config_));
+  if (!content)
+    return false;
+
+  ManifestFile file;
+  if (!DeserializeValue(config_->cacheFormat, content->data, content->size,
+                        kManifestVersion, &file) ||
+      file.version != kManifestVersion) {
+    LOG_S(WARNING) << "Ignoring invalid cache manifest "
+                   << GetManifestFileName(config_);
+    return false;
+  }
+
+  CachePathMapper from_cache(config_, CachePathMapper::Direction::FromCache);
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  entries_.reserve(file.entries.size());
+  for (Entry& entry : file.entries) {
+    MapPaths(from_cache, &entry);
+    std::string path = entry.path;
+    entries_[path] = std::move(entry);
+  }
+  is_dirty_ = false;
+  is_loaded_ = true;
+  timer.ResetAndPrint("[perf] Loaded cache manifest (" +
+                      std::to_string(entries_.size()) + " files)");
+  return true;
+}
+
+void CacheManifest::Save() {
+  if (!config_->enableCacheWrite || config_->cacheDirectory.empty())
+    return;
+
+  ManifestFile file;
+  file.version = kManifestVersion;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!is_dirty_)
+      return;
+    is_dirty_ = false;
+    file.entries.reserve(entries_.size());
+    for (const auto& entry : entries_)
+      file.entries.push_back(entry.second);
+  }
+  CachePathMapper to_cache(config_, CachePathMapper::Direction::ToCache);
+  for (Entry& entry : file.entries)
+    MapPaths(to_cache, &entry);
+
+  Timer timer;
+  std::string content =
+      SerializeValue(config_->cacheFormat, kManifestVersion, file);
+  // A manifest cut short by a crash would make the next startup reindex the
+  // whole project, so never overwrite it in place.
+  if (!WriteFileAtomically(GetManifestFileName(config_), content)) {
+    LOG_S(ERROR) << "Unable to write cache manifest "
+                 << GetManifestFileName(config_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_dirty_ = true;
+    return;
+  }
+  timer.ResetAndPrint("[perf] Saved cache manifest (" +
+                      std::to_string(file.entries.size()) + " files)");
+}
+
+bool CacheManifest::IsLoaded() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return is_loaded_;
+}
+
+void CacheManifest::Update(const IndexFile& file) {
+  Entry entry;
+  entry.path = file.path;
+  entry.last_modification_time = file.last_modification_time;
+  entry.content_hash = file.content_hash;
+  entry.import_file = file.import_file;
+  entry.dependencies = file.dependencies;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& existing = entries_[file.path];
+  // Rewriting an unchanged file should not cause the manifest to be saved.
+  if (existing.path == entry.path &&
+      existing.last_modification_time == entry.last_modification_time &&
+      existing.content_hash == entry.content_hash &&
+      existing.import_file == entry.import_file &&
+      existing.dependencies == entry.dependencies) {
+    MarkUsedLocked(&existing);
+    return;
+  }
+  existing = std::move(entry);
+  existing.last_used_time = static_cast<int64_t>(std::time(nullptr));
+  is_dirty_ = true;
+}
+
+void CacheManifest::MarkUsed(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(path);
+  if (it != entries_.end())
+    MarkUsedLocked(&it->second);
+}
+
+void CacheManifest::Remove(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entries_.erase(path))
+    is_dirty_ = true;
+}
+
+optional<CacheManifest::Entry> CacheManifest::Find(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(path);
+  if (it == entries_.end())
+    return nullopt;
+  return it->second;
+}
+
+void CacheManifest::ForEachEntry(
+    const std::function<void(const std::string& path, const Entry& entry)>&
+        action) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& entry : entries_)
+    action(entry.first, entry.second);
+}
+
+bool CacheManifest::IsClean(const std::string& path, ScanCache* scan_cache) {
+  // Snapshot what is recorded for |path| and its dependencies, then stat and
+  // hash the files without holding |mutex_|; hashing a large header can take
+  // a while and the indexers update the manifest concurrently.
+  std::vector<FileState> files;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(path);
+    if (it == entries_.end())
+      return false;
+    files.push_back(GetFileStateLocked(path));
+    for (const std::string& dependency : it->second.dependencies)
+      files.push_back(GetFileStateLocked(dependency));
+  }
+
+  std::vector<FileState> touched;
+  bool is_clean = true;
+  for (const FileState& file : files) {
+    if (!IsFileClean(file, scan_cache, &touched)) {
+      is_clean = false;
+      break;
+    }
+  }
+
+  if (!touched.empty()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const FileState& file : touched) {
+      auto it = entries_.find(file.path);
+      // Skip entries which were rewritten while the file was being hashed.
+      if (it == entries_.end() || it->second.content_hash != file.content_hash)
+        continue;
+      it->second.last_modification_time = file.last_modification_time;
+      is_dirty_ = true;
+    }
+  }
+  return is_clean;
+}
+
+CacheManifest::FileState CacheManifest::GetFileStateLocked(
+    const std::string& path) const {
+  FileState state;
+  state.path = path;
+  auto it = entries_.find(path);
+  if (it != entries_.end()) {
+    state.has_entry = true;
+    state.last_modification_time = it->second.last_modification_time;
+    state.content_hash = it->second.content_hash;
+  }
+  return state;
+}
+
+// static
+bool CacheManifest::IsFileClean(const FileState& file,
+                                ScanCache* scan_cache,
+                                std::vector<FileState>* touched) {
+  auto cached = scan_cache->find(file.path);
+  if (cached != scan_cache->end())
+    return cached->second;
+
+  bool is_clean = false;
+  optional<int64_t> modification_time = GetLastModificationTime(file.path);
+  if (file.has_entry && modification_time) {
+    if (*modification_time == file.last_modification_time) {
+      is_clean = true;
+    } else if (file.content_hash != 0 &&
+               HashFileContent(file.path) == file.content_hash) {
+      // Only the timestamp changed, ie, a checkout that restored the same
+      // contents. Record the new timestamp so the file is not hashed again.
+      FileState updated = file;
+      updated.last_modification_time = *modification_time;
+      touched->push_back(updated);
+      is_clean = true;
+    }
+  }
+
+  (*scan_cache)[file.path] = is_clean;
+  return is_clean;
+}
+
+void CacheManifest::MarkUsedLocked(Entry* entry) {
+  int64_t now = static_cast<int64_t>(std::time(nullptr));
+  if (now - entry->last_used_time < kLastUsedResolutionSeconds)
+    return;
+  entry->last_used_time = now;
+  is_dirty_ = true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "serializer.h"
+
+#include <optional.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::experimental::nullopt;
+using std::experimental::optional;
+
+struct Config;
+struct IndexFile;
+
+// Project-wide summary of the cache directory. For every cached file it stores
+// the state needed to decide if the file is out of date, so that on startup
+// the set of files that need to be reindexed can be computed without opening
+// any of the per-file caches.
+//
+// The manifest is updated from the indexer threads whenever a file is written
+// to the cache and is saved to disk by the querydb thread when idle.
+struct CacheManifest {
+  struct Entry {
+    std::string path;
+    int64_t last_modification_time = 0;
+    // Hash of the file contents at the time it was indexed. 0 if unknown.
+    uint64_t content_hash = 0;
+    std::string import_file;
+    std::vector<std::string> dependencies;
+    // Seconds since the epoch at which the cache of this file was last read or
+    // written. Used to evict the least recently used files.
+    int64_t last_used_time = 0;
+  };
+
+  // Per-file results of IsClean for a single scan, so that headers shared by
+  // many translation units are only checked (and hashed) once.
+  using ScanCache = std::unordered_map<std::string, bool>;
+
+  explicit CacheManifest(Config* config);
+
+  // Loads the manifest from the cache directory, replacing any existing
+  // entries. Returns false if there is no usable manifest.
+  bool Load();
+  // Writes the manifest to the cache directory if it has changed since it was
+  // last loaded or saved.
+  void Save();
+  // Returns true if the manifest was read from the cache directory. If not, it
+  // only knows about the files written since startup.
+  bool IsLoaded();
+
+  // Records that |file| has been written to the cache.
+  void Update(const IndexFile& file);
+  // Records that the cache of |path| has been read.
+  void MarkUsed(const std::string& path);
+  // Forgets |path|, ie, after its cache has been removed.
+  void Remove(const std::string& path);
+
+  optional<Entry> Find(const std::string& path);
+  void ForEachEntry(
+      const std::function<void(const std::string& path, const Entry& entry)>&
+          action);
+
+  // Returns true if |path| and every dependency recorded for it are unchanged
+  // on disk since they were last written to the cache. A file whose timestamp
+  // changed is still clean if its contents hash to the recorded value; the
+  // recorded timestamp is then updated so the file is not hashed again.
+  bool IsClean(const std::string& path, ScanCache* scan_cache);
+
+ private:
+  // What the manifest records for a single file, copied out so the file can
+  // be checked without holding |mutex_|.
+  struct FileState {
+    std::string path;
+    bool has_entry = false;
+    int64_t last_modification_time = 0;
+    uint64_t content_hash = 0;
+  };
+
+  FileState GetFileStateLocked(const std::string& path) const;
+  // Appends |file| with its new timestamp to |touched| if only its timestamp
+  // changed.
+  static bool IsFileClean(const FileState& file,
+                          ScanCache* scan_cache,
+                          std::vector<FileState>* touched);
+  void MarkUsedLocked(Entry* entry);
+
+  Config* config_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  bool is_dirty_ = false;
+  bool is_loaded_ = false;
+};
+MAKE_REFLECT_STRUCT(CacheManifest::Entry,
+                    path,
+                    last_modification_time,
+                    content_hash,
+                    import_file,
+                    dependencies,
+                    last_used_time);
@@ -0,0 +1,672 @@
+#include "cache_storage.h"
+
+#include "config.h"
+#include "platform.h"
+#include "serializer.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru/loguru.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+int64_t GetCurrentTime() {
+  return static_cast<int64_t>(std::time(nullptr));
+}
+
+struct FileCacheStorage : public CacheStorage {
+  explicit FileCacheStorage(const std::string& directory)
+      : directory_(directory) {}
+
+  std::unique_ptr<PlatformMappedFile> Read(const std::string& name) override {
+    return CreatePlatformMappedFile(directory_ + name);
+  }
+
+  bool Exists(const std::string& name) override {
+    return static_cast<bool>(GetLastModificationTime(directory_ + name));
+  }
+
+  bool Write(const std::string& name, const std::string& content) override {
+    // Entries such as "@blobs/<id>" live in a subdirectory.
+    size_t slash = name.find_last_of('/');
+    if (slash != std::string::npos)
+      TryMakeDirectory(directory_ + name.substr(0, slash));
+    return WriteFileAtomically(directory_ + name, content);
+  }
+
+  bool Remove(const std::string& name) override {
+    return std::remove((directory_ + name).c_str()) == 0;
+  }
+
+  void ForEachEntry(
+      const std::function<void(const EntryInfo&)>& action) override {
+    GetFilesInFolder(
+        directory_, true /*recursive*/, false /*add_folder_to_path*/,
+        [&](const std::string& name) {
+          // Skip cache metadata (ie, the manifest) and interrupted writes.
+          if ((StartsWith(name, "@") && !StartsWith(name, "@blobs/")) ||
+              EndsWith(name, ".tmp")) {
+            return;
+          }
+          std::string path = directory_ + name;
+          optional<int64_t> write_time = GetLastModificationTime(path);
+          if (!write_time)
+            return;
+
+          EntryInfo info;
+          info.name = name;
+          info.write_time = *write_time;
+          std::ifstream input(path, std::ios::binary | std::ios::ate);
+          std::streamoff size = input.tellg();
+          if (size > 0)
+            info.size = static_cast<uint64_t>(size);
+          action(info);
+        });
+  }
+
+  std::string directory_;
+};
+
+// The pack is a sequence of records. Each record is a PackRecordHeader
+// followed by the entry name and then the entry content. An entry is replaced
+// by appending a new record with the same name, and removed by appending a
+// record whose |content_size| is kRemovedEntry.
+//
+// The pack index maps every name to the content of its newest record. It is
+// only rewritten on Flush; records appended since then are recovered by
+// scanning the end of the pack on startup.
+const char kPackMagic[4] = {'C', 'Q', 'P', 'K'};
+const uint64_t kRemovedEntry = std::numeric_limits<uint64_t>::max();
+const uint32_t kMaxNameSize = 4096;
+const int kPackIndexVersion = 1;
+// The pack is compacted once it is larger than this and more than half of it
+// is taken up by replaced or removed records.
+const uint64_t kMinCompactionSize = 64 * 1024 * 1024;
+
+struct PackRecordHeader {
+  char magic[4];
+  uint32_t name_size;
+  uint64_t content_size;
+  int64_t write_time;
+};
+
+struct PackIndexEntry {
+  std::string name;
+  // Offset of the content in the pack.
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  int64_t write_time = 0;
+};
+MAKE_REFLECT_STRUCT(PackIndexEntry, name, offset, size, write_time);
+
+struct PackIndex {
+  // Compaction writes a new pack, so packs are numbered.
+  int generation = 0;
+  // Number of bytes at the start of the pack which are described by
+  // |entries|.
+  uint64_t indexed_size = 0;
+  std::vector<PackIndexEntry> entries;
+};
+MAKE_REFLECT_STRUCT(PackIndex, generation, indexed_size, entries);
+
+// A view of a single entry. Keeps the mapping of the pack alive, since the
+// storage remaps the pack as it grows.
+struct PackEntryView : public PlatformMappedFile {
+  std::shared_ptr<PlatformMappedFile> pack;
+};
+
+struct PackCacheStorage : public CacheStorage {
+  // |min_compaction_size| is only lowered by tests.
+  explicit PackCacheStorage(const std::string& directory,
+                            uint64_t min_compaction_size = kMinCompactionSize)
+      : directory_(directory), min_compaction_size_(min_compaction_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LoadLocked();
+  }
+
+  std::unique_ptr<PlatformMappedFile> Read(const std::string& name) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(name);
+    if (it == entries_.end() ||
+        !EnsureMappedLocked(it->second.offset + it->second.size)) {
+      return nullptr;
+    }
+
+    auto view = MakeUnique<PackEntryView>();
+    view->pack = mapping_;
+    view->data = mapping_->data + it->second.offset;
+    view->size = static_cast<size_t>(it->second.size);
+    return std::move(view);
+  }
+
+  bool Exists(const std::string& name) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.find(name) != entries_.end();
+  }
+
+  bool Write(const std::string& name, const std::string& content) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      int64_t write_time = GetCurrentTime();
+      optional<uint64_t> offset =
+          AppendLocked(name, content.data(), content.size(), write_time);
+      if (!offset)
+        return false;
+
+      RemoveEntryLocked(name);
+      Entry& entry = entries_[name];
+      entry.offset = *offset;
+      entry.size = content.size();
+      entry.write_time = write_time;
+      live_size_ += GetRecordSize(name, entry.size);
+    }
+
+    CompactIfNeeded();
+    return true;
+  }
+
+  bool Remove(const std::string& name) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (entries_.find(name) == entries_.end() ||
+          !AppendLocked(name, nullptr, kRemovedEntry, GetCurrentTime())) {
+        return false;
+      }
+      RemoveEntryLocked(name);
+    }
+
+    CompactIfNeeded();
+    return true;
+  }
+
+  void ForEachEntry(
+      const std::function<void(const EntryInfo&)>& action) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EntryInfo info;
+    for (auto& entry : entries_) {
+      info.name = entry.first;
+      info.size = entry.second.size;
+      info.write_time = entry.second.write_time;
+      action(info);
+    }
+  }
+
+  void Flush() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_dirty_)
+      SaveIndexLocked();
+  }
+
+ private:
+  struct Entry {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    int64_t write_time = 0;
+  };
+
+  static uint64_t GetRecordSize(const std::string& name,
+                                uint64_t content_size) {
+    if (content_size == kRemovedEntry)
+      content_size = 0;
+    return sizeof(PackRecordHeader) + name.size() + content_size;
+  }
+
+  std::string GetPackFileName(int generation) const {
+    return directory_ + "@pack." + std::to_string(generation) + ".data";
+  }
+  std::string GetIndexFileName() const { return directory_ + "@pack.index"; }
+
+  void LoadLocked() {
+    Timer time;
+
+    PackIndex index;
+    optional<std::string> index_content = ReadContent(GetIndexFileName());
+    bool has_index =
+        index_content &&
+        DeserializeValue(SerializeFormat::Binary, index_content->data(),
+                         index_content->size(), kPackIndexVersion, &index);
+    generation_ = has_index ? index.generation : 0;
+
+    mapping_ = CreatePlatformMappedFile(GetPackFileName(generation_));
+    uint64_t mapped_size = mapping_ ? mapping_->size : 0;
+    uint64_t scan_from = 0;
+    if (has_index && index.indexed_size <= mapped_size) {
+      for (PackIndexEntry& indexed : index.entries) {
+        if (indexed.offset + indexed.size > index.indexed_size)
+          continue;
+        Entry& entry = entries_[indexed.name];
+        entry.offset = indexed.offset;
+        entry.size = indexed.size;
+        entry.write_time = indexed.write_time;
+        live_size_ += GetRecordSize(indexed.name, indexed.size);
+      }
+      scan_from = index.indexed_size;
+    } else if (has_index) {
+      LOG_S(WARNING) << "Cache pack index does not match "
+                     << GetPackFileName(generation_) << "; rescanning it";
+    }
+
+    pack_size_ = ScanLocked(scan_from);
+    index_dirty_ = !has_index || pack_size_ != scan_from;
+    if (pack_size_ != mapped_size) {
+      LOG_S(WARNING) << "Ignoring " << (mapped_size - pack_size_)
+                     << " bytes of incomplete records at the end of "
+                     << GetPackFileName(generation_);
+    }
+    RemoveStalePacksLocked();
+
+    time.ResetAndPrint("[perf] Loaded cache pack (" +
+                       std::to_string(entries_.size()) + " entries, " +
+                       std::to_string(pack_size_) + " bytes)");
+  }
+
+  // Applies every record from |offset| to the end of the pack to |entries_|.
+  // Returns the end of the last complete record.
+  uint64_t ScanLocked(uint64_t offset) {
+    if (!mapping_)
+      return 0;
+
+    const char* data = mapping_->data;
+    uint64_t size = mapping_->size;
+    while (size - offset >= sizeof(PackRecordHeader)) {
+      PackRecordHeader header;
+      memcpy(&header, data + offset, sizeof(header));
+      if (memcmp(header.magic, kPackMagic, sizeof(kPackMagic)) != 0 ||
+          header.name_size > kMaxNameSize) {
+        break;
+      }
+      uint64_t name_offset = offset + sizeof(header);
+      uint64_t content_offset = name_offset + header.name_size;
+      if (content_offset > size)
+        break;
+      bool removed = header.content_size == kRemovedEntry;
+      if (!removed && header.content_size > size - content_offset)
+        break;
+
+      std::string name(data + name_offset, header.name_size);
+      RemoveEntryLocked(name);
+      if (!removed) {
+        Entry& entry = entries_[name];
+        entry.offset = content_offset;
+        entry.size = header.content_size;
+        entry.write_time = header.write_time;
+        live_size_ += GetRecordSize(name, entry.size);
+      }
+      offset = content_offset + (removed ? 0 : header.content_size);
+    }
+    return offset;
+  }
+
+  void RemoveEntryLocked(const std::string& name) {
+    auto it = entries_.find(name);
+    if (it == entries_.end())
+      return;
+    live_size_ -= GetRecordSize(name, it->second.size);
+    entries_.erase(it);
+  }
+
+  // Maps the pack again if the current mapping ends before |end|.
+  bool EnsureMappedLocked(uint64_t end) {
+    if (mapping_ && mapping_->size >= end)
+      return true;
+    if (output_.is_open())
+      output_.flush();
+    mapping_ = CreatePlatformMappedFile(GetPackFileName(generation_));
+    return mapping_ && mapping_->size >= end;
+  }
+
+  // Appends a record to the pack. Returns the offset of the record content,
+  // or nullopt if the write failed.
+  optional<uint64_t> AppendLocked(const std::string& name,
+                                  const char* content,
+                                  uint64_t content_size,
+                                  int64_t write_time) {
+    if (name.size() > kMaxNameSize) {
+      LOG_S(ERROR) << "Cache entry name is too long: " << name;
+      return nullopt;
+    }
+
+    if (!output_.is_open()) {
+      std::string path = GetPackFileName(generation_);
+      // fstream does not create files when opened for reading and writing.
+      if (!GetLastModificationTime(path))
+        std::ofstream(path, std::ios::out | std::ios::binary);
+      output_.open(path, std::ios::in | std::ios::out | std::ios::binary);
+      // Overwrite any incomplete record at the end of the pack.
+      output_.seekp(static_cast<std::streamoff>(pack_size_));
+    }
+
+    PackRecordHeader header;
+    memcpy(header.magic, kPackMagic, sizeof(kPackMagic));
+    header.name_size = static_cast<uint32_t>(name.size());
+    header.content_size = content_size;
+    header.write_time = write_time;
+    output_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output_.write(name.data(), name.size());
+    if (content_size != kRemovedEntry)
+      output_.write(content, static_cast<std::streamsize>(content_size));
+    output_.flush();
+    if (!output_.good()) {
+      LOG_S(ERROR) << "Unable to append to cache pack "
+                   << GetPackFileName(generation_);
+      // Reopen on the next write, which then overwrites this record.
+      output_.close();
+      output_.clear();
+      return nullopt;
+    }
+
+    uint64_t content_offset = pack_size_ + sizeof(header) + name.size();
+    pack_size_ += GetRecordSize(name, content_size);
+    index_dirty_ = true;
+    return content_offset;
+  }
+
+  bool SaveIndexLocked() {
+    PackIndex index;
+    index.generation = generation_;
+    index.indexed_size = pack_size_;
+    index.entries.reserve(entries_.size());
+    for (auto& entry : entries_) {
+      PackIndexEntry indexed;
+      indexed.name = entry.first;
+      indexed.offset = entry.second.offset;
+      indexed.size = entry.second.size;
+      indexed.write_time = entry.second.write_time;
+      index.entries.push_back(indexed);
+    }
+
+    std::string content =
+        SerializeValue(SerializeFormat::Binary, kPackIndexVersion, index);
+    if (!WriteFileAtomically(GetIndexFileName(), content))
+      return false;
+    index_dirty_ = false;
+    return true;
+  }
+
+  // Copies every live entry into a new pack and switches to it once more
+  // than half of the pack is garbage. The copy is made without holding
+  // |mutex_|, so reads and writes are not blocked while tens of megabytes are
+  // copied; records appended meanwhile are carried over when switching.
+  void CompactIfNeeded() {
+    Timer time;
+    std::unordered_map<std::string, Entry> entries;
+    std::shared_ptr<PlatformMappedFile> mapping;
+    uint64_t copied_size = 0;
+    int new_generation = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (is_compacting_ || pack_size_ < min_compaction_size_ ||
+          pack_size_ - live_size_ <= pack_size_ / 2 ||
+          !EnsureMappedLocked(pack_size_)) {
+        return;
+      }
+      is_compacting_ = true;
+      entries = entries_;
+      // Records before |copied_size| are never rewritten, so the mapping can
+      // be read while other threads keep appending to the pack.
+      mapping = mapping_;
+      copied_size = pack_size_;
+      new_generation = generation_ + 1;
+    }
+
+    std::string new_path = GetPackFileName(new_generation);
+    std::unordered_map<std::string, Entry> new_entries;
+    uint64_t new_size = 0;
+    bool copied = WritePack(new_path, entries, mapping->data, &new_entries,
+                            &new_size);
+    mapping.reset();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_compacting_ = false;
+    if (!copied || !EnsureMappedLocked(pack_size_) ||
+        !AppendTail(new_path, mapping_->data + copied_size,
+                    pack_size_ - copied_size)) {
+      LOG_S(ERROR) << "Unable to compact cache pack into " << new_path;
+      std::remove(new_path.c_str());
+      return;
+    }
+    uint64_t tail_size = pack_size_ - copied_size;
+    std::shared_ptr<PlatformMappedFile> new_mapping =
+        CreatePlatformMappedFile(new_path);
+    if ((new_mapping ? new_mapping->size : 0) != new_size + tail_size) {
+      LOG_S(ERROR) << "Unable to map compacted cache pack " << new_path;
+      std::remove(new_path.c_str());
+      return;
+    }
+
+    std::string old_path = GetPackFileName(generation_);
+    uint64_t old_size = pack_size_;
+    output_.close();
+    output_.clear();
+    // Readers may still hold views into the old mapping; they keep it alive.
+    mapping_ = std::move(new_mapping);
+    generation_ = new_generation;
+    entries_ = std::move(new_entries);
+    live_size_ = new_size;
+    pack_size_ = ScanLocked(new_size);
+
+    // The old pack is only removed once the index refers to the new one. If
+    // it is still mapped (ie, on Windows) it is removed on the next startup.
+    if (SaveIndexLocked())
+      std::remove(old_path.c_str());
+    time.ResetAndPrint("[perf] Compacted cache pack from " +
+                       std::to_string(old_size) + " to " +
+                       std::to_string(pack_size_) + " bytes");
+  }
+
+  // Writes a record for each of |entries|, whose contents are in |data|, to a
+  // new pack at |path|. |new_entries| receives their offsets in the new pack.
+  static bool WritePack(const std::string& path,
+                        const std::unordered_map<std::string, Entry>& entries,
+                        const char* data,
+                        std::unordered_map<std::string, Entry>* new_entries,
+                        uint64_t* new_size) {
+    std::ofstream output(path,
+                         std::ios::out | std::ios::binary | std::ios::trunc);
+    for (auto& entry : entries) {
+      const std::string& name = entry.first;
+      PackRecordHeader header;
+      memcpy(header.magic, kPackMagic, sizeof(kPackMagic));
+      header.name_size = static_cast<uint32_t>(name.size());
+      header.content_size = entry.second.size;
+      header.write_time = entry.second.write_time;
+      output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      output.write(name.data(), name.size());
+      output.write(data + entry.second.offset,
+                   static_cast<std::streamsize>(entry.second.size));
+
+      Entry& new_entry = (*new_entries)[name];
+      new_entry = entry.second;
+      new_entry.offset = *new_size + sizeof(header) + name.size();
+      *new_size += GetRecordSize(name, entry.second.size);
+    }
+    output.flush();
+    return output.good();
+  }
+
+  // Appends the records written to the old pack during a compaction to the
+  // new pack at |path|.
+  static bool AppendTail(const std::string& path,
+                         const char* data,
+                         uint64_t size) {
+    if (size == 0)
+      return true;
+    std::ofstream output(path, std::ios::out | std::ios::binary |
+                                   std::ios::app);
+    output.write(data, static_cast<std::streamsize>(size));
+    output.flush();
+    return output.good();
+  }
+
+  // Removes packs left behind by an interrupted compaction.
+  void RemoveStalePacksLocked() {
+    std::string current = GetPackFileName(generation_);
+    GetFilesInFolder(directory_, false /*recursive*/,
+                     true /*add_folder_to_path*/, [&](const std::string& path) {
+                       if (path != current &&
+                           StartsWith(path, directory_ + "@pack.") &&
+                           EndsWith(path, ".data")) {
+                         std::remove(path.c_str());
+                       }
+                     });
+  }
+
+  std::string directory_;
+  const uint64_t min_compaction_size_;
+
+  std::mutex mutex_;
+  int generation_ = 0;
+  std::unordered_map<std::string, Entry> entries_;
+  // End of the last complete record in the pack.
+  uint64_t pack_size_ = 0;
+  // Size of the records of every entry in |entries_|.
+  uint64_t live_size_ = 0;
+  // True if |entries_| has changed since the index was written.
+  bool index_dirty_ = false;
+  // True while a thread is copying the pack in CompactIfNeeded.
+  bool is_compacting_ = false;
+  std::shared_ptr<PlatformMappedFile> mapping_;
+  std::fstream output_;
+};
+
+}  // namespace
+
+CacheStorage* GetCacheStorage(Config* config) {
+  static std::mutex mutex;
+  // Never destroyed, so that writes racing with exit() do not touch a
+  // destroyed storage.
+  static auto* storages =
+      new std::unordered_map<std::string, std::unique_ptr<CacheStorage>>();
+
+  std::string key = std::string(config->enablePackedCache ? "pack:" : "file:") +
+                    config->cacheDirectory;
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<CacheStorage>& storage = (*storages)[key];
+  if (!storage) {
+    if (config->enablePackedCache)
+      storage = MakePackCacheStorage(config->cacheDirectory);
+    else
+      storage = MakeFileCacheStorage(config->cacheDirectory);
+  }
+  return storage.get();
+}
+
+std::unique_ptr<CacheStorage> MakeFileCacheStorage(
+    const std::string& directory) {
+  return MakeUnique<FileCacheStorage>(directory);
+}
+
+std::unique_ptr<CacheStorage> MakePackCacheStorage(
+    const std::string& directory) {
+  return MakeUnique<PackCacheStorage>(directory);
+}
+
+TEST_SUITE("CacheStorage") {
+  TEST_CASE("concurrent writes of the same entry") {
+    const std::string directory = "cache_storage_test/";
+    TryMakeDirectory(directory);
+    std::unique_ptr<CacheStorage> storage = MakeFileCacheStorage(directory);
+
+    // Blobs are shared by files with the same contents, so several threads
+    // can write one at the same time. Each write must land whole.
+    const std::string name = "@blobs/shared";
+    const std::string a(1 << 20, 'a');
+    const std::string b(1 << 20, 'b');
+    std::atomic<int> failed_writes(0);
+    std::vector<std::thread> threads;
+    for (const std::string* content : {&a, &b}) {
+      threads.emplace_back([&, content]() {
+        for (int i = 0; i < 20; ++i) {
+          if (!storage->Write(name, *content))
+            ++failed_writes;
+        }
+      });
+    }
+    for (std::thread& thread : threads)
+      thread.join();
+    REQUIRE(failed_writes == 0);
+
+    std::unique_ptr<PlatformMappedFile> entry = storage->Read(name);
+    REQUIRE(entry);
+    std::string content(entry->data, entry->size);
+    REQUIRE((content == a || content == b));
+    entry.reset();
+
+    // No temporary files are left behind.
+    int entry_count = 0;
+    storage->ForEachEntry([&](const CacheStorage::EntryInfo&) {
+      ++entry_count;
+    });
+    REQUIRE(entry_count == 1);
+    GetFilesInFolder(directory, true /*recursive*/,
+                     false /*add_folder_to_path*/,
+                     [&](const std::string& file) {
+                       REQUIRE(!EndsWith(file, ".tmp"));
+                     });
+
+    REQUIRE(storage->Remove(name));
+    std::remove((directory + "@blobs").c_str());
+    std::remove(directory.c_str());
+  }
+  TEST_CASE("compaction keeps concurrent writes") {
+    const std::string directory =
+        GetTemporaryDirectory() + "cquery_cache_storage_pack_test/";
+    // Removes the pack files even if a check below fails.
+    struct RemoveDirectory {
+      std::string directory;
+      ~RemoveDirectory() {
+        GetFilesInFolder(directory, false /*recursive*/,
+                         true /*add_folder_to_path*/,
+                         [](const std::string& path) {
+                           std::remove(path.c_str());
+                         });
+        std::remove(directory.c_str());
+      }
+    };
+    RemoveDirectory remove_directory{directory};
+    MakeDirectoryRecursive(directory);
+
+    // Each thread keeps replacing its own entry, so the pack is compacted
+    // several times while the other thread is appending to it.
+    const int kThreads = 2;
+    const int kWrites = 20;
+    const size_t kContentSize = 16 * 1024;
+    PackCacheStorage storage(directory, 4 * kContentSize);
+    std::atomic<int> failed_writes(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&, t]() {
+        for (int i = 0; i < kWrites; ++i) {
+          std::string content(kContentSize, static_cast<char>('a' + i));
+          if (!storage.Write(std::to_string(t), content))
+            ++failed_writes;
+        }
+      });
+    }
+    for (std::thread& thread : threads)
+      thread.join();
+    REQUIRE(failed_writes == 0);
+
+    for (int t = 0; t < kThreads; ++t) {
+      std::unique_ptr<PlatformMappedFile> entry =
+          storage.Read(std::to_string(t));
+      REQUIRE(entry);
+      std::string expected(kContentSize, static_cast<char>('a' + kWrites - 1));
+      REQUIRE(std::string(entry->data, entry->size) == expected);
+      REQUIRE(storage.Remove(std::to_string(t)));
+    }
+    storage.Flush();
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+struct Config;
+struct PlatformMappedFile;
+
+// Stores the per-file cache entries (indexes, headers and content blobs).
+// Entries are named by their path relative to the cache directory, ie,
+// "_usr_include_stdio.h.header.json" or "@blobs/<id>".
+//
+// Implementations are thread-safe.
+struct CacheStorage {
+  struct EntryInfo {
+    std::string name;
+    uint64_t size = 0;
+    // Seconds since the epoch at which the entry was written.
+    int64_t write_time = 0;
+  };
+
+  virtual ~CacheStorage() = default;
+
+  // Returns nullptr if there is no entry called |name|. The returned view stays
+  // valid even if the entry is later replaced or removed.
+  virtual std::unique_ptr<PlatformMappedFile> Read(const std::string& name) = 0;
+  virtual bool Exists(const std::string& name) = 0;
+  // Replaces any existing entry. Readers never observe a partial write.
+  virtual bool Write(const std::string& name, const std::string& content) = 0;
+  // Returns true if the entry existed and was removed.
+  virtual bool Remove(const std::string& name) = 0;
+  // Calls |action| for every entry. |action| must not call back into the
+  // storage.
+  virtual void ForEachEntry(
+      const std::function<void(const EntryInfo&)>& action) = 0;
+
+  // Persists any state that is only kept in memory. Entries that have been
+  // written are never lost if this is not called, but the next startup may be
+  // slower.
+  virtual void Flush() {}
+};
+
+// Returns the storage for |config|'s cache directory. This is either one file
+// per entry, or, if |config->enablePackedCache| is set, a single append-only
+// pack file. The storage lives until the process exits.
+CacheStorage* GetCacheStorage(Config* config);
+
+// One file per entry inside |directory|.
+std::unique_ptr<CacheStorage> MakeFileCacheStorage(
+    const std::string& directory);
+// All entries are appended to a pack file inside |directory|. Replaced and
+// removed entries are reclaimed by periodically compacting the pack.
+std::unique_ptr<CacheStorage> MakePackCacheStorage(
+    const std::string& directory);
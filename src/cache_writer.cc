@@ -0,0 +1,229 @@
+#include "cache_writer.h"
+
+#include "cache.h"
+#include "cache_manifest.h"
+#include "config.h"
+#include "indexer.h"
+#include "platform.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <doctest/doctest.h>
+#include <loguru/loguru.hpp>
+
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+// Maximum number of indexes waiting to be written. Once reached, the thread
+// queueing a new index writes the oldest pending one itself.
+const size_t kMaxPendingWrites = 64;
+// Maximum number of indexes the writer thread takes at once.
+const size_t kMaxBatchSize = 16;
+
+}  // namespace
+
+CacheWriter::CacheWriter(Config* config, CacheManifest* cache_manifest)
+    : config_(config), cache_manifest_(cache_manifest) {}
+
+void CacheWriter::Enqueue(std::unique_ptr<IndexFile> file) {
+  std::string path = file->path;
+  std::unique_ptr<IndexFile> overflow;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<IndexFile>& pending = pending_[path];
+    if (pending)
+      LOG_S(INFO) << "Dropping superseded cache write for " << path;
+    else
+      order_.push_back(path);
+    pending = std::move(file);
+
+    if (pending_.size() > kMaxPendingWrites)
+      overflow = TakeNextLocked();
+  }
+  cv_.notify_all();
+
+  if (overflow)
+    Write(std::move(overflow));
+}
+
+void CacheWriter::Flush(const std::string& path) {
+  std::unique_ptr<IndexFile> file;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&]() { return in_flight_.find(path) == in_flight_.end(); });
+    auto it = pending_.find(path);
+    if (it == pending_.end())
+      return;
+    file = std::move(it->second);
+    pending_.erase(it);
+    in_flight_.insert(path);
+  }
+  Write(std::move(file));
+}
+
+void CacheWriter::FlushAll() {
+  while (true) {
+    std::unique_ptr<IndexFile> file;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      file = TakeNextLocked();
+      if (!file) {
+        if (pending_.empty() && in_flight_.empty())
+          return;
+        // Another thread is writing; wait for it to finish.
+        cv_.wait(lock);
+        continue;
+      }
+    }
+    Write(std::move(file));
+  }
+}
+
+optional<std::string> CacheWriter::LoadFileContents(const std::string& path) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&]() { return in_flight_.find(path) == in_flight_.end(); });
+    auto it = pending_.find(path);
+    if (it != pending_.end() && !it->second->file_contents_.empty())
+      return it->second->file_contents_;
+  }
+  return LoadCachedFileContents(config_, path);
+}
+
+void CacheWriter::MarkUsed(const std::string& path) {
+  cache_manifest_->MarkUsed(path);
+}
+
+bool CacheWriter::HasWork() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !pending_.empty() || !in_flight_.empty();
+}
+
+WorkThread::Result CacheWriter::Run() {
+  std::vector<std::unique_ptr<IndexFile>> batch;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Use a timeout so the thread notices WorkThread::request_exit_on_idle.
+    // Pending paths which are in flight cannot be taken, so waiting for
+    // |pending_| to be non-empty would spin while another thread writes them.
+    cv_.wait_for(lock, std::chrono::seconds(1), [&]() {
+      return HasWritablePendingLocked() || WorkThread::request_exit_on_idle;
+    });
+    while (batch.size() < kMaxBatchSize) {
+      std::unique_ptr<IndexFile> file = TakeNextLocked();
+      if (!file)
+        break;
+      batch.push_back(std::move(file));
+    }
+  }
+  if (batch.empty())
+    return WorkThread::Result::NoWork;
+
+  Timer time;
+  size_t count = batch.size();
+  size_t unchanged_count = 0;
+  for (std::unique_ptr<IndexFile>& file : batch) {
+    if (Write(std::move(file)) == CacheWriteResult::Unchanged)
+      ++unchanged_count;
+  }
+  time.ResetAndPrint("[perf] Wrote " + std::to_string(count) +
+                     " cache files (" + std::to_string(unchanged_count) +
+                     " unchanged and skipped)");
+  return WorkThread::Result::MoreWork;
+}
+
+bool CacheWriter::HasWritablePendingLocked() const {
+  for (const auto& entry : pending_) {
+    if (in_flight_.find(entry.first) == in_flight_.end())
+      return true;
+  }
+  return false;
+}
+
+std::unique_ptr<IndexFile> CacheWriter::TakeNextLocked() {
+  for (auto it = order_.begin(); it != order_.end();) {
+    auto pending_it = pending_.find(*it);
+    if (pending_it == pending_.end()) {
+      // Already flushed.
+      it = order_.erase(it);
+      continue;
+    }
+    if (in_flight_.find(*it) != in_flight_.end()) {
+      ++it;
+      continue;
+    }
+
+    std::unique_ptr<IndexFile> file = std::move(pending_it->second);
+    pending_.erase(pending_it);
+    in_flight_.insert(*it);
+    order_.erase(it);
+    return file;
+  }
+  return nullptr;
+}
+
+CacheWriteResult CacheWriter::Write(std::unique_ptr<IndexFile> file) {
+  CacheWriteResult result = WriteToCache(config_, *file);
+  if (result == CacheWriteResult::Unchanged)
+    ++unchanged_count_;
+  if (result != CacheWriteResult::Failed)
+    cache_manifest_->Update(*file);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_flight_.erase(file->path);
+  }
+  cv_.notify_all();
+  return result;
+}
+
+TEST_SUITE("CacheWriter") {
+  TEST_CASE("pending contents are read without writing") {
+    Config config;
+    CacheWriter cache_writer(&config, nullptr);
+    std::unique_ptr<IndexFile> file = MakeUnique<IndexFile>("/project/a.cc");
+    file->file_contents_ = "int a;";
+    cache_writer.Enqueue(std::move(file));
+
+    optional<std::string> contents =
+        cache_writer.LoadFileContents("/project/a.cc");
+    REQUIRE(contents);
+    REQUIRE(*contents == "int a;");
+    // The index is still waiting to be written.
+    REQUIRE(cache_writer.HasWork());
+  }
+
+  TEST_CASE("unchanged indexes are counted") {
+    Config config;
+    config.cacheDirectory =
+        GetTemporaryDirectory() + "cquery_cache_writer_test/";
+    config.cacheFormat = SerializeFormat::Binary;
+    MakeDirectoryRecursive(config.cacheDirectory);
+    CacheManifest manifest(&config);
+    CacheWriter cache_writer(&config, &manifest);
+
+    auto write = [&](const std::string& contents) {
+      auto file = MakeUnique<IndexFile>("/project/a.cc");
+      file->file_contents_ = contents;
+      file->content_hash = HashContent(contents);
+      cache_writer.Enqueue(std::move(file));
+      cache_writer.FlushAll();
+    };
+    write("int a;");
+    REQUIRE(cache_writer.unchanged_count() == 0);
+    write("int a;");
+    REQUIRE(cache_writer.unchanged_count() == 1);
+    write("int b;");
+    REQUIRE(cache_writer.unchanged_count() == 1);
+
+    GetFilesInFolder(config.cacheDirectory, true /*recursive*/,
+                     true /*add_folder_to_path*/,
+                     [](const std::string& path) {
+                       std::remove(path.c_str());
+                     });
+    std::remove((config.cacheDirectory + "@blobs").c_str());
+    std::remove(config.cacheDirectory.c_str());
+  }
+}
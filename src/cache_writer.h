@@ -0,0 +1,88 @@
+#pragma once
+
+#include "cache.h"
+#include "work_thread.h"
+
+#include <optional.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+struct CacheManifest;
+struct Config;
+struct IndexFile;
+
+// Writes indexes to the cache on a dedicated thread, so that indexer threads
+// do not stall on disk IO while parsing.
+//
+// Pending writes are coalesced by path; if a file is emitted again before its
+// previous index has been written, only the newest index is written. The
+// queue is bounded, so a slow disk applies backpressure to the indexers
+// instead of buffering an unbounded number of indexes in memory.
+struct CacheWriter {
+  CacheWriter(Config* config, CacheManifest* cache_manifest);
+
+  // Queues |file| to be written. Replaces any pending write for the same path.
+  // If the queue is full, the oldest pending index is written on the calling
+  // thread before this returns.
+  void Enqueue(std::unique_ptr<IndexFile> file);
+
+  // Writes the pending index for |path|, if any, on the calling thread. This
+  // must be called before reading the cache for |path|.
+  void Flush(const std::string& path);
+  // Writes every pending index on the calling thread.
+  void FlushAll();
+
+  // Returns the contents of |path| at the time it was last indexed. Unlike
+  // Flush(), a pending index is read from memory instead of being written
+  // first; this only waits for a write of |path| which is already running.
+  optional<std::string> LoadFileContents(const std::string& path);
+
+  // Records that the cache of |path| has been read, so it is not evicted
+  // before caches which have not been used for longer.
+  void MarkUsed(const std::string& path);
+
+  // Returns true if there are pending or in-progress writes.
+  bool HasWork();
+
+  // Number of indexes which were not written because the cache already
+  // contained an identical index and file contents. Files which were loaded
+  // from the cache instead of being parsed are never sent to the writer, so
+  // they are not counted here.
+  int unchanged_count() const { return unchanged_count_; }
+
+  // Entry point for the writer thread. Writes the next batch of pending
+  // indexes.
+  WorkThread::Result Run();
+
+ private:
+  // Returns true if a pending index is not in-flight, ie, it can be taken by
+  // TakeNextLocked(). |mutex_| must be held.
+  bool HasWritablePendingLocked() const;
+  // Removes the oldest pending index which is not being written and marks it
+  // as in-flight. Returns nullptr if there is none. |mutex_| must be held.
+  std::unique_ptr<IndexFile> TakeNextLocked();
+  // Writes |file| and records it in the manifest. The path of |file| must be
+  // in-flight.
+  CacheWriteResult Write(std::unique_ptr<IndexFile> file);
+
+  Config* config_;
+  CacheManifest* cache_manifest_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Paths in the order they were first queued. May contain paths which have
+  // since been flushed; those are skipped.
+  std::deque<std::string> order_;
+  std::unordered_map<std::string, std::unique_ptr<IndexFile>> pending_;
+  // Paths which are currently being written. A path is only ever written by
+  // one thread at a time.
+  std::unordered_set<std::string> in_flight_;
+  std::atomic<int> unchanged_count_{0};
+};
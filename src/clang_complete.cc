@@ -313,11 +313,23 @@ void TryEnsureDocumentParsed(ClangCompleteManager* manager,
   }
 }
 
+// Marks |completion_manager| as busy for the lifetime of the object.
+struct ScopedActiveRequest {
+  explicit ScopedActiveRequest(ClangCompleteManager* completion_manager)
+      : completion_manager_(completion_manager) {
+    ++completion_manager_->active_requests_;
+  }
+  ~ScopedActiveRequest() { --completion_manager_->active_requests_; }
+
+  ClangCompleteManager* completion_manager_;
+};
+
 void CompletionParseMain(ClangCompleteManager* completion_manager) {
   while (true) {
     // Fetching the completion request blocks until we have a request.
     ClangCompleteManager::ParseRequest request =
         completion_manager->parse_requests_.Dequeue();
+    ScopedActiveRequest active(completion_manager);
 
     // If we don't get a session then that means we don't care about the file
     // anymore - abandon the request.
@@ -353,6 +365,7 @@ void CompletionQueryMain(ClangCompleteManager* completion_manager) {
     // Fetching the completion request blocks until we have a request.
     std::unique_ptr<ClangCompleteManager::CompletionRequest> request =
         completion_manager->completion_request_.Take();
+    ScopedActiveRequest active(completion_manager);
     std::string path = request->document.uri.GetPath();
 
     std::shared_ptr<CompletionSession> session =
@@ -582,6 +595,10 @@ void ClangCompleteManager::DiagnosticsUpdate(
       });
 }
 
+bool ClangCompleteManager::IsBusy() {
+  return active_requests_ > 0 || !parse_requests_.IsEmpty();
+}
+
 void ClangCompleteManager::NotifyView(const std::string& filename) {
   //
   // On view, we reparse only if the file has not been parsed. The existence of
@@ -8,6 +8,7 @@
 
 #include <clang-c/Index.h>
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -86,6 +87,9 @@ struct ClangCompleteManager {
                     const OnComplete& on_complete);
   // Request a diagnostics update.
   void DiagnosticsUpdate(const lsTextDocumentIdentifier& document);
+  // Returns true if code completion, diagnostics or a preload parse is
+  // running or queued.
+  bool IsBusy();
 
   // Notify the completion manager that |filename| has been viewed and we
   // should begin preloading completion data.
@@ -134,4 +138,6 @@ struct ClangCompleteManager {
   // Parse requests. The path may already be parsed, in which case it should be
   // reparsed.
   ThreadedQueue<ParseRequest> parse_requests_;
+  // Number of completion and parse requests which are being processed.
+  std::atomic<int> active_requests_{0};
 };
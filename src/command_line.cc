@@ -1,9 +1,12 @@
 // TODO: cleanup includes
 #include "cache.h"
+#include "cache_manifest.h"
+#include "cache_writer.h"
 #include "clang_complete.h"
 #include "file_consumer.h"
 #include "include_complete.h"
 #include "indexer.h"
+#include "indexer_pool.h"
 #include "ipc_manager.h"
 #include "language_server_api.h"
 #include "lex_utils.h"
@@ -12,12 +15,16 @@
 #include "platform.h"
 #include "project.h"
 #include "query.h"
+#include "query_snapshot.h"
 #include "query_utils.h"
+#include "request_cancellation.h"
 #include "serializer.h"
+#include "shared_mutex.h"
 #include "standard_includes.h"
 #include "test.h"
 #include "threaded_queue.h"
 #include "timer.h"
+#include "work_stealing_queue.h"
 #include "work_thread.h"
 #include "working_files.h"
 
@@ -26,6 +33,7 @@
 #include <rapidjson/ostreamwrapper.h>
 #include <loguru.hpp>
 
+#include <atomic>
 #include <climits>
 #include <fstream>
 #include <functional>
@@ -36,15 +44,13 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 // TODO: provide a feature like 'https://github.com/goldsborough/clang-expand',
 // ie, a fully linear view of a function with inline function calls expanded.
 // We can probably use vscode decorators to achieve it.
 
-// TODO: implement ThreadPool type which monitors CPU usage / number of work
-// items per second completed and scales up/down number of running threads.
-
 namespace {
 
 std::vector<std::string> kEmptyArgs;
@@ -52,6 +58,9 @@ std::vector<std::string> kEmptyArgs;
 // Expected client version. We show an error if this doesn't match.
 const int kExpectedClientVersion = 3;
 
+// Number of threads answering read-only requests next to the querydb thread.
+const int kNumQueryDbReaders = 2;
+
 // If true stdout will be printed to stderr.
 bool g_log_stdin_stdout_to_stderr = false;
 
@@ -104,19 +113,19 @@ bool FindFileOrFail(QueryDatabase* db,
                     QueryFileId* out_file_id = nullptr) {
   *out_query_file = nullptr;
 
-  auto it = db->usr_to_file.find(LowerPathIfCaseInsensitive(absolute_path));
-  if (it != db->usr_to_file.end()) {
-    QueryFile& file = db->files[it->second.id];
+  optional<QueryFileId> file_id = db->GetQueryFileId(absolute_path);
+  if (file_id) {
+    QueryFile& file = db->files[file_id->id];
     if (file.def) {
       *out_query_file = &file;
       if (out_file_id)
-        *out_file_id = QueryFileId(it->second.id);
+        *out_file_id = *file_id;
       return true;
     }
   }
 
   if (out_file_id)
-    *out_file_id = QueryFileId((size_t)-1);
+    *out_file_id = QueryFileId((RawId)-1);
 
   LOG_S(INFO) << "Unable to find file \"" << absolute_path << "\"";
 
@@ -131,6 +140,15 @@ bool FindFileOrFail(QueryDatabase* db,
   return false;
 }
 
+// Answers a request which the client has cancelled.
+void ReplyCancelled(BaseIpcMessage* message) {
+  Out_Error out;
+  out.id = *message->request_id;
+  out.error.code = lsErrorCodes::RequestCancelled;
+  out.error.message = "Request cancelled";
+  IpcManager::instance()->SendOutMessageToClient(message->method_id, out);
+}
+
 void EmitInactiveLines(WorkingFile* working_file,
                        const std::vector<Range>& inactive_regions) {
   Out_CquerySetInactiveRegion out;
@@ -303,20 +321,22 @@ optional<QueryFileId> GetImplementationFile(QueryDatabase* db,
 
   LOG_S(INFO) << "!! Looking for impl file that starts with " << target_path;
 
-  for (auto& entry : db->usr_to_file) {
-    Usr path = entry.first;
+  optional<QueryFileId> result;
+  db->usr_to_file.ForEach([&](const Usr& path, QueryFileId id) {
+    // Skip files which an indexer has seen but querydb has not imported yet.
+    if (result || id.id >= db->files.size())
+      return;
 
     // Do not consider header files for implementation files.
     // TODO: make file extensions configurable.
     if (EndsWith(path, ".h") || EndsWith(path, ".hpp"))
-      continue;
+      return;
 
-    if (StartsWith(path, target_path) && path != original_path) {
-      return entry.second;
-    }
-  }
+    if (StartsWith(path, target_path) && path != original_path)
+      result = id;
+  });
 
-  return nullopt;
+  return result;
 }
 
 void EnsureImplFile(QueryDatabase* db,
@@ -544,6 +564,17 @@ struct Index_Request {
   std::vector<std::string> args;
   bool is_interactive;
   optional<std::string> contents;  // Preloaded contents. Useful for tests.
+  // If true, the cache manifest reported the file and all of its dependencies
+  // as unchanged, so the cache is loaded without checking timestamps again.
+  bool load_from_cache = false;
+  // If true, the cache manifest reported the file or one of its dependencies
+  // as changed since it was cached.
+  bool is_modified = false;
+  // Set once a newer request for |path| makes this one unnecessary. Null if
+  // the request is not tracked by QueueManager.
+  std::shared_ptr<std::atomic<bool>> obsolete;
+
+  bool IsObsolete() const { return obsolete && *obsolete; }
 
   Index_Request(const std::string& path,
                 const std::vector<std::string>& args,
@@ -562,7 +593,9 @@ struct Index_DoIdMap {
   PerformanceImportFile perf;
   bool is_interactive = false;
   bool write_to_disk = false;
-  bool load_previous = false;
+  // Indexer which produced |current|, or -1. The IdMap for the file is built on
+  // the same indexer while its data is still in cache.
+  int indexer = -1;
 
   Index_DoIdMap(std::unique_ptr<IndexFile> current,
                 PerformanceImportFile perf,
@@ -603,35 +636,349 @@ struct Index_OnIdMapped {
 struct Index_OnIndexed {
   IndexUpdate update;
   PerformanceImportFile perf;
+  // Indexed contents of the files in |update| which were open in the editor,
+  // keyed by path. The indexer reads them so that querydb does not have to
+  // wait on the disk.
+  std::unordered_map<std::string, std::string> indexed_contents;
 
   Index_OnIndexed(IndexUpdate& update, PerformanceImportFile perf)
       : update(update), perf(perf) {}
 };
 
+// The cached dependencies of a file which was opened in the editor. The
+// indexer reads them from disk so that querydb does not have to.
+struct Index_OnDependencies {
+  std::string path;
+  std::vector<std::string> dependencies;
+
+  Index_OnDependencies(const std::string& path,
+                       std::vector<std::string> dependencies)
+      : path(path), dependencies(std::move(dependencies)) {}
+};
+
+// Returns true if |id| is a request which only reads the query database and
+// the working files. These are answered by reader threads, so that they do not
+// wait behind index imports on the querydb thread.
+bool IsQueryDbReadRequest(IpcId id) {
+  switch (id) {
+    case IpcId::TextDocumentDefinition:
+    case IpcId::TextDocumentDocumentHighlight:
+    case IpcId::TextDocumentHover:
+    case IpcId::TextDocumentReferences:
+    case IpcId::TextDocumentDocumentSymbol:
+    case IpcId::TextDocumentDocumentLink:
+    case IpcId::WorkspaceSymbol:
+    case IpcId::CqueryTypeHierarchyTree:
+    case IpcId::CqueryCallTreeInitial:
+    case IpcId::CqueryCallTreeExpand:
+    case IpcId::CqueryVars:
+    case IpcId::CqueryCallers:
+    case IpcId::CqueryBase:
+    case IpcId::CqueryDerived:
+      return true;
+    default:
+      return false;
+  }
+}
+
+struct QueryDb_ReadRequest {
+  std::unique_ptr<BaseIpcMessage> message;
+  // Value of QueueManager::querydb_messages_sent when |message| was received.
+  int64_t querydb_messages_sent_before;
+
+  QueryDb_ReadRequest(std::unique_ptr<BaseIpcMessage> message,
+                      int64_t querydb_messages_sent_before)
+      : message(std::move(message)),
+        querydb_messages_sent_before(querydb_messages_sent_before) {}
+};
+
+// Order in which index requests are processed.
+enum class IndexRequestPriority {
+  // The file is open in the editor.
+  OpenFile,
+  // The file likely implements a header included by an open file, ie,
+  // foo.cc if an open file includes foo.h.
+  OpenFileDependency,
+  // The file is in the same directory as an open file.
+  OpenFileNeighbor,
+  // The file can be loaded from cache. This is cheap and makes most of the
+  // project queryable, so it happens before any other file is parsed.
+  Cached,
+  // The file has been modified since it was cached.
+  RecentlyModified,
+  Default
+};
+const int kNumIndexRequestPriorities =
+    static_cast<int>(IndexRequestPriority::Default) + 1;
+
+// Tracks the files the user is working on, so that they and the files the user
+// is likely to navigate into are indexed first.
+//
+// NOTE: This is not thread safe and should only be used on the querydb thread.
+struct IndexRequestPrioritizer {
+  void OnOpen(const std::string& path) {
+    open_files_[path];
+    Rebuild();
+  }
+
+  void OnClose(const std::string& path) {
+    open_files_.erase(path);
+    Rebuild();
+  }
+
+  // Only dependencies under |project_root| are prioritized. System headers
+  // share stems like "string" and "memory" with many project files.
+  void SetProjectRoot(const std::string& project_root) {
+    project_root_ = project_root;
+  }
+
+  // Sets the files which are included by the open file |path|. Returns false
+  // if |path| is not open or its dependencies did not change.
+  bool SetDependencies(const std::string& path,
+                       std::vector<std::string> dependencies) {
+    auto it = open_files_.find(path);
+    if (it == open_files_.end())
+      return false;
+    dependencies.erase(
+        std::remove_if(dependencies.begin(), dependencies.end(),
+                       [this](const std::string& dependency) {
+                         return !StartsWith(dependency, project_root_);
+                       }),
+        dependencies.end());
+    std::sort(dependencies.begin(), dependencies.end());
+    if (it->second == dependencies)
+      return false;
+    it->second = std::move(dependencies);
+    Rebuild();
+    return true;
+  }
+
+  IndexRequestPriority GetPriority(const Index_Request& request) const {
+    if (request.is_interactive || open_files_.count(request.path))
+      return IndexRequestPriority::OpenFile;
+    if (!open_files_.empty()) {
+      if (dependency_stems_.count(GetStem(request.path)))
+        return IndexRequestPriority::OpenFileDependency;
+      if (directories_.count(GetDirectory(request.path)))
+        return IndexRequestPriority::OpenFileNeighbor;
+    }
+    if (request.load_from_cache)
+      return IndexRequestPriority::Cached;
+    if (request.is_modified)
+      return IndexRequestPriority::RecentlyModified;
+    return IndexRequestPriority::Default;
+  }
+
+ private:
+  // Returns "/foo/" for "/foo/bar.cc".
+  static std::string GetDirectory(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+  }
+
+  // Returns "bar" for "/foo/bar.cc". Headers and their implementation often
+  // live in different directories, so the directory is not part of the stem.
+  static std::string GetStem(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    std::string name =
+        slash == std::string::npos ? path : path.substr(slash + 1);
+    return name.substr(0, name.find('.'));
+  }
+
+  void Rebuild() {
+    dependency_stems_.clear();
+    directories_.clear();
+    for (const auto& entry : open_files_) {
+      directories_.insert(GetDirectory(entry.first));
+      for (const std::string& dependency : entry.second)
+        dependency_stems_.insert(GetStem(dependency));
+    }
+  }
+
+  std::string project_root_;
+  // Open files and the project files they include.
+  std::unordered_map<std::string, std::vector<std::string>> open_files_;
+  std::unordered_set<std::string> dependency_stems_;
+  std::unordered_set<std::string> directories_;
+};
+
 struct QueueManager {
-  using Index_RequestQueue = ThreadedQueue<Index_Request>;
-  using Index_DoIdMapQueue = ThreadedQueue<Index_DoIdMap>;
-  using Index_OnIdMappedQueue = ThreadedQueue<Index_OnIdMapped>;
+  using Index_RequestQueue = PriorityThreadedQueue<Index_Request>;
+  using Index_DoIdMapQueue = WorkStealingQueue<Index_DoIdMap>;
   using Index_OnIndexedQueue = ThreadedQueue<Index_OnIndexed>;
-
+  using Index_OnDependenciesQueue = ThreadedQueue<Index_OnDependencies>;
+  using QueryDb_ReadRequestQueue = ThreadedQueue<QueryDb_ReadRequest>;
+
+  // Files to parse. They are not spread over per-indexer deques like
+  // |do_id_map|: the next parse must be the highest priority request in the
+  // whole pool, and a request is replaced in place when the file is requested
+  // again. Parses are long enough that contention on one queue does not
+  // matter.
   Index_RequestQueue index_request;
-  Index_DoIdMapQueue do_id_map;
-  Index_DoIdMapQueue load_previous_index;
-  Index_OnIdMappedQueue on_id_mapped;
+  // Indexes whose IdMap has not been built yet. These are cheap compared to
+  // parse requests, so they are scheduled through per-indexer deques and never
+  // wait for a parse to finish. Created by the initialize request, with one
+  // deque per indexer, before any indexer is started.
+  std::unique_ptr<Index_DoIdMapQueue> do_id_map;
+  // Set once |do_id_map| exists. HasWork() is also called by threads which
+  // start before the initialize request.
+  std::atomic<bool> has_do_id_map{false};
+  // Index updates for querydb. Idle indexers merge queued updates together,
+  // which needs every queued update in one place, and querydb imports them in
+  // the order they were produced; so this is a single shared queue as well.
   Index_OnIndexedQueue on_indexed;
+  Index_OnDependenciesQueue on_dependencies;
+  // Read-only requests from the client; see QueryDbReaderMain.
+  QueryDb_ReadRequestQueue read_requests;
+
+  // Requests from the client which can be cancelled.
+  RequestCancellation request_cancellation;
+
+  // Guards the query database and the contents of the working files. The
+  // querydb thread holds it exclusively while it modifies them, and reader
+  // threads hold it shared. querydb does not need it for its own reads.
+  SharedMutex querydb_mutex;
+
+  // Number of client messages sent to and handled by the querydb thread.
+  std::atomic<int64_t> querydb_messages_sent{0};
+  std::atomic<int64_t> querydb_messages_handled{0};
+
+  // Decides the order of |index_request|. Only used on the querydb thread.
+  IndexRequestPrioritizer index_request_prioritizer;
+
+  // Decides how many indexers run. Created by the initialize request before
+  // any indexer is started.
+  std::unique_ptr<IndexerPool> indexer_pool;
 
   QueueManager(MultiQueueWaiter* waiter)
-      : index_request(waiter),
-        do_id_map(waiter),
-        load_previous_index(waiter),
-        on_id_mapped(waiter),
-        on_indexed(waiter) {}
+      : index_request(waiter, kNumIndexRequestPriorities),
+        on_indexed(waiter),
+        on_dependencies(waiter),
+        read_requests(waiter) {}
+
+  // Sends a client message to the querydb thread, or to a reader thread if it
+  // does not modify any state.
+  void SendToQueryDb(std::unique_ptr<BaseIpcMessage> message) {
+    if (IsQueryDbReadRequest(message->method_id)) {
+      read_requests.Enqueue(
+          QueryDb_ReadRequest(std::move(message), querydb_messages_sent));
+      return;
+    }
+    ++querydb_messages_sent;
+    IpcManager::instance()->SendMessage(IpcManager::Destination::Server,
+                                        std::move(message));
+  }
+
+  // Queues |request|, replacing any older request for the same path. Must be
+  // called on the querydb thread.
+  void EnqueueIndexRequest(Index_Request&& request) {
+    TrackIndexRequest(&request);
+    IndexRequestPriority priority =
+        index_request_prioritizer.GetPriority(request);
+    index_request.Enqueue(static_cast<int>(priority), std::move(request));
+  }
+
+  // Returns the next request which has not been replaced by a newer one.
+  optional<Index_Request> DequeueIndexRequest() {
+    while (true) {
+      optional<Index_Request> request = index_request.TryDequeue();
+      if (!request)
+        return nullopt;
+
+      std::lock_guard<std::mutex> lock(tracked_index_requests_mutex_);
+      if (request->IsObsolete()) {
+        LOG_S(INFO) << "Dropping obsolete index request for " << request->path;
+        continue;
+      }
+      auto it = tracked_index_requests_.find(request->path);
+      if (it != tracked_index_requests_.end() &&
+          it->second.obsolete == request->obsolete)
+        it->second.in_flight = true;
+      return request;
+    }
+  }
+
+  // Call once an indexer is done with a request from DequeueIndexRequest.
+  void FinishIndexRequest(const Index_Request& request) {
+    std::lock_guard<std::mutex> lock(tracked_index_requests_mutex_);
+    auto it = tracked_index_requests_.find(request.path);
+    if (it != tracked_index_requests_.end() &&
+        it->second.obsolete == request.obsolete)
+      tracked_index_requests_.erase(it);
+  }
+
+  // Updates the priority of queued index requests after the user's working
+  // set has changed. Must be called on the querydb thread.
+  void ReprioritizeIndexRequests() {
+    index_request.Reprioritize([this](const Index_Request& request) {
+      return static_cast<int>(index_request_prioritizer.GetPriority(request));
+    });
+  }
+
+  void EnqueueDoIdMap(Index_DoIdMap&& request) {
+    int indexer = request.indexer;
+    do_id_map->Enqueue(indexer, std::move(request));
+  }
+
+  // Number of indexer iterations which have started and finished. An
+  // iteration may have dequeued work without having queued its results yet.
+  std::atomic<int64_t> indexer_iterations_started{0};
+  std::atomic<int64_t> indexer_iterations_finished{0};
+
+  // Totals for the --index-only summary.
+  std::atomic<int> parsed_file_count{0};
+  std::atomic<int> cached_file_count{0};
 
   bool HasWork() {
-    return !index_request.IsEmpty() || !do_id_map.IsEmpty() ||
-           !load_previous_index.IsEmpty() || !on_id_mapped.IsEmpty() ||
-           !on_indexed.IsEmpty();
+    return !index_request.IsEmpty() ||
+           (has_do_id_map && !do_id_map->IsEmpty()) ||
+           !on_indexed.IsEmpty() || !on_dependencies.IsEmpty();
+  }
+
+  // Returns true if every queue is empty and no indexer is in the middle of
+  // processing an item. Work done on the querydb thread is not considered.
+  bool IsIndexerIdle() {
+    int64_t started = indexer_iterations_started;
+    if (indexer_iterations_finished != started || HasWork())
+      return false;
+    // An iteration which started after |started| was read may have dequeued
+    // the last item before HasWork() checked the queues.
+    return indexer_iterations_started == started;
+  }
+
+ private:
+  struct TrackedIndexRequest {
+    std::shared_ptr<std::atomic<bool>> obsolete;
+    bool is_interactive = false;
+    // True once an indexer has started on the request.
+    bool in_flight = false;
+  };
+
+  // Makes |request| the newest request for its path. An older request which
+  // is still queued is dropped when it is dequeued. An older request which is
+  // already being parsed is aborted if |request| is interactive, since then
+  // |request| reparses the file anyway; otherwise the parse is allowed to
+  // finish, and |request| will find the file up to date.
+  void TrackIndexRequest(Index_Request* request) {
+    request->obsolete = std::make_shared<std::atomic<bool>>(false);
+
+    std::lock_guard<std::mutex> lock(tracked_index_requests_mutex_);
+    TrackedIndexRequest& tracked = tracked_index_requests_[request->path];
+    if (tracked.obsolete && (!tracked.in_flight || request->is_interactive)) {
+      LOG_S(INFO) << "Replacing " << (tracked.in_flight ? "running" : "queued")
+                  << " index request for " << request->path;
+      *tracked.obsolete = true;
+      // The older request may have been forcing a reparse.
+      request->is_interactive |= tracked.is_interactive;
+    }
+    tracked.obsolete = request->obsolete;
+    tracked.is_interactive = request->is_interactive;
+    tracked.in_flight = false;
   }
+
+  std::mutex tracked_index_requests_mutex_;
+  // The newest request for every path which is queued or being indexed.
+  std::unordered_map<std::string, TrackedIndexRequest> tracked_index_requests_;
 };
 
 void RegisterMessageTypes() {
@@ -657,6 +1004,8 @@ void RegisterMessageTypes() {
   MessageRegistry::instance()->Register<Ipc_CodeLensResolve>();
   MessageRegistry::instance()->Register<Ipc_WorkspaceSymbol>();
   MessageRegistry::instance()->Register<Ipc_CqueryFreshenIndex>();
+  MessageRegistry::instance()->Register<Ipc_CquerySaveSnapshot>();
+  MessageRegistry::instance()->Register<Ipc_CqueryCollectCache>();
   MessageRegistry::instance()->Register<Ipc_CqueryTypeHierarchyTree>();
   MessageRegistry::instance()->Register<Ipc_CqueryCallTreeInitial>();
   MessageRegistry::instance()->Register<Ipc_CqueryCallTreeExpand>();
@@ -671,8 +1020,6 @@ void RegisterMessageTypes() {
 
 // Manages files inside of the indexing pipeline so we don't have the same file
 // being imported multiple times.
-//
-// NOTE: This is not thread safe and should only be used on the querydb thread.
 struct ImportManager {
   // Try to mark the given dependency as imported. A dependency can only ever be
   // imported once.
@@ -685,18 +1032,24 @@ struct ImportManager {
   // importing a file into querydb once per file. Returns true if the file
   // can be imported.
   bool StartQueryDbImport(const std::string& path) {
+    std::lock_guard<std::mutex> lock(querydb_processing_mutex_);
     return querydb_processing_.insert(path).second;
   }
 
   // The file has been fully imported and can be imported again later on.
   void DoneQueryDbImport(const std::string& path) {
+    std::lock_guard<std::mutex> lock(querydb_processing_mutex_);
     querydb_processing_.erase(path);
   }
 
   // Returns true if there any any files currently being imported.
-  bool HasActiveQuerydbImports() { return !querydb_processing_.empty(); }
+  bool HasActiveQuerydbImports() {
+    std::lock_guard<std::mutex> lock(querydb_processing_mutex_);
+    return !querydb_processing_.empty();
+  }
 
   std::unordered_set<std::string> querydb_processing_;
+  std::mutex querydb_processing_mutex_;
 
   // TODO: use std::shared_mutex so we can have multiple readers.
   std::mutex depdency_mutex_;
@@ -705,44 +1058,37 @@ struct ImportManager {
 
 // Manages loading caches from file paths for the indexer process.
 struct CacheLoader {
-  explicit CacheLoader(Config* config) : config_(config) {}
-
-  IndexFile* TryLoad(const std::string& path) {
-    auto it = caches.find(path);
-    if (it != caches.end())
-      return it->second.get();
-
-    std::unique_ptr<IndexFile> cache = LoadCachedIndex(config_, path);
-    if (!cache)
+  CacheLoader(Config* config, CacheWriter* cache_writer)
+      : config_(config), cache_writer_(cache_writer) {}
+
+  // Loads the header of the cache at |path|. The header is small and does not
+  // contain any symbols, so this is cheap compared to loading the full index.
+  const IndexFileHeader* TryLoadHeader(const std::string& path) {
+    auto it = headers.find(path);
+    if (it != headers.end())
+      return &it->second;
+
+    cache_writer_->Flush(path);
+    optional<IndexFileHeader> header = LoadCachedIndexHeader(config_, path);
+    if (!header)
       return nullptr;
 
-    caches[path] = std::move(cache);
-    return caches[path].get();
-  }
-
-  // Takes the existing cache or loads the cache at |path|. May return nullptr
-  // if the cache does not exist.
-  std::unique_ptr<IndexFile> TryTakeOrLoad(const std::string& path) {
-    auto it = caches.find(path);
-    if (it != caches.end()) {
-      auto result = std::move(it->second);
-      caches.erase(it);
-      return result;
-    }
-
-    return LoadCachedIndex(config_, path);
+    return &(headers[path] = std::move(*header));
   }
 
-  // Takes the existing cache or loads the cache at |path|. Asserts the cache
-  // exists.
-  std::unique_ptr<IndexFile> TakeOrLoad(const std::string& path) {
-    auto result = TryTakeOrLoad(path);
-    assert(result);
-    return result;
+  // Loads the full cache at |path|. May return nullptr if the cache does not
+  // exist.
+  std::unique_ptr<IndexFile> TryLoad(const std::string& path) {
+    cache_writer_->Flush(path);
+    std::unique_ptr<IndexFile> file = LoadCachedIndex(config_, path);
+    if (file)
+      cache_writer_->MarkUsed(path);
+    return file;
   }
 
-  std::unordered_map<std::string, std::unique_ptr<IndexFile>> caches;
+  std::unordered_map<std::string, IndexFileHeader> headers;
   Config* config_;
+  CacheWriter* cache_writer_;
 };
 
 // Caches timestamps of cc files so we can avoid a filesystem reads. This is
@@ -757,12 +1103,12 @@ struct TimestampManager {
       if (it != timestamps_.end())
         return it->second;
     }
-    IndexFile* file = cache_loader->TryLoad(path);
-    if (!file)
+    const IndexFileHeader* header = cache_loader->TryLoadHeader(path);
+    if (!header)
       return nullopt;
 
-    UpdateCachedModificationTime(path, file->last_modification_time);
-    return file->last_modification_time;
+    UpdateCachedModificationTime(path, header->last_modification_time);
+    return header->last_modification_time;
   }
 
   void UpdateCachedModificationTime(const std::string& path,
@@ -771,9 +1117,33 @@ struct TimestampManager {
     timestamps_[path] = timestamp;
   }
 
+  // Returns the content hash of |path| on disk. The hash is cached by
+  // modification time so every version of a file is only hashed once, even
+  // if it is a dependency of many translation units.
+  optional<uint64_t> GetContentHash(const std::string& path,
+                                    int64_t modification_time) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = content_hashes_.find(path);
+      if (it != content_hashes_.end() &&
+          it->second.first == modification_time)
+        return it->second.second;
+    }
+    optional<uint64_t> hash = HashFileContent(path);
+    if (!hash)
+      return nullopt;
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    content_hashes_[path] = std::make_pair(modification_time, *hash);
+    return hash;
+  }
+
   // TODO: use std::shared_mutex so we can have multiple readers.
   std::mutex mutex_;
   std::unordered_map<std::string, int64_t> timestamps_;
+  // Maps path to (modification time, content hash).
+  std::unordered_map<std::string, std::pair<int64_t, uint64_t>>
+      content_hashes_;
 };
 
 struct IndexManager {
@@ -804,9 +1174,8 @@ void EmitProgress(Config *config, QueueManager* queue) {
   if (config->enableProgressReports) {
     Out_Progress out;
     out.params.indexRequestCount = queue->index_request.Size();
-    out.params.doIdMapCount = queue->do_id_map.Size();
-    out.params.loadPreviousIndexCount = queue->load_previous_index.Size();
-    out.params.onIdMappedCount = queue->on_id_mapped.Size();
+    out.params.doIdMapCount =
+        queue->has_do_id_map ? queue->do_id_map->Size() : 0;
     out.params.onIndexedCount = queue->on_indexed.Size();
 
     IpcManager::instance()->SendOutMessageToClient(IpcId::Cout, out);
@@ -844,14 +1213,16 @@ std::vector<Index_DoIdMap> DoParseFile(
     ImportManager* import_manager,
     CacheLoader* cache_loader,
     bool is_interactive,
+    bool load_from_cache,
     const std::string& path,
     const std::vector<std::string>& args,
-    const optional<FileContents>& contents) {
+    const optional<FileContents>& contents,
+    const std::function<bool()>& is_cancelled) {
   std::vector<Index_DoIdMap> result;
 
   // Always run this block, even if we are interactive, so we can check
   // dependencies and reset files in |file_consumer_shared|.
-  IndexFile* previous_index = cache_loader->TryLoad(path);
+  const IndexFileHeader* previous_index = cache_loader->TryLoadHeader(path);
   if (previous_index) {
     // If none of the dependencies have changed and the index is not
     // interactive (ie, requested by a file save), skip parsing and just load
@@ -877,6 +1248,22 @@ std::vector<Index_DoIdMap> DoParseFile(
       optional<int64_t> last_cached_modification =
           timestamp_manager->GetLastCachedModificationTime(cache_loader, path);
 
+      // The timestamp changed but the contents may not have, ie, after
+      // switching branches back and forth. Compare content hashes before
+      // deciding to reparse.
+      if (last_cached_modification &&
+          modification_timestamp != *last_cached_modification) {
+        const IndexFileHeader* header = cache_loader->TryLoadHeader(path);
+        if (header && header->content_hash != 0 &&
+            timestamp_manager->GetContentHash(path, *modification_timestamp) ==
+                header->content_hash) {
+          LOG_S(INFO) << "Timestamp changed but contents did not for " << path;
+          timestamp_manager->UpdateCachedModificationTime(
+              path, *modification_timestamp);
+          return FileParseQuery::DoesNotNeedParse;
+        }
+      }
+
       // File has been changed.
       if (!last_cached_modification ||
           modification_timestamp != *last_cached_modification) {
@@ -890,59 +1277,76 @@ std::vector<Index_DoIdMap> DoParseFile(
       return FileParseQuery::DoesNotNeedParse;
     };
 
-    // Check timestamps and update |file_consumer_shared|.
-    FileParseQuery path_state = file_needs_parse(path, false /*is_dependency*/);
+    bool needs_reparse = is_interactive;
 
-    // Target file does not exist on disk, do not emit any indexes.
-    // TODO: Dependencies should be reassigned to other files. We can do this by
-    // updating the "primary_file" if it doesn't exist. Might not actually be a
-    // problem in practice.
-    if (path_state == FileParseQuery::NoSuchFile)
-      return result;
+    // The manifest has already checked the timestamps for this file and all of
+    // its dependencies, so there is no need to check them again.
+    if (!load_from_cache || is_interactive) {
+      // Check timestamps and update |file_consumer_shared|.
+      FileParseQuery path_state =
+          file_needs_parse(path, false /*is_dependency*/);
 
-    bool needs_reparse =
-        is_interactive || path_state == FileParseQuery::NeedsParse;
+      // Target file does not exist on disk, do not emit any indexes.
+      // TODO: Dependencies should be reassigned to other files. We can do this
+      // by updating the "primary_file" if it doesn't exist. Might not actually
+      // be a problem in practice.
+      if (path_state == FileParseQuery::NoSuchFile)
+        return result;
 
-    for (const std::string& dependency : previous_index->dependencies) {
-      assert(!dependency.empty());
+      needs_reparse =
+          needs_reparse || path_state == FileParseQuery::NeedsParse;
 
-      // note: Use != as there are multiple failure results for FileParseQuery.
-      if (file_needs_parse(dependency, true /*is_dependency*/) !=
-          FileParseQuery::DoesNotNeedParse) {
-        LOG_S(INFO) << "Timestamp has changed for " << dependency << " (via "
-                    << previous_index->path << ")";
-        needs_reparse = true;
-        // SUBTLE: Do not break here, as |file_consumer_shared| is updated
-        // inside of |file_needs_parse|.
+      for (const std::string& dependency : previous_index->dependencies) {
+        assert(!dependency.empty());
+
+        // note: Use != as there are multiple failure results for
+        // FileParseQuery.
+        if (file_needs_parse(dependency, true /*is_dependency*/) !=
+            FileParseQuery::DoesNotNeedParse) {
+          LOG_S(INFO) << "Timestamp has changed for " << dependency
+                      << " (via " << path << ")";
+          needs_reparse = true;
+          // SUBTLE: Do not break here, as |file_consumer_shared| is updated
+          // inside of |file_needs_parse|.
+        }
       }
     }
 
-    // No timestamps changed - load directly from cache.
+    // No timestamps changed - load directly from cache. Only now do we pay
+    // for deserializing the full indexes.
+    std::unique_ptr<IndexFile> cached_index;
     if (!needs_reparse) {
+      cached_index = cache_loader->TryLoad(path);
+      LOG_IF_S(ERROR, !cached_index)
+          << "Found cache header but no index for " << path;
+    }
+    if (cached_index) {
       LOG_S(INFO) << "Skipping parse; no timestamp change for " << path;
 
       // TODO/FIXME: real perf
       PerformanceImportFile perf;
-      result.push_back(Index_DoIdMap(cache_loader->TakeOrLoad(path), perf,
+      result.push_back(Index_DoIdMap(std::move(cached_index), perf,
                                      is_interactive, false /*write_to_disk*/));
       for (const std::string& dependency : previous_index->dependencies) {
         // Only load a dependency if it is not already loaded.
         //
         // This is important for perf in large projects where there are lots of
         // dependencies shared between many files.
-        if (!file_consumer_shared->Mark(dependency))
+        int64_t generation;
+        if (!file_consumer_shared->Mark(dependency, &generation))
           continue;
 
         LOG_S(INFO) << "Emitting index result for " << dependency << " (via "
-                    << previous_index->path << ")";
+                    << path << ")";
 
         std::unique_ptr<IndexFile> dependency_index =
-            cache_loader->TryTakeOrLoad(dependency);
+            cache_loader->TryLoad(dependency);
 
         // |dependency_index| may be null if there is no cache for it but
         // another file has already started importing it.
         if (!dependency_index)
           continue;
+        dependency_index->file_consumer_generation_ = generation;
 
         result.push_back(Index_DoIdMap(std::move(dependency_index), perf,
                                        is_interactive,
@@ -971,17 +1375,16 @@ std::vector<Index_DoIdMap> DoParseFile(
     loaded_primary = loaded_primary || contents->path == path;
     file_contents.push_back(*contents);
   }
-  for (const auto& it : cache_loader->caches) {
-    const std::unique_ptr<IndexFile>& index = it.second;
-    assert(index);
-    optional<std::string> index_content = ReadContent(index->path);
+  for (const auto& it : cache_loader->headers) {
+    const std::string& index_path = it.first;
+    optional<std::string> index_content = ReadContent(index_path);
     if (!index_content) {
-      LOG_S(ERROR) << "Failed to preload index content for " << index->path;
+      LOG_S(ERROR) << "Failed to preload index content for " << index_path;
       continue;
     }
-    file_contents.push_back(FileContents(index->path, *index_content));
+    file_contents.push_back(FileContents(index_path, *index_content));
 
-    loaded_primary = loaded_primary || index->path == path;
+    loaded_primary = loaded_primary || index_path == path;
   }
   if (!loaded_primary) {
     optional<std::string> content = ReadContent(path);
@@ -993,8 +1396,9 @@ std::vector<Index_DoIdMap> DoParseFile(
   }
 
   PerformanceImportFile perf;
-  std::vector<std::unique_ptr<IndexFile>> indexes = Parse(
-      config, file_consumer_shared, path, args, file_contents, &perf, index);
+  std::vector<std::unique_ptr<IndexFile>> indexes =
+      Parse(config, file_consumer_shared, path, args, file_contents, &perf,
+            index, false /*dump_ast*/, is_cancelled);
   for (std::unique_ptr<IndexFile>& new_index : indexes) {
     Timer time;
 
@@ -1004,8 +1408,7 @@ std::vector<Index_DoIdMap> DoParseFile(
     if (!is_interactive)
       EmitDiagnostics(working_files, new_index->path, new_index->diagnostics_);
 
-    // When main thread does IdMap request it will request the previous index if
-    // needed.
+    // The IdMap step will load the previous index if needed.
     LOG_S(INFO) << "Emitting index result for " << new_index->path;
     result.push_back(Index_DoIdMap(std::move(new_index), perf, is_interactive,
                                    true /*write_to_disk*/));
@@ -1036,8 +1439,7 @@ void IndexWithTuFromCodeCompletion(
   for (std::unique_ptr<IndexFile>& new_index : indexes) {
     Timer time;
 
-    // When main thread does IdMap request it will request the previous index if
-    // needed.
+    // The IdMap step will load the previous index if needed.
     LOG_S(INFO) << "Emitting index result for " << new_index->path;
     result.push_back(Index_DoIdMap(std::move(new_index), perf,
                                    true /*is_interactive*/,
@@ -1047,7 +1449,8 @@ void IndexWithTuFromCodeCompletion(
   LOG_IF_S(WARNING, result.size() > 1)
       << "Code completion index update generated more than one index";
 
-  queue->do_id_map.EnqueueAll(std::move(result));
+  for (Index_DoIdMap& request : result)
+    queue->EnqueueDoIdMap(std::move(request));
 }
 
 std::vector<Index_DoIdMap> ParseFile(
@@ -1057,23 +1460,28 @@ std::vector<Index_DoIdMap> ParseFile(
     FileConsumer::SharedState* file_consumer_shared,
     TimestampManager* timestamp_manager,
     ImportManager* import_manager,
+    CacheWriter* cache_writer,
     bool is_interactive,
+    bool load_from_cache,
     const Project::Entry& entry,
-    const optional<std::string>& contents) {
+    const optional<std::string>& contents,
+    const std::function<bool()>& is_cancelled) {
   optional<FileContents> file_contents;
   if (contents)
     file_contents = FileContents(entry.filename, *contents);
 
-  CacheLoader cache_loader(config);
+  CacheLoader cache_loader(config, cache_writer);
 
   // Try to determine the original import file by loading the file from cache.
   // This lets the user request an index on a header file, which clang will
   // complain about if indexed by itself.
-  IndexFile* entry_cache = cache_loader.TryLoad(entry.filename);
+  const IndexFileHeader* entry_cache =
+      cache_loader.TryLoadHeader(entry.filename);
   std::string tu_path = entry_cache ? entry_cache->import_file : entry.filename;
   return DoParseFile(config, working_files, index, file_consumer_shared,
                      timestamp_manager, import_manager, &cache_loader,
-                     is_interactive, tu_path, entry.args, file_contents);
+                     is_interactive, load_from_cache, tu_path, entry.args,
+                     file_contents, is_cancelled);
 }
 
 bool IndexMain_DoParse(Config* config,
@@ -1082,34 +1490,74 @@ bool IndexMain_DoParse(Config* config,
                        FileConsumer::SharedState* file_consumer_shared,
                        TimestampManager* timestamp_manager,
                        ImportManager* import_manager,
-                       ClangIndex* index) {
-  optional<Index_Request> request = queue->index_request.TryDequeue();
+                       CacheWriter* cache_writer,
+                       int indexer) {
+  optional<Index_Request> request = queue->DequeueIndexRequest();
   if (!request)
     return false;
 
+  // Prioritize the files included by a file which was just opened while it is
+  // being parsed. They are refreshed once the file has been indexed.
+  if (request->is_interactive) {
+    optional<IndexFileHeader> header =
+        LoadCachedIndexHeader(config, request->path);
+    if (header) {
+      queue->on_dependencies.Enqueue(
+          Index_OnDependencies(request->path, std::move(header->dependencies)));
+    }
+  }
+
+  // TODO: dispose of index after it is not used for a while.
+  ClangIndex index;
+
   Project::Entry entry;
   entry.filename = request->path;
   entry.args = request->args;
   std::vector<Index_DoIdMap> responses = ParseFile(
-      config, working_files, index, file_consumer_shared, timestamp_manager,
-      import_manager, request->is_interactive, entry, request->contents);
+      config, working_files, &index, file_consumer_shared, timestamp_manager,
+      import_manager, cache_writer, request->is_interactive,
+      request->load_from_cache, entry, request->contents,
+      [&request]() { return request->IsObsolete(); });
+  queue->FinishIndexRequest(*request);
+  queue->indexer_pool->OnRequestDone();
+
+  // A newer request for the file arrived while this one was being indexed.
+  // Drop the results before querydb spends time on them, and let the newer
+  // request index the files this one took ownership of. A file which the
+  // newer request has already reset and taken again is left alone.
+  if (request->IsObsolete()) {
+    LOG_S(INFO) << "Discarding obsolete index results for " << request->path;
+    for (const Index_DoIdMap& response : responses) {
+      file_consumer_shared->Release(
+          response.current->path,
+          response.current->file_consumer_generation_);
+    }
+    return true;
+  }
 
   // Don't bother sending an IdMap request if there are no responses.
   if (responses.empty())
     return false;
 
-  // EnqueueAll will clear |responses|.
-  queue->do_id_map.EnqueueAll(std::move(responses));
+  for (Index_DoIdMap& response : responses) {
+    response.indexer = indexer;
+    if (response.write_to_disk)
+      ++queue->parsed_file_count;
+    else
+      ++queue->cached_file_count;
+  }
+
+  for (Index_DoIdMap& response : responses)
+    queue->EnqueueDoIdMap(std::move(response));
   return true;
 }
 
-bool IndexMain_DoCreateIndexUpdate(Config* config,
+void IndexMain_DoCreateIndexUpdate(Config* config,
                                    QueueManager* queue,
-                                   TimestampManager* timestamp_manager) {
-  optional<Index_OnIdMapped> response = queue->on_id_mapped.TryDequeue();
-  if (!response)
-    return false;
-
+                                   TimestampManager* timestamp_manager,
+                                   CacheWriter* cache_writer,
+                                   WorkingFiles* working_files,
+                                   std::unique_ptr<Index_OnIdMapped> response) {
   Timer time;
 
   IdMap* previous_id_map = nullptr;
@@ -1127,16 +1575,30 @@ bool IndexMain_DoCreateIndexUpdate(Config* config,
   LOG_S(INFO) << "Built index update for " << response->current->file->path
               << " (is_delta=" << !!response->previous << ")";
 
-  // Write current index to disk if requested.
+  // querydb needs the indexed contents of open files to map index positions
+  // to the buffer. A freshly parsed index still has them in memory.
+  std::string path = response->current->file->path;
+  optional<std::string> indexed_contents;
+  if (working_files->GetFileByFilename(path)) {
+    if (!response->current->file->file_contents_.empty()) {
+      indexed_contents = response->current->file->file_contents_;
+    } else {
+      cache_writer->Flush(path);
+      indexed_contents = LoadCachedFileContents(config, path);
+    }
+  }
+
+  // Write current index to disk if requested. The write happens on the cache
+  // writer thread; the index is not needed here after the delta is built.
   if (response->write_to_disk) {
-    LOG_S(INFO) << "Writing cached index to disk for "
+    LOG_S(INFO) << "Queueing cached index write for "
                 << response->current->file->path;
     time.Reset();
-    WriteToCache(config, *response->current->file);
-    response->perf.index_save_to_disk = time.ElapsedMicrosecondsAndReset();
     timestamp_manager->UpdateCachedModificationTime(
         response->current->file->path,
         response->current->file->last_modification_time);
+    cache_writer->Enqueue(std::move(response->current->file));
+    response->perf.index_queue_cache_write = time.ElapsedMicrosecondsAndReset();
   }
 
 #if false
@@ -1150,9 +1612,9 @@ bool IndexMain_DoCreateIndexUpdate(Config* config,
   output << "[perf]";
   PRINT_SECTION(index_parse);
   PRINT_SECTION(index_build);
-  PRINT_SECTION(index_save_to_disk);
+  PRINT_SECTION(index_queue_cache_write);
   PRINT_SECTION(index_load_cached);
-  PRINT_SECTION(querydb_id_map);
+  PRINT_SECTION(index_id_map);
   PRINT_SECTION(index_make_delta);
   output << "\n       total: " << FormatMicroseconds(total);
   output << " path: " << response->current_index->path;
@@ -1165,33 +1627,92 @@ bool IndexMain_DoCreateIndexUpdate(Config* config,
 #endif
 
   Index_OnIndexed reply(update, response->perf);
+  if (indexed_contents)
+    reply.indexed_contents[path] = std::move(*indexed_contents);
   queue->on_indexed.Enqueue(std::move(reply));
-
-  return true;
 }
 
-bool IndexMain_LoadPreviousIndex(Config* config, QueueManager* queue) {
-  optional<Index_DoIdMap> response = queue->load_previous_index.TryDequeue();
-  if (!response)
+// Builds the IdMaps for the newest index of |indexer|, or one stolen from
+// another indexer, and creates its index update. Returns false if there were
+// no indexes waiting for an IdMap.
+bool IndexMain_DoIdMap(Config* config,
+                       QueryDatabase* db,
+                       ImportManager* import_manager,
+                       QueueManager* queue,
+                       TimestampManager* timestamp_manager,
+                       CacheWriter* cache_writer,
+                       WorkingFiles* working_files,
+                       int indexer) {
+  optional<Index_DoIdMap> request = queue->do_id_map->TryDequeue(indexer);
+  if (!request)
     return false;
 
-  response->previous = LoadCachedIndex(config, response->current->path);
-  LOG_IF_S(ERROR, !response->previous)
-      << "Unable to load previous index for already imported index "
-      << response->current->path;
+  assert(request->current);
+
+  // Check if the file is already being imported into querydb. If it is, drop
+  // the request. Otherwise no other update of the file can be applied until
+  // this one is done, so whether querydb has the file cannot change below.
+  if (!import_manager->StartQueryDbImport(request->current->path)) {
+    LOG_S(INFO) << "Dropping index as it is already being imported for "
+                << request->current->path;
+    return true;
+  }
+
+  // If the request does not have previous state and querydb has applied an
+  // index of the file, load the previous state from disk so only the delta is
+  // applied. An IdMap interns the file before its update is applied, so check
+  // for the definition rather than the id.
+  bool is_imported;
+  {
+    SharedLock lock(queue->querydb_mutex);
+    optional<QueryFileId> file_id = db->GetQueryFileId(request->current->path);
+    is_imported = file_id && db->files[file_id->id].def;
+  }
+  if (!request->previous && is_imported) {
+    Timer time;
+    cache_writer->Flush(request->current->path);
+    request->previous = LoadCachedIndex(config, request->current->path);
+    LOG_IF_S(ERROR, !request->previous)
+        << "Unable to load previous index for already imported index "
+        << request->current->path;
+    request->perf.index_load_cached += time.ElapsedMicroseconds();
+  }
+
+  auto response = MakeUnique<Index_OnIdMapped>(
+      request->perf, request->is_interactive, request->write_to_disk);
+  Timer time;
+
+  auto make_map = [db](std::unique_ptr<IndexFile> file)
+      -> std::unique_ptr<Index_OnIdMapped::File> {
+    if (!file)
+      return nullptr;
+
+    auto id_map = MakeUnique<IdMap>(db, file->id_cache);
+    return MakeUnique<Index_OnIdMapped::File>(std::move(file),
+                                              std::move(id_map));
+  };
+  response->current = make_map(std::move(request->current));
+  response->previous = make_map(std::move(request->previous));
+  response->perf.index_id_map = time.ElapsedMicrosecondsAndReset();
 
-  queue->do_id_map.Enqueue(std::move(*response));
+  IndexMain_DoCreateIndexUpdate(config, queue, timestamp_manager, cache_writer,
+                                working_files, std::move(response));
   return true;
 }
 
-bool IndexMergeIndexUpdates(QueueManager* queue) {
+// Merges queued index updates until the merged update has |max_size| entries.
+// querydb imports an update in one go, so it must not grow without bound.
+bool IndexMergeIndexUpdates(QueueManager* queue, int max_size) {
   optional<Index_OnIndexed> root = queue->on_indexed.TryDequeue();
   if (!root)
     return false;
 
   bool did_merge = false;
+  size_t size = root->update.Size();
   while (true) {
-    optional<Index_OnIndexed> to_join = queue->on_indexed.TryDequeue();
+    optional<Index_OnIndexed> to_join;
+    if (max_size <= 0 || size < static_cast<size_t>(max_size))
+      to_join = queue->on_indexed.TryDequeue();
     if (!to_join) {
       queue->on_indexed.Enqueue(std::move(*root));
       return did_merge;
@@ -1199,7 +1720,10 @@ bool IndexMergeIndexUpdates(QueueManager* queue) {
 
     did_merge = true;
     Timer time;
+    size += to_join->update.Size();
     root->update.Merge(to_join->update);
+    for (auto& entry : to_join->indexed_contents)
+      root->indexed_contents[entry.first] = std::move(entry.second);
     // time.ResetAndPrint("Joined querydb updates for files: " +
     // StringJoinMap(root->update.files_def_update,
     //[](const QueryFile::DefUpdate& update) {
@@ -1209,47 +1733,50 @@ bool IndexMergeIndexUpdates(QueueManager* queue) {
 }
 
 WorkThread::Result IndexMain(Config* config,
+                             QueryDatabase* db,
                              FileConsumer::SharedState* file_consumer_shared,
                              TimestampManager* timestamp_manager,
                              ImportManager* import_manager,
+                             CacheWriter* cache_writer,
                              Project* project,
                              WorkingFiles* working_files,
                              MultiQueueWaiter* waiter,
-                             QueueManager* queue) {
+                             QueueManager* queue,
+                             int indexer) {
+  // Stay parked while the pool does not need this indexer.
+  IndexerPool* pool = queue->indexer_pool.get();
+  if (!pool->IsActive(indexer)) {
+    waiter->WaitUntil([&]() {
+      return pool->IsActive(indexer) || WorkThread::request_exit_on_idle;
+    });
+    return WorkThread::Result::NoWork;
+  }
+
   EmitProgress(config, queue);
 
-  // TODO: dispose of index after it is not used for a while.
-  ClangIndex index;
+  ++queue->indexer_iterations_started;
 
-  // TODO: process all off IndexMain_DoIndex before calling
-  // IndexMain_DoCreateIndexUpdate for
-  //       better icache behavior. We need to have some threads spinning on
-  //       both though
-  //       otherwise memory usage will get bad.
-
-  // We need to make sure to run both IndexMain_DoParse and
-  // IndexMain_DoCreateIndexUpdate so we don't starve querydb from doing any
-  // work. Running both also lets the user query the partially constructed
-  // index.
-  bool did_parse =
+  // Every call runs a single task. Building the IdMap and index update of an
+  // already parsed file is cheap and feeds querydb, so it always goes first; a
+  // parse is only started once there are none left anywhere in the pool. This
+  // way a long parse never delays them, and they never delay the next parse by
+  // more than the time it takes to drain them.
+  bool did_work =
+      IndexMain_DoIdMap(config, db, import_manager, queue, timestamp_manager,
+                        cache_writer, working_files, indexer) ||
       IndexMain_DoParse(config, working_files, queue, file_consumer_shared,
-                        timestamp_manager, import_manager, &index);
-
-  bool did_create_update =
-      IndexMain_DoCreateIndexUpdate(config, queue, timestamp_manager);
+                        timestamp_manager, import_manager, cache_writer,
+                        indexer) ||
+      // Nothing to index and no index updates to create, so join some already
+      // created index updates to reduce work on querydb thread.
+      IndexMergeIndexUpdates(queue, config->indexUpdateMaxSize);
 
-  bool did_load_previous = IndexMain_LoadPreviousIndex(config, queue);
-
-  // Nothing to index and no index updates to create, so join some already
-  // created index updates to reduce work on querydb thread.
-  bool did_merge = false;
-  if (!did_parse && !did_create_update && !did_load_previous)
-    did_merge = IndexMergeIndexUpdates(queue);
+  ++queue->indexer_iterations_finished;
 
   // We didn't do any work, so wait for a notification.
-  if (!did_parse && !did_create_update && !did_merge && !did_load_previous) {
-    waiter->Wait({&queue->index_request, &queue->on_id_mapped,
-                  &queue->load_previous_index, &queue->on_indexed});
+  if (!did_work) {
+    waiter->Wait({&queue->index_request, queue->do_id_map.get(),
+                  &queue->on_indexed});
   }
 
   return queue->HasWork() ? WorkThread::Result::MoreWork
@@ -1263,107 +1790,99 @@ bool QueryDb_ImportMain(Config* config,
                         WorkingFiles* working_files) {
   EmitProgress(config, queue);
 
+  // Import updates for at most |indexImportBudgetMs| so that client messages
+  // which arrive in the meantime are not stuck behind a long import queue.
+  // The remaining updates are imported in the next slice, after the querydb
+  // main loop has handled pending messages.
+  Timer slice_time;
+  long long budget_us = config->indexImportBudgetMs * 1000LL;
+  int imported_count = 0;
+  uint64_t update_working_file_us = 0;
+  uint64_t apply_index_update_us = 0;
+
   bool did_work = false;
 
   while (true) {
-    optional<Index_DoIdMap> request = queue->do_id_map.TryDequeue();
-    if (!request)
+    if (did_work && budget_us > 0 &&
+        slice_time.ElapsedMicroseconds() >= budget_us)
       break;
-    did_work = true;
-
-    assert(request->current);
-
-    // If the request does not have previous state and we have already imported
-    // it, load the previous state from disk and rerun IdMap logic later. Do not
-    // do this if we have already attempted in the past.
-    if (!request->load_previous && !request->previous &&
-        db->usr_to_file.find(LowerPathIfCaseInsensitive(
-            request->current->path)) != db->usr_to_file.end()) {
-      assert(!request->load_previous);
-      request->load_previous = true;
-      queue->load_previous_index.Enqueue(std::move(*request));
-      continue;
-    }
-
-    // Check if the file is already being imported into querydb. If it is, drop
-    // the request.
-    //
-    // Note, we must do this *after* we have checked for the previous index,
-    // otherwise we will never actually generate the IdMap.
-    if (!import_manager->StartQueryDbImport(request->current->path)) {
-      LOG_S(INFO) << "Dropping index as it is already being imported for "
-                  << request->current->path;
-      continue;
-    }
 
-    Index_OnIdMapped response(request->perf, request->is_interactive,
-                              request->write_to_disk);
-    Timer time;
-
-    auto make_map = [db](std::unique_ptr<IndexFile> file)
-        -> std::unique_ptr<Index_OnIdMapped::File> {
-      if (!file)
-        return nullptr;
-
-      auto id_map = MakeUnique<IdMap>(db, file->id_cache);
-      return MakeUnique<Index_OnIdMapped::File>(std::move(file),
-                                                std::move(id_map));
-    };
-    response.current = make_map(std::move(request->current));
-    response.previous = make_map(std::move(request->previous));
-    response.perf.querydb_id_map = time.ElapsedMicrosecondsAndReset();
-
-    queue->on_id_mapped.Enqueue(std::move(response));
-  }
-
-  while (true) {
     optional<Index_OnIndexed> response = queue->on_indexed.TryDequeue();
     if (!response)
       break;
 
     did_work = true;
+    ++imported_count;
 
+    // The indexer attached the indexed contents of open files. A file which
+    // was opened after it was indexed falls back to its buffer. Only this
+    // thread modifies |working_files|, so reading it without the lock is fine.
     Timer time;
-
+    std::vector<std::pair<WorkingFile*, std::string>> index_contents;
     for (auto& updated_file : response->update.files_def_update) {
-      // TODO: We're reading a file on querydb thread. This is slow!! If this
-      // a real problem in practice we can load the file in a previous stage.
-      // It should be fine though because we only do it if the user has the
-      // file open.
       WorkingFile* working_file =
           working_files->GetFileByFilename(updated_file.path);
-      if (working_file) {
-        optional<std::string> cached_file_contents =
-            LoadCachedFileContents(config, updated_file.path);
-        if (cached_file_contents)
-          working_file->SetIndexContent(*cached_file_contents);
-        else
-          working_file->SetIndexContent(working_file->buffer_content);
-        time.ResetAndPrint(
-            "Update WorkingFile index contents (via disk load) for " +
-            updated_file.path);
+      if (!working_file)
+        continue;
+      auto it = response->indexed_contents.find(updated_file.path);
+      index_contents.emplace_back(working_file,
+                                  it != response->indexed_contents.end()
+                                      ? std::move(it->second)
+                                      : working_file->buffer_content);
+    }
 
-        // Update inactive region.
-        EmitInactiveLines(working_file, updated_file.inactive_regions);
+    {
+      std::lock_guard<SharedMutex> lock(queue->querydb_mutex);
+      for (auto& entry : index_contents)
+        entry.first->SetIndexContent(entry.second);
+      response->perf.querydb_update_working_file = time.ElapsedMicroseconds();
+      if (!index_contents.empty()) {
+        time.ResetAndPrint(
+            "Update WorkingFile index contents for " +
+            StringJoinMap(
+                index_contents,
+                [](const std::pair<WorkingFile*, std::string>& entry) {
+                  return entry.first->filename;
+                }));
       }
+
+      time.Reset();
+      db->ApplyIndexUpdate(&response->update);
+      response->perf.querydb_apply_index_update = time.ElapsedMicroseconds();
+      time.ResetAndPrint("Applying index update for " +
+                         StringJoinMap(response->update.files_def_update,
+                                       [](const QueryFile::DefUpdate& value) {
+                                         return value.path;
+                                       }));
     }
 
-    time.Reset();
-    db->ApplyIndexUpdate(&response->update);
-    time.ResetAndPrint("Applying index update for " +
-                       StringJoinMap(response->update.files_def_update,
-                                     [](const QueryFile::DefUpdate& value) {
-                                       return value.path;
-                                     }));
+    for (auto& updated_file : response->update.files_def_update) {
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(updated_file.path);
+      if (!working_file)
+        continue;
+
+      // Update inactive region.
+      EmitInactiveLines(working_file, updated_file.inactive_regions);
+
+      // Now that the includes of the open file are known, index the files
+      // which implement them first.
+      std::vector<std::string> dependencies;
+      for (const IndexInclude& include : updated_file.includes)
+        dependencies.push_back(include.resolved_path);
+      if (queue->index_request_prioritizer.SetDependencies(updated_file.path,
+                                                           dependencies))
+        queue->ReprioritizeIndexRequests();
+    }
 
     // Update semantic highlighting.
     for (auto& updated_file : response->update.files_def_update) {
       WorkingFile* working_file =
           working_files->GetFileByFilename(updated_file.path);
-      if (working_file) {
-        QueryFileId file_id =
-            db->usr_to_file[LowerPathIfCaseInsensitive(working_file->filename)];
-        QueryFile* file = &db->files[file_id.id];
+      optional<QueryFileId> file_id =
+          working_file ? db->GetQueryFileId(working_file->filename) : nullopt;
+      if (file_id) {
+        QueryFile* file = &db->files[file_id->id];
         EmitSemanticHighlighting(db, working_file, file);
       }
     }
@@ -1372,6 +1891,20 @@ bool QueryDb_ImportMain(Config* config,
     // update.
     for (auto& updated_file : response->update.files_def_update)
       import_manager->DoneQueryDbImport(updated_file.path);
+
+    update_working_file_us += response->perf.querydb_update_working_file;
+    apply_index_update_us += response->perf.querydb_apply_index_update;
+  }
+
+  if (did_work) {
+    LOG_S(INFO) << "[perf] Import slice: " << imported_count
+                << " index updates in "
+                << FormatMicroseconds(slice_time.ElapsedMicroseconds())
+                << " (querydb_update_working_file: "
+                << FormatMicroseconds(update_working_file_us)
+                << ", querydb_apply_index_update: "
+                << FormatMicroseconds(apply_index_update_us) << "), "
+                << queue->on_indexed.Size() << " remaining";
   }
 
   return did_work;
@@ -1395,72 +1928,735 @@ bool QueryDb_ImportMain(Config* config,
 // QUERYDB MAIN ////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-bool QueryDbMainLoop(Config* config,
-                     QueryDatabase* db,
-                     bool* exit_when_idle,
-                     MultiQueueWaiter* waiter,
-                     QueueManager* queue,
-                     Project* project,
-                     FileConsumer::SharedState* file_consumer_shared,
-                     ImportManager* import_manager,
-                     TimestampManager* timestamp_manager,
-                     WorkingFiles* working_files,
-                     ClangCompleteManager* clang_complete,
-                     IncludeComplete* include_complete,
-                     CodeCompleteCache* global_code_complete_cache,
-                     CodeCompleteCache* non_global_code_complete_cache,
-                     CodeCompleteCache* signature_cache) {
-  IpcManager* ipc = IpcManager::instance();
+// Scanning the cache takes a while, so it is done in the background.
+void StartCacheCollection(Config* config,
+                          CacheManifest* cache_manifest,
+                          Project* project,
+                          bool report_to_client) {
+  std::vector<std::string> project_files;
+  project_files.reserve(project->entries.size());
+  for (const Project::Entry& entry : project->entries)
+    project_files.push_back(entry.filename);
+
+  WorkThread::StartThread("cachegc", [=]() {
+    CacheCollectionStats stats =
+        CollectCacheGarbage(config, cache_manifest, project_files);
+    if (report_to_client) {
+      Out_ShowLogMessage out;
+      out.display_type = Out_ShowLogMessage::DisplayType::Show;
+      out.params.type = lsMessageType::Info;
+      out.params.message =
+          "cquery: removed " + std::to_string(stats.removed_files) +
+          " stale and evicted " + std::to_string(stats.evicted_files) +
+          " cached files, reclaiming " +
+          std::to_string(stats.reclaimed_bytes / (1024 * 1024)) +
+          " MB. The cache now uses " +
+          std::to_string(stats.remaining_bytes / (1024 * 1024)) + " MB.";
+      IpcManager::instance()->SendOutMessageToClient(IpcId::Cout, out);
+    }
+    return WorkThread::Result::ExitThread;
+  });
+}
 
-  bool did_work = false;
+// Periodically resizes |queue->indexer_pool|.
+void StartIndexerPoolThread(Config* config,
+                            QueueManager* queue,
+                            ClangCompleteManager* clang_complete,
+                            MultiQueueWaiter* waiter) {
+  Timer time;
+  WorkThread::StartThread("indexerpool", [=]() mutable {
+    std::this_thread::sleep_for(IndexerPool::kUpdateInterval);
+
+    IndexerPool* pool = queue->indexer_pool.get();
+    IndexerPool::Sample sample;
+    sample.elapsed_seconds = time.ElapsedMicrosecondsAndReset() / 1000000.0;
+    sample.completed = pool->TakeCompletedCount();
+    sample.has_pending_work = !queue->index_request.IsEmpty();
+    sample.load_average = GetSystemLoadAverage();
+    sample.memory_used_mb = GetProcessMemoryUsedInMb();
+    sample.is_foreground_busy = clang_complete->IsBusy();
+    if (pool->Update(sample)) {
+      LOG_S(INFO) << "Running " << pool->active_count() << " of "
+                  << config->indexerCount << " indexers";
+      // Wake up indexers which have been reactivated.
+      waiter->Notify();
+    }
 
-  std::vector<std::unique_ptr<BaseIpcMessage>> messages =
-      ipc->GetMessages(IpcManager::Destination::Server);
-  for (auto& message : messages) {
-    did_work = true;
+    return WorkThread::Result::NoWork;
+  });
+}
 
-    switch (message->method_id) {
-      case IpcId::Initialize: {
-        auto request = message->As<Ipc_InitializeRequest>();
+// Answers a request for which IsQueryDbReadRequest() is true. The caller must
+// hold |queue->querydb_mutex| shared.
+void QueryDbHandleReadRequest(Config* config,
+                              QueryDatabase* db,
+                              WorkingFiles* working_files,
+                              BaseIpcMessage* message) {
+  IpcManager* ipc = IpcManager::instance();
 
-        // Log initialization parameters.
-        rapidjson::StringBuffer output;
-        Writer writer(output);
-        Reflect(writer, request->params.initializationOptions);
-        std::cerr << output.GetString() << std::endl;
+  switch (message->method_id) {
+    case IpcId::CqueryTypeHierarchyTree: {
+      auto msg = message->As<Ipc_CqueryTypeHierarchyTree>();
 
-        if (request->params.rootUri) {
-          std::string project_path = request->params.rootUri->GetPath();
-          LOG_S(INFO) << "[querydb] Initialize in directory " << project_path
-                      << " with uri " << request->params.rootUri->raw_uri;
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
 
-          if (!request->params.initializationOptions) {
-            LOG_S(FATAL) << "Initialization parameters (particularily "
-                            "cacheDirectory) are required";
-            exit(1);
-          }
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
 
-          *config = *request->params.initializationOptions;
+      Out_CqueryTypeHierarchyTree response;
+      response.id = msg->id;
 
-          // Check client version.
-          if (config->clientVersion != kExpectedClientVersion &&
-              config->clientVersion != -1 /*disable check*/) {
-            Out_ShowLogMessage out;
-            out.display_type = Out_ShowLogMessage::DisplayType::Show;
-            out.params.type = lsMessageType::Error;
-            out.params.message =
-                "cquery client (v" + std::to_string(config->clientVersion) +
-                ") and server (v" + std::to_string(kExpectedClientVersion) +
-                ") version mismatch. Please update ";
-            if (config->clientVersion > kExpectedClientVersion)
-              out.params.message += "the cquery binary.";
-            else
-              out.params.message +=
-                  "your extension client (VSIX file). Make sure to uninstall "
-                  "the cquery extension and restart vscode before "
-                  "reinstalling.";
-            out.Write(std::cout);
-          }
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        if (ref.idx.kind == SymbolKind::Type) {
+          response.result = BuildInheritanceHierarchyForType(
+              db, working_files, QueryTypeId(ref.idx.idx));
+          break;
+        }
+        if (ref.idx.kind == SymbolKind::Func) {
+          response.result = BuildInheritanceHierarchyForFunc(
+              db, working_files, QueryFuncId(ref.idx.idx));
+          break;
+        }
+      }
+
+      ipc->SendOutMessageToClient(IpcId::CqueryTypeHierarchyTree, response);
+      break;
+    }
+
+    case IpcId::CqueryCallTreeInitial: {
+      auto msg = message->As<Ipc_CqueryCallTreeInitial>();
+
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_CqueryCallTree response;
+      response.id = msg->id;
+
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        if (ref.idx.kind == SymbolKind::Func) {
+          response.result = BuildInitialCallTree(db, working_files,
+                                                 QueryFuncId(ref.idx.idx));
+          break;
+        }
+      }
+
+      if (msg->IsCancelled()) {
+        ReplyCancelled(msg);
+        break;
+      }
+      ipc->SendOutMessageToClient(IpcId::CqueryCallTreeInitial, response);
+      break;
+    }
+
+    case IpcId::CqueryCallTreeExpand: {
+      auto msg = message->As<Ipc_CqueryCallTreeExpand>();
+
+      Out_CqueryCallTree response;
+      response.id = msg->id;
+
+      optional<QueryFuncId> func_id = db->GetQueryFuncId(msg->params.usr);
+      if (func_id)
+        response.result = BuildExpandCallTree(db, working_files, *func_id);
+
+      if (msg->IsCancelled()) {
+        ReplyCancelled(msg);
+        break;
+      }
+      ipc->SendOutMessageToClient(IpcId::CqueryCallTreeExpand, response);
+      break;
+    }
+
+    case IpcId::CqueryVars: {
+      auto msg = message->As<Ipc_CqueryVars>();
+
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_LocationList response;
+      response.id = msg->id;
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        if (ref.idx.kind == SymbolKind::Type) {
+          QueryType& type = db->types[ref.idx.idx];
+          std::vector<QueryLocation> locations =
+              ToQueryLocation(db, type.instances);
+          response.result = GetLsLocations(db, working_files, locations);
+        }
+      }
+      ipc->SendOutMessageToClient(IpcId::CqueryVars, response);
+      break;
+    }
+
+    case IpcId::CqueryCallers: {
+      auto msg = message->As<Ipc_CqueryCallers>();
+
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_LocationList response;
+      response.id = msg->id;
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        if (ref.idx.kind == SymbolKind::Func) {
+          QueryFunc& func = db->funcs[ref.idx.idx];
+          std::vector<QueryLocation> locations =
+              ToQueryLocation(db, func.callers);
+          for (QueryFuncRef func_ref :
+               GetCallersForAllBaseFunctions(db, func))
+            locations.push_back(func_ref.loc);
+          for (QueryFuncRef func_ref :
+               GetCallersForAllDerivedFunctions(db, func))
+            locations.push_back(func_ref.loc);
+
+          response.result = GetLsLocations(db, working_files, locations);
+        }
+      }
+      ipc->SendOutMessageToClient(IpcId::CqueryCallers, response);
+      break;
+    }
+
+    case IpcId::CqueryBase: {
+      auto msg = message->As<Ipc_CqueryBase>();
+
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_LocationList response;
+      response.id = msg->id;
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        if (ref.idx.kind == SymbolKind::Type) {
+          QueryType& type = db->types[ref.idx.idx];
+          if (!type.def)
+            continue;
+          std::vector<QueryLocation> locations =
+              ToQueryLocation(db, type.def->parents);
+          response.result = GetLsLocations(db, working_files, locations);
+        } else if (ref.idx.kind == SymbolKind::Func) {
+          QueryFunc& func = db->funcs[ref.idx.idx];
+          optional<QueryLocation> location =
+              GetBaseDefinitionOrDeclarationSpelling(db, func);
+          if (!location)
+            continue;
+          optional<lsLocation> ls_loc =
+              GetLsLocation(db, working_files, *location);
+          if (!ls_loc)
+            continue;
+          response.result.push_back(*ls_loc);
+        }
+      }
+      ipc->SendOutMessageToClient(IpcId::CqueryBase, response);
+      break;
+    }
+
+    case IpcId::CqueryDerived: {
+      auto msg = message->As<Ipc_CqueryDerived>();
+
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_LocationList response;
+      response.id = msg->id;
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        if (ref.idx.kind == SymbolKind::Type) {
+          QueryType& type = db->types[ref.idx.idx];
+          std::vector<QueryLocation> locations =
+              ToQueryLocation(db, type.derived);
+          response.result = GetLsLocations(db, working_files, locations);
+        } else if (ref.idx.kind == SymbolKind::Func) {
+          QueryFunc& func = db->funcs[ref.idx.idx];
+          std::vector<QueryLocation> locations =
+              ToQueryLocation(db, func.derived);
+          response.result = GetLsLocations(db, working_files, locations);
+        }
+      }
+      ipc->SendOutMessageToClient(IpcId::CqueryDerived, response);
+      break;
+    }
+
+    case IpcId::TextDocumentDefinition: {
+      auto msg = message->As<Ipc_TextDocumentDefinition>();
+
+      QueryFileId file_id;
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file, &file_id))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_TextDocumentDefinition response;
+      response.id = msg->id;
+
+      int target_line = msg->params.position.line + 1;
+      int target_column = msg->params.position.character + 1;
+
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        // Found symbol. Return definition.
+
+        // Special cases which are handled:
+        //  - symbol has declaration but no definition (ie, pure virtual)
+        //  - start at spelling but end at extent for better mouse tooltip
+        //  - goto declaration while in definition of recursive type
+
+        optional<QueryLocation> def_loc =
+            GetDefinitionSpellingOfSymbol(db, ref.idx);
+
+        // We use spelling start and extent end because this causes vscode to
+        // highlight the entire definition when previewing / hoving with the
+        // mouse.
+        optional<QueryLocation> def_extent =
+            GetDefinitionExtentOfSymbol(db, ref.idx);
+        if (def_loc && def_extent)
+          def_loc->range.end = def_extent->range.end;
+
+        // If the cursor is currently at or in the definition we should goto
+        // the declaration if possible. We also want to use declarations if
+        // we're pointing to, ie, a pure virtual function which has no
+        // definition.
+        if (!def_loc ||
+            (def_loc->path == file_id &&
+             def_loc->range.Contains(target_line, target_column))) {
+          // Goto declaration.
+
+          std::vector<QueryLocation> declarations =
+              GetDeclarationsOfSymbolForGotoDefinition(db, ref.idx);
+          for (auto declaration : declarations) {
+            optional<lsLocation> ls_declaration =
+                GetLsLocation(db, working_files, declaration);
+            if (ls_declaration)
+              response.result.push_back(*ls_declaration);
+          }
+          // We found some declarations. Break so we don't add the definition
+          // location.
+          if (!response.result.empty())
+            break;
+        }
+
+        if (def_loc) {
+          PushBack(&response.result,
+                   GetLsLocation(db, working_files, *def_loc));
+        }
+
+        if (!response.result.empty())
+          break;
+      }
+
+      // No symbols - check for includes.
+      if (response.result.empty()) {
+        for (const IndexInclude& include : file->def->includes) {
+          if (include.line == target_line) {
+            lsLocation result;
+            result.uri = lsDocumentUri::FromPath(include.resolved_path);
+            response.result.push_back(result);
+            break;
+          }
+        }
+      }
+
+      ipc->SendOutMessageToClient(IpcId::TextDocumentDefinition, response);
+      break;
+    }
+
+    case IpcId::TextDocumentDocumentHighlight: {
+      auto msg = message->As<Ipc_TextDocumentDocumentHighlight>();
+
+      QueryFileId file_id;
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file, &file_id))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_TextDocumentDocumentHighlight response;
+      response.id = msg->id;
+
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        // Found symbol. Return references to highlight.
+        std::vector<QueryLocation> uses = GetUsesOfSymbol(db, ref.idx);
+        response.result.reserve(uses.size());
+        for (const QueryLocation& use : uses) {
+          if (use.path != file_id)
+            continue;
+
+          optional<lsLocation> ls_location =
+              GetLsLocation(db, working_files, use);
+          if (!ls_location)
+            continue;
+
+          lsDocumentHighlight highlight;
+          highlight.kind = lsDocumentHighlightKind::Text;
+          highlight.range = ls_location->range;
+          response.result.push_back(highlight);
+        }
+        break;
+      }
+
+      ipc->SendOutMessageToClient(IpcId::TextDocumentDocumentHighlight,
+                                  response);
+      break;
+    }
+
+    case IpcId::TextDocumentHover: {
+      auto msg = message->As<Ipc_TextDocumentHover>();
+
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_TextDocumentHover response;
+      response.id = msg->id;
+
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        // Found symbol. Return hover.
+        optional<lsRange> ls_range = GetLsRange(
+            working_files->GetFileByFilename(file->def->path), ref.loc.range);
+        if (!ls_range)
+          continue;
+
+        response.result.contents.value = GetHoverForSymbol(db, ref.idx);
+        response.result.contents.language = file->def->language;
+
+        response.result.range = *ls_range;
+        break;
+      }
+
+      ipc->SendOutMessageToClient(IpcId::TextDocumentHover, response);
+      break;
+    }
+
+    case IpcId::TextDocumentReferences: {
+      auto msg = message->As<Ipc_TextDocumentReferences>();
+
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
+
+      WorkingFile* working_file =
+          working_files->GetFileByFilename(file->def->path);
+
+      Out_TextDocumentReferences response;
+      response.id = msg->id;
+
+      for (const SymbolRef& ref :
+           FindSymbolsAtLocation(working_file, file, msg->params.position)) {
+        optional<QueryLocation> excluded_declaration;
+        if (!msg->params.context.includeDeclaration) {
+          LOG_S(INFO) << "Excluding declaration in references";
+          excluded_declaration = GetDefinitionSpellingOfSymbol(db, ref.idx);
+        }
+
+        // Found symbol. Return references.
+        std::vector<QueryLocation> uses = GetUsesOfSymbol(db, ref.idx);
+        response.result.reserve(uses.size());
+        for (const QueryLocation& use : uses) {
+          if (msg->IsCancelled())
+            break;
+          if (excluded_declaration.has_value() &&
+              use == *excluded_declaration)
+            continue;
+
+          optional<lsLocation> ls_location =
+              GetLsLocation(db, working_files, use);
+          if (ls_location)
+            response.result.push_back(*ls_location);
+        }
+        break;
+      }
+
+      if (msg->IsCancelled()) {
+        ReplyCancelled(msg);
+        break;
+      }
+      ipc->SendOutMessageToClient(IpcId::TextDocumentReferences, response);
+      break;
+    }
+
+    case IpcId::TextDocumentDocumentSymbol: {
+      auto msg = message->As<Ipc_TextDocumentDocumentSymbol>();
+
+      Out_TextDocumentDocumentSymbol response;
+      response.id = msg->id;
+
+      QueryFile* file;
+      if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
+                          &file))
+        break;
+
+      for (SymbolRef ref : file->def->outline) {
+        optional<lsSymbolInformation> info =
+            GetSymbolInfo(db, working_files, ref.idx);
+        if (!info)
+          continue;
+
+        optional<lsLocation> location =
+            GetLsLocation(db, working_files, ref.loc);
+        if (!location)
+          continue;
+        info->location = *location;
+        response.result.push_back(*info);
+      }
+
+      ipc->SendOutMessageToClient(IpcId::TextDocumentDocumentSymbol,
+                                  response);
+      break;
+    }
+
+    case IpcId::TextDocumentDocumentLink: {
+      auto msg = message->As<Ipc_TextDocumentDocumentLink>();
+
+      Out_TextDocumentDocumentLink response;
+      response.id = msg->id;
+
+      if (config->showDocumentLinksOnIncludes) {
+        QueryFile* file;
+        if (!FindFileOrFail(db, msg->id,
+                            msg->params.textDocument.uri.GetPath(), &file))
+          break;
+
+        WorkingFile* working_file = working_files->GetFileByFilename(
+            msg->params.textDocument.uri.GetPath());
+        if (!working_file) {
+          LOG_S(INFO) << "Unable to find working file "
+                      << msg->params.textDocument.uri.GetPath();
+          break;
+        }
+        for (const IndexInclude& include : file->def->includes) {
+          optional<int> buffer_line;
+          optional<std::string> buffer_line_content =
+              working_file->GetBufferLineContentFromIndexLine(include.line,
+                                                              &buffer_line);
+          if (!buffer_line || !buffer_line_content)
+            continue;
+
+          // Subtract 1 from line because querydb stores 1-based lines but
+          // vscode expects 0-based lines.
+          optional<lsRange> between_quotes =
+              ExtractQuotedRange(*buffer_line - 1, *buffer_line_content);
+          if (!between_quotes)
+            continue;
+
+          lsDocumentLink link;
+          link.target = lsDocumentUri::FromPath(include.resolved_path);
+          link.range = *between_quotes;
+          response.result.push_back(link);
+        }
+      }
+
+      ipc->SendOutMessageToClient(IpcId::TextDocumentDocumentLink, response);
+      break;
+    }
+
+    case IpcId::WorkspaceSymbol: {
+      // TODO: implement fuzzy search, see
+      // https://github.com/junegunn/fzf/blob/master/src/matcher.go for
+      // inspiration
+      auto msg = message->As<Ipc_WorkspaceSymbol>();
+
+      Out_WorkspaceSymbol response;
+      response.id = msg->id;
+
+      LOG_S(INFO) << "[querydb] Considering " << db->detailed_names.size()
+                  << " candidates for query " << msg->params.query;
+
+      std::string query = msg->params.query;
+
+      std::unordered_set<std::string> inserted_results;
+      inserted_results.reserve(config->maxWorkspaceSearchResults);
+
+      for (int i = 0; i < db->detailed_names.size(); ++i) {
+        if (msg->IsCancelled())
+          break;
+        if (db->detailed_names[i].find(query) != std::string::npos) {
+          // Do not show the same entry twice.
+          if (!inserted_results.insert(db->detailed_names[i]).second)
+            continue;
+
+          InsertSymbolIntoResult(db, working_files, db->symbols[i],
+                                 &response.result);
+          if (response.result.size() >= config->maxWorkspaceSearchResults)
+            break;
+        }
+      }
+
+      if (response.result.size() < config->maxWorkspaceSearchResults) {
+        for (int i = 0; i < db->detailed_names.size(); ++i) {
+          if (msg->IsCancelled())
+            break;
+          if (SubstringMatch(query, db->detailed_names[i])) {
+            // Do not show the same entry twice.
+            if (!inserted_results.insert(db->detailed_names[i]).second)
+              continue;
+
+            InsertSymbolIntoResult(db, working_files, db->symbols[i],
+                                   &response.result);
+            if (response.result.size() >= config->maxWorkspaceSearchResults)
+              break;
+          }
+        }
+      }
+
+      if (msg->IsCancelled()) {
+        ReplyCancelled(msg);
+        break;
+      }
+      LOG_S(INFO) << "[querydb] Found " << response.result.size()
+                  << " results for query " << query;
+      ipc->SendOutMessageToClient(IpcId::WorkspaceSymbol, response);
+      break;
+    }
+
+    default: {
+      LOG_S(FATAL) << "Exiting; unhandled read request "
+                   << IpcIdToString(message->method_id);
+      exit(1);
+    }
+  }
+}
+
+// Answers read requests concurrently with the querydb thread. A request is
+// only answered once querydb has handled every message the client sent before
+// it, so it observes the effects of, ie, an earlier didChange.
+WorkThread::Result QueryDbReaderMain(Config* config,
+                                     QueryDatabase* db,
+                                     WorkingFiles* working_files,
+                                     MultiQueueWaiter* waiter,
+                                     QueueManager* queue) {
+  optional<QueryDb_ReadRequest> request = queue->read_requests.TryDequeue();
+  if (!request) {
+    waiter->Wait({&queue->read_requests});
+    return WorkThread::Result::NoWork;
+  }
+
+  int64_t sent_before = request->querydb_messages_sent_before;
+  waiter->WaitUntil([queue, sent_before]() {
+    return queue->querydb_messages_handled >= sent_before;
+  });
+
+  SharedLock lock(queue->querydb_mutex);
+  if (request->message->IsCancelled())
+    ReplyCancelled(request->message.get());
+  else
+    QueryDbHandleReadRequest(config, db, working_files, request->message.get());
+  return WorkThread::Result::MoreWork;
+}
+
+bool QueryDbMainLoop(Config* config,
+                     QueryDatabase* db,
+                     bool* exit_when_idle,
+                     MultiQueueWaiter* waiter,
+                     QueueManager* queue,
+                     Project* project,
+                     FileConsumer::SharedState* file_consumer_shared,
+                     ImportManager* import_manager,
+                     TimestampManager* timestamp_manager,
+                     CacheManifest* cache_manifest,
+                     CacheWriter* cache_writer,
+                     WorkingFiles* working_files,
+                     ClangCompleteManager* clang_complete,
+                     IncludeComplete* include_complete,
+                     CodeCompleteCache* global_code_complete_cache,
+                     CodeCompleteCache* non_global_code_complete_cache,
+                     CodeCompleteCache* signature_cache) {
+  IpcManager* ipc = IpcManager::instance();
+
+  bool did_work = false;
+
+  std::vector<std::unique_ptr<BaseIpcMessage>> messages =
+      ipc->GetMessages(IpcManager::Destination::Server);
+  for (auto& message : messages) {
+    did_work = true;
+
+    if (message->IsCancelled()) {
+      ReplyCancelled(message.get());
+      ++queue->querydb_messages_handled;
+      continue;
+    }
+
+    switch (message->method_id) {
+      case IpcId::Initialize: {
+        auto request = message->As<Ipc_InitializeRequest>();
+
+        // Log initialization parameters.
+        rapidjson::StringBuffer output;
+        Writer writer(output);
+        Reflect(writer, request->params.initializationOptions);
+        std::cerr << output.GetString() << std::endl;
+
+        if (request->params.rootUri) {
+          std::string project_path = request->params.rootUri->GetPath();
+          LOG_S(INFO) << "[querydb] Initialize in directory " << project_path
+                      << " with uri " << request->params.rootUri->raw_uri;
+
+          if (!request->params.initializationOptions) {
+            LOG_S(FATAL) << "Initialization parameters (particularily "
+                            "cacheDirectory) are required";
+            exit(1);
+          }
+
+          *config = *request->params.initializationOptions;
+
+          // Check client version.
+          if (config->clientVersion != kExpectedClientVersion &&
+              config->clientVersion != -1 /*disable check*/) {
+            Out_ShowLogMessage out;
+            out.display_type = Out_ShowLogMessage::DisplayType::Show;
+            out.params.type = lsMessageType::Error;
+            out.params.message =
+                "cquery client (v" + std::to_string(config->clientVersion) +
+                ") and server (v" + std::to_string(kExpectedClientVersion) +
+                ") version mismatch. Please update ";
+            if (config->clientVersion > kExpectedClientVersion)
+              out.params.message += "the cquery binary.";
+            else
+              out.params.message +=
+                  "your extension client (VSIX file). Make sure to uninstall "
+                  "the cquery extension and restart vscode before "
+                  "reinstalling.";
+            out.Write(std::cout);
+          }
 
           // Make sure cache directory is valid.
           if (config->cacheDirectory.empty()) {
@@ -1549,6 +2745,9 @@ bool QueryDbMainLoop(Config* config,
           config->projectRoot =
               NormalizePath(request->params.rootUri->GetPath());
           EnsureEndsInSlash(config->projectRoot);
+          for (std::string& root : config->relocatableCacheRoots)
+            root = NormalizePath(root);
+          queue->index_request_prioritizer.SetProjectRoot(config->projectRoot);
 
           // Start indexer threads.
           if (config->indexerCount == 0) {
@@ -1560,14 +2759,38 @@ bool QueryDbMainLoop(Config* config,
             if (config->indexerCount <= 0)
               config->indexerCount = 1;
           }
+          if (config->minIndexerCount <= 0)
+            config->minIndexerCount = config->indexerCount;
           LOG_S(INFO) << "Starting " << config->indexerCount << " indexers";
+          queue->do_id_map = MakeUnique<QueueManager::Index_DoIdMapQueue>(
+              waiter, config->indexerCount);
+          queue->has_do_id_map = true;
+          queue->indexer_pool = MakeUnique<IndexerPool>(
+              config->minIndexerCount, config->indexerCount,
+              std::thread::hardware_concurrency(),
+              config->indexerMemoryLimitMb);
+          if (config->minIndexerCount < config->indexerCount)
+            StartIndexerPoolThread(config, queue, clang_complete, waiter);
+          WorkThread::Priority indexer_priority =
+              config->enableIndexerBackgroundPriority
+                  ? WorkThread::Priority::Background
+                  : WorkThread::Priority::Normal;
           for (int i = 0; i < config->indexerCount; ++i) {
-            WorkThread::StartThread("indexer" + std::to_string(i), [=]() {
-              return IndexMain(config, file_consumer_shared, timestamp_manager,
-                               import_manager, project, working_files, waiter,
-                               queue);
-            });
+            WorkThread::StartThread("indexer" + std::to_string(i),
+                                    [=]() {
+                                      return IndexMain(
+                                          config, db, file_consumer_shared,
+                                          timestamp_manager, import_manager,
+                                          cache_writer, project, working_files,
+                                          waiter, queue, i);
+                                    },
+                                    indexer_priority);
           }
+          // The cache writer keeps the default priority: indexers, and
+          // querydb when a file is opened, wait for its writes to finish
+          // before reading a cache.
+          WorkThread::StartThread("cachewriter",
+                                  [=]() { return cache_writer->Run(); });
 
           Timer time;
 
@@ -1583,7 +2806,50 @@ bool QueryDbMainLoop(Config* config,
           // files, because that takes a long time.
           include_complete->Rescan();
 
+          // Load the cache manifest so we can figure out which files are out
+          // of date without opening every cache file.
           time.Reset();
+          bool has_manifest = cache_manifest->Load();
+
+          // Restore the query database from the previous session. This has to
+          // happen before the scan below, which can update the manifest.
+          bool has_snapshot = false;
+          if (has_manifest && db->files.empty()) {
+            std::lock_guard<SharedMutex> lock(queue->querydb_mutex);
+            has_snapshot =
+                LoadQueryDatabaseSnapshot(config, cache_manifest, db);
+          }
+          auto is_in_snapshot = [&](const std::string& path) {
+            optional<QueryFileId> id = db->GetQueryFileId(path);
+            return id && db->files[id->id].def.has_value();
+          };
+          // A clean file whose index is already in the restored database, along
+          // with the indexes of all of its dependencies, does not need to be
+          // loaded at all.
+          auto is_restored = [&](const std::string& path) {
+            if (!has_snapshot || !is_in_snapshot(path))
+              return false;
+            optional<CacheManifest::Entry> cached = cache_manifest->Find(path);
+            if (!cached)
+              return false;
+            for (const std::string& dependency : cached->dependencies) {
+              if (!is_in_snapshot(dependency))
+                return false;
+            }
+            for (const std::string& dependency : cached->dependencies) {
+              file_consumer_shared->Mark(dependency);
+              import_manager->TryMarkDependencyImported(dependency);
+            }
+            return true;
+          };
+
+          // Clean files are dispatched first since loading them from cache is
+          // fast and makes most of the project queryable right away. Files
+          // which need to be parsed are dispatched afterwards.
+          int restored_count = 0;
+          std::vector<Index_Request> clean_requests;
+          std::vector<Index_Request> dirty_requests;
+          CacheManifest::ScanCache scan_cache;
           project->ForAllFilteredFiles(
               config, [&](int i, const Project::Entry& entry) {
                 // std::cerr << "[" << i << "/" << (project->entries.size() - 1)
@@ -1591,12 +2857,46 @@ bool QueryDbMainLoop(Config* config,
                 //  << std::endl;
                 bool is_interactive =
                     working_files->GetFileByFilename(entry.filename) != nullptr;
-                queue->index_request.Enqueue(Index_Request(
-                    entry.filename, entry.args, is_interactive, nullopt));
+                Index_Request request(entry.filename, entry.args,
+                                      is_interactive, nullopt);
+                if (has_manifest &&
+                    cache_manifest->IsClean(entry.filename, &scan_cache)) {
+                  if (is_restored(entry.filename)) {
+                    ++restored_count;
+                    return;
+                  }
+                  request.load_from_cache = true;
+                  clean_requests.push_back(std::move(request));
+                } else {
+                  request.is_modified = has_manifest;
+                  dirty_requests.push_back(std::move(request));
+                }
               });
+          LOG_S(INFO) << "Cache manifest reports " << clean_requests.size()
+                      << " clean and " << dirty_requests.size()
+                      << " stale files; " << restored_count
+                      << " files restored from snapshot";
+
+          // Seed timestamps after the scan, as it updates the timestamps of
+          // files which were touched without changing.
+          if (has_manifest) {
+            cache_manifest->ForEachEntry(
+                [&](const std::string& path,
+                    const CacheManifest::Entry& entry) {
+                  timestamp_manager->UpdateCachedModificationTime(
+                      path, entry.last_modification_time);
+                });
+          }
+          for (Index_Request& request : clean_requests)
+            queue->EnqueueIndexRequest(std::move(request));
+          for (Index_Request& request : dirty_requests)
+            queue->EnqueueIndexRequest(std::move(request));
 
           // We need to support multiple concurrent index processes.
           time.ResetAndPrint("[perf] Dispatched initial index requests");
+
+          StartCacheCollection(config, cache_manifest, project,
+                               false /*report_to_client*/);
         }
 
         break;
@@ -1604,6 +2904,10 @@ bool QueryDbMainLoop(Config* config,
 
       case IpcId::Exit: {
         LOG_S(INFO) << "Exiting; got IpcId::Exit";
+        cache_writer->FlushAll();
+        cache_manifest->Save();
+        FlushCache(config);
+        SaveQueryDatabaseSnapshot(config, db);
         exit(0);
         break;
       }
@@ -1614,7 +2918,7 @@ bool QueryDbMainLoop(Config* config,
         // TODO: think about this flow and test it more.
 
         // Unmark all files whose timestamp has changed.
-        CacheLoader cache_loader(config);
+        CacheLoader cache_loader(config, cache_writer);
         for (const auto& file : db->files) {
           if (!file.def)
             continue;
@@ -1637,214 +2941,27 @@ bool QueryDbMainLoop(Config* config,
               LOG_S(INFO) << "[" << i << "/" << (project->entries.size() - 1)
                           << "] Dispatching index request for file "
                           << entry.filename;
-              bool is_interactive =
-                  working_files->GetFileByFilename(entry.filename) != nullptr;
-              queue->index_request.Enqueue(Index_Request(
-                  entry.filename, entry.args, is_interactive, nullopt));
-            });
-        break;
-      }
-
-      case IpcId::CqueryTypeHierarchyTree: {
-        auto msg = message->As<Ipc_CqueryTypeHierarchyTree>();
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_CqueryTypeHierarchyTree response;
-        response.id = msg->id;
-
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          if (ref.idx.kind == SymbolKind::Type) {
-            response.result = BuildInheritanceHierarchyForType(
-                db, working_files, QueryTypeId(ref.idx.idx));
-            break;
-          }
-          if (ref.idx.kind == SymbolKind::Func) {
-            response.result = BuildInheritanceHierarchyForFunc(
-                db, working_files, QueryFuncId(ref.idx.idx));
-            break;
-          }
-        }
-
-        ipc->SendOutMessageToClient(IpcId::CqueryTypeHierarchyTree, response);
-        break;
-      }
-
-      case IpcId::CqueryCallTreeInitial: {
-        auto msg = message->As<Ipc_CqueryCallTreeInitial>();
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_CqueryCallTree response;
-        response.id = msg->id;
-
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          if (ref.idx.kind == SymbolKind::Func) {
-            response.result = BuildInitialCallTree(db, working_files,
-                                                   QueryFuncId(ref.idx.idx));
-            break;
-          }
-        }
-
-        ipc->SendOutMessageToClient(IpcId::CqueryCallTreeInitial, response);
-        break;
-      }
-
-      case IpcId::CqueryCallTreeExpand: {
-        auto msg = message->As<Ipc_CqueryCallTreeExpand>();
-
-        Out_CqueryCallTree response;
-        response.id = msg->id;
-
-        auto func_id = db->usr_to_func.find(msg->params.usr);
-        if (func_id != db->usr_to_func.end())
-          response.result =
-              BuildExpandCallTree(db, working_files, func_id->second);
-
-        ipc->SendOutMessageToClient(IpcId::CqueryCallTreeExpand, response);
-        break;
-      }
-
-      case IpcId::CqueryVars: {
-        auto msg = message->As<Ipc_CqueryVars>();
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_LocationList response;
-        response.id = msg->id;
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          if (ref.idx.kind == SymbolKind::Type) {
-            QueryType& type = db->types[ref.idx.idx];
-            std::vector<QueryLocation> locations =
-                ToQueryLocation(db, type.instances);
-            response.result = GetLsLocations(db, working_files, locations);
-          }
-        }
-        ipc->SendOutMessageToClient(IpcId::CqueryVars, response);
-        break;
-      }
-
-      case IpcId::CqueryCallers: {
-        auto msg = message->As<Ipc_CqueryCallers>();
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_LocationList response;
-        response.id = msg->id;
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          if (ref.idx.kind == SymbolKind::Func) {
-            QueryFunc& func = db->funcs[ref.idx.idx];
-            std::vector<QueryLocation> locations =
-                ToQueryLocation(db, func.callers);
-            for (QueryFuncRef func_ref :
-                 GetCallersForAllBaseFunctions(db, func))
-              locations.push_back(func_ref.loc);
-            for (QueryFuncRef func_ref :
-                 GetCallersForAllDerivedFunctions(db, func))
-              locations.push_back(func_ref.loc);
-
-            response.result = GetLsLocations(db, working_files, locations);
-          }
-        }
-        ipc->SendOutMessageToClient(IpcId::CqueryCallers, response);
-        break;
-      }
-
-      case IpcId::CqueryBase: {
-        auto msg = message->As<Ipc_CqueryBase>();
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_LocationList response;
-        response.id = msg->id;
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          if (ref.idx.kind == SymbolKind::Type) {
-            QueryType& type = db->types[ref.idx.idx];
-            if (!type.def)
-              continue;
-            std::vector<QueryLocation> locations =
-                ToQueryLocation(db, type.def->parents);
-            response.result = GetLsLocations(db, working_files, locations);
-          } else if (ref.idx.kind == SymbolKind::Func) {
-            QueryFunc& func = db->funcs[ref.idx.idx];
-            optional<QueryLocation> location =
-                GetBaseDefinitionOrDeclarationSpelling(db, func);
-            if (!location)
-              continue;
-            optional<lsLocation> ls_loc =
-                GetLsLocation(db, working_files, *location);
-            if (!ls_loc)
-              continue;
-            response.result.push_back(*ls_loc);
-          }
-        }
-        ipc->SendOutMessageToClient(IpcId::CqueryBase, response);
+              bool is_interactive =
+                  working_files->GetFileByFilename(entry.filename) != nullptr;
+              queue->EnqueueIndexRequest(Index_Request(
+                  entry.filename, entry.args, is_interactive, nullopt));
+            });
         break;
       }
 
-      case IpcId::CqueryDerived: {
-        auto msg = message->As<Ipc_CqueryDerived>();
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
+      case IpcId::CquerySaveSnapshot: {
+        // Save the manifest first so that the snapshot is checked against
+        // the cache state it was taken from.
+        cache_writer->FlushAll();
+        cache_manifest->Save();
+        FlushCache(config);
+        SaveQueryDatabaseSnapshot(config, db);
+        break;
+      }
 
-        Out_LocationList response;
-        response.id = msg->id;
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          if (ref.idx.kind == SymbolKind::Type) {
-            QueryType& type = db->types[ref.idx.idx];
-            std::vector<QueryLocation> locations =
-                ToQueryLocation(db, type.derived);
-            response.result = GetLsLocations(db, working_files, locations);
-          } else if (ref.idx.kind == SymbolKind::Func) {
-            QueryFunc& func = db->funcs[ref.idx.idx];
-            std::vector<QueryLocation> locations =
-                ToQueryLocation(db, func.derived);
-            response.result = GetLsLocations(db, working_files, locations);
-          }
-        }
-        ipc->SendOutMessageToClient(IpcId::CqueryDerived, response);
+      case IpcId::CqueryCollectCache: {
+        StartCacheCollection(config, cache_manifest, project,
+                             true /*report_to_client*/);
         break;
       }
 
@@ -1855,13 +2972,17 @@ bool QueryDbMainLoop(Config* config,
         Timer time;
         auto msg = message->As<Ipc_TextDocumentDidOpen>();
         std::string path = msg->params.textDocument.uri.GetPath();
-        WorkingFile* working_file = working_files->OnOpen(msg->params);
         optional<std::string> cached_file_contents =
-            LoadCachedFileContents(config, path);
-        if (cached_file_contents)
-          working_file->SetIndexContent(*cached_file_contents);
-        else
-          working_file->SetIndexContent(working_file->buffer_content);
+            cache_writer->LoadFileContents(path);
+        WorkingFile* working_file;
+        {
+          std::lock_guard<SharedMutex> lock(queue->querydb_mutex);
+          working_file = working_files->OnOpen(msg->params);
+          if (cached_file_contents)
+            working_file->SetIndexContent(*cached_file_contents);
+          else
+            working_file->SetIndexContent(working_file->buffer_content);
+        }
 
         QueryFile* file = nullptr;
         FindFileOrFail(db, nullopt, path, &file);
@@ -1877,10 +2998,15 @@ bool QueryDbMainLoop(Config* config,
         include_complete->AddFile(working_file->filename);
         clang_complete->NotifyView(path);
 
-        // Submit new index request.
+        // Index the files the user is likely to navigate into next. The
+        // dependencies are refreshed once the file has been indexed.
         const Project::Entry& entry =
             project->FindCompilationEntryForFile(path);
-        queue->index_request.PriorityEnqueue(Index_Request(
+        queue->index_request_prioritizer.OnOpen(path);
+        queue->ReprioritizeIndexRequests();
+
+        // Submit new index request.
+        queue->EnqueueIndexRequest(Index_Request(
             entry.filename, entry.args, true /*is_interactive*/, nullopt));
 
         break;
@@ -1889,7 +3015,10 @@ bool QueryDbMainLoop(Config* config,
       case IpcId::TextDocumentDidChange: {
         auto msg = message->As<Ipc_TextDocumentDidChange>();
         std::string path = msg->params.textDocument.uri.GetPath();
-        working_files->OnChange(msg->params);
+        {
+          std::lock_guard<SharedMutex> lock(queue->querydb_mutex);
+          working_files->OnChange(msg->params);
+        }
         clang_complete->NotifyEdit(path);
         clang_complete->DiagnosticsUpdate(
             msg->params.textDocument.AsTextDocumentIdentifier());
@@ -1907,8 +3036,13 @@ bool QueryDbMainLoop(Config* config,
             IpcId::TextDocumentPublishDiagnostics, diag);
 
         // Remove internal state.
-        working_files->OnClose(msg->params);
+        {
+          std::lock_guard<SharedMutex> lock(queue->querydb_mutex);
+          working_files->OnClose(msg->params);
+        }
         clang_complete->NotifyClose(path);
+        queue->index_request_prioritizer.OnClose(path);
+        queue->ReprioritizeIndexRequests();
 
         break;
       }
@@ -1920,18 +3054,10 @@ bool QueryDbMainLoop(Config* config,
         // Send out an index request, and copy the current buffer state so we
         // can update the cached index contents when the index is done.
         //
-        // We also do not index if there is already an index request.
-        //
-        // TODO: Cancel outgoing index request. Might be tricky to make
-        //       efficient since we have to cancel.
-        //    - we could have an |atomic<int> active_cancellations| variable
-        //      that all of the indexers check before accepting an index. if
-        //      zero we don't slow down fast-path. if non-zero we acquire
-        //      mutex and check to see if we should skip the current request.
-        //      if so, ignore that index response.
-        // TODO: send as priority request
+        // This replaces any index request for the file which is still queued
+        // or being parsed.
         Project::Entry entry = project->FindCompilationEntryForFile(path);
-        queue->index_request.Enqueue(Index_Request(
+        queue->EnqueueIndexRequest(Index_Request(
             entry.filename, entry.args, true /*is_interactive*/, nullopt));
 
         clang_complete->NotifySave(path);
@@ -1958,11 +3084,17 @@ bool QueryDbMainLoop(Config* config,
              FindSymbolsAtLocation(working_file, file, msg->params.position)) {
           // Found symbol. Return references to rename.
           std::vector<QueryLocation> uses = GetUsesOfSymbol(db, ref.idx);
+          if (msg->IsCancelled())
+            break;
           response.result =
               BuildWorkspaceEdit(db, working_files, uses, msg->params.newName);
           break;
         }
 
+        if (msg->IsCancelled()) {
+          ReplyCancelled(msg);
+          break;
+        }
         ipc->SendOutMessageToClient(IpcId::TextDocumentRename, response);
         break;
       }
@@ -2023,15 +3155,19 @@ bool QueryDbMainLoop(Config* config,
                msg](const NonElidedVector<lsCompletionItem>& results,
                     bool is_cached_result) {
 
-                Out_TextDocumentComplete complete_response;
-                complete_response.id = msg->id;
-                complete_response.result.items = results;
-
-                // Emit completion results.
-                FilterCompletionResponse(&complete_response,
-                                         existing_completion);
-                IpcManager::instance()->SendOutMessageToClient(
-                    IpcId::TextDocumentCompletion, complete_response);
+                // Emit completion results, unless the client has moved on
+                // already. The results are still cached below.
+                if (msg->IsCancelled()) {
+                  ReplyCancelled(msg.get());
+                } else {
+                  Out_TextDocumentComplete complete_response;
+                  complete_response.id = msg->id;
+                  complete_response.result.items = results;
+                  FilterCompletionResponse(&complete_response,
+                                           existing_completion);
+                  IpcManager::instance()->SendOutMessageToClient(
+                      IpcId::TextDocumentCompletion, complete_response);
+                }
 
                 // Cache completion results.
                 if (!is_cached_result) {
@@ -2178,284 +3314,6 @@ bool QueryDbMainLoop(Config* config,
         break;
       }
 
-      case IpcId::TextDocumentDefinition: {
-        auto msg = message->As<Ipc_TextDocumentDefinition>();
-
-        QueryFileId file_id;
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file, &file_id))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_TextDocumentDefinition response;
-        response.id = msg->id;
-
-        int target_line = msg->params.position.line + 1;
-        int target_column = msg->params.position.character + 1;
-
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          // Found symbol. Return definition.
-
-          // Special cases which are handled:
-          //  - symbol has declaration but no definition (ie, pure virtual)
-          //  - start at spelling but end at extent for better mouse tooltip
-          //  - goto declaration while in definition of recursive type
-
-          optional<QueryLocation> def_loc =
-              GetDefinitionSpellingOfSymbol(db, ref.idx);
-
-          // We use spelling start and extent end because this causes vscode to
-          // highlight the entire definition when previewing / hoving with the
-          // mouse.
-          optional<QueryLocation> def_extent =
-              GetDefinitionExtentOfSymbol(db, ref.idx);
-          if (def_loc && def_extent)
-            def_loc->range.end = def_extent->range.end;
-
-          // If the cursor is currently at or in the definition we should goto
-          // the declaration if possible. We also want to use declarations if
-          // we're pointing to, ie, a pure virtual function which has no
-          // definition.
-          if (!def_loc ||
-              (def_loc->path == file_id &&
-               def_loc->range.Contains(target_line, target_column))) {
-            // Goto declaration.
-
-            std::vector<QueryLocation> declarations =
-                GetDeclarationsOfSymbolForGotoDefinition(db, ref.idx);
-            for (auto declaration : declarations) {
-              optional<lsLocation> ls_declaration =
-                  GetLsLocation(db, working_files, declaration);
-              if (ls_declaration)
-                response.result.push_back(*ls_declaration);
-            }
-            // We found some declarations. Break so we don't add the definition
-            // location.
-            if (!response.result.empty())
-              break;
-          }
-
-          if (def_loc) {
-            PushBack(&response.result,
-                     GetLsLocation(db, working_files, *def_loc));
-          }
-
-          if (!response.result.empty())
-            break;
-        }
-
-        // No symbols - check for includes.
-        if (response.result.empty()) {
-          for (const IndexInclude& include : file->def->includes) {
-            if (include.line == target_line) {
-              lsLocation result;
-              result.uri = lsDocumentUri::FromPath(include.resolved_path);
-              response.result.push_back(result);
-              break;
-            }
-          }
-        }
-
-        ipc->SendOutMessageToClient(IpcId::TextDocumentDefinition, response);
-        break;
-      }
-
-      case IpcId::TextDocumentDocumentHighlight: {
-        auto msg = message->As<Ipc_TextDocumentDocumentHighlight>();
-
-        QueryFileId file_id;
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file, &file_id))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_TextDocumentDocumentHighlight response;
-        response.id = msg->id;
-
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          // Found symbol. Return references to highlight.
-          std::vector<QueryLocation> uses = GetUsesOfSymbol(db, ref.idx);
-          response.result.reserve(uses.size());
-          for (const QueryLocation& use : uses) {
-            if (use.path != file_id)
-              continue;
-
-            optional<lsLocation> ls_location =
-                GetLsLocation(db, working_files, use);
-            if (!ls_location)
-              continue;
-
-            lsDocumentHighlight highlight;
-            highlight.kind = lsDocumentHighlightKind::Text;
-            highlight.range = ls_location->range;
-            response.result.push_back(highlight);
-          }
-          break;
-        }
-
-        ipc->SendOutMessageToClient(IpcId::TextDocumentDocumentHighlight,
-                                    response);
-        break;
-      }
-
-      case IpcId::TextDocumentHover: {
-        auto msg = message->As<Ipc_TextDocumentHover>();
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_TextDocumentHover response;
-        response.id = msg->id;
-
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          // Found symbol. Return hover.
-          optional<lsRange> ls_range = GetLsRange(
-              working_files->GetFileByFilename(file->def->path), ref.loc.range);
-          if (!ls_range)
-            continue;
-
-          response.result.contents.value = GetHoverForSymbol(db, ref.idx);
-          response.result.contents.language = file->def->language;
-
-          response.result.range = *ls_range;
-          break;
-        }
-
-        ipc->SendOutMessageToClient(IpcId::TextDocumentHover, response);
-        break;
-      }
-
-      case IpcId::TextDocumentReferences: {
-        auto msg = message->As<Ipc_TextDocumentReferences>();
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        WorkingFile* working_file =
-            working_files->GetFileByFilename(file->def->path);
-
-        Out_TextDocumentReferences response;
-        response.id = msg->id;
-
-        for (const SymbolRef& ref :
-             FindSymbolsAtLocation(working_file, file, msg->params.position)) {
-          optional<QueryLocation> excluded_declaration;
-          if (!msg->params.context.includeDeclaration) {
-            LOG_S(INFO) << "Excluding declaration in references";
-            excluded_declaration = GetDefinitionSpellingOfSymbol(db, ref.idx);
-          }
-
-          // Found symbol. Return references.
-          std::vector<QueryLocation> uses = GetUsesOfSymbol(db, ref.idx);
-          response.result.reserve(uses.size());
-          for (const QueryLocation& use : uses) {
-            if (excluded_declaration.has_value() &&
-                use == *excluded_declaration)
-              continue;
-
-            optional<lsLocation> ls_location =
-                GetLsLocation(db, working_files, use);
-            if (ls_location)
-              response.result.push_back(*ls_location);
-          }
-          break;
-        }
-
-        ipc->SendOutMessageToClient(IpcId::TextDocumentReferences, response);
-        break;
-      }
-
-      case IpcId::TextDocumentDocumentSymbol: {
-        auto msg = message->As<Ipc_TextDocumentDocumentSymbol>();
-
-        Out_TextDocumentDocumentSymbol response;
-        response.id = msg->id;
-
-        QueryFile* file;
-        if (!FindFileOrFail(db, msg->id, msg->params.textDocument.uri.GetPath(),
-                            &file))
-          break;
-
-        for (SymbolRef ref : file->def->outline) {
-          optional<lsSymbolInformation> info =
-              GetSymbolInfo(db, working_files, ref.idx);
-          if (!info)
-            continue;
-
-          optional<lsLocation> location =
-              GetLsLocation(db, working_files, ref.loc);
-          if (!location)
-            continue;
-          info->location = *location;
-          response.result.push_back(*info);
-        }
-
-        ipc->SendOutMessageToClient(IpcId::TextDocumentDocumentSymbol,
-                                    response);
-        break;
-      }
-
-      case IpcId::TextDocumentDocumentLink: {
-        auto msg = message->As<Ipc_TextDocumentDocumentLink>();
-
-        Out_TextDocumentDocumentLink response;
-        response.id = msg->id;
-
-        if (config->showDocumentLinksOnIncludes) {
-          QueryFile* file;
-          if (!FindFileOrFail(db, msg->id,
-                              msg->params.textDocument.uri.GetPath(), &file))
-            break;
-
-          WorkingFile* working_file = working_files->GetFileByFilename(
-              msg->params.textDocument.uri.GetPath());
-          if (!working_file) {
-            LOG_S(INFO) << "Unable to find working file "
-                        << msg->params.textDocument.uri.GetPath();
-            break;
-          }
-          for (const IndexInclude& include : file->def->includes) {
-            optional<int> buffer_line;
-            optional<std::string> buffer_line_content =
-                working_file->GetBufferLineContentFromIndexLine(include.line,
-                                                                &buffer_line);
-            if (!buffer_line || !buffer_line_content)
-              continue;
-
-            // Subtract 1 from line because querydb stores 1-based lines but
-            // vscode expects 0-based lines.
-            optional<lsRange> between_quotes =
-                ExtractQuotedRange(*buffer_line - 1, *buffer_line_content);
-            if (!between_quotes)
-              continue;
-
-            lsDocumentLink link;
-            link.target = lsDocumentUri::FromPath(include.resolved_path);
-            link.range = *between_quotes;
-            response.result.push_back(link);
-          }
-        }
-
-        ipc->SendOutMessageToClient(IpcId::TextDocumentDocumentLink, response);
-        break;
-      }
-
       case IpcId::TextDocumentCodeAction: {
         // NOTE: This code snippet will generate some FixIts for testing:
         //
@@ -2847,60 +3705,9 @@ bool QueryDbMainLoop(Config* config,
         break;
       }
 
-      case IpcId::WorkspaceSymbol: {
-        // TODO: implement fuzzy search, see
-        // https://github.com/junegunn/fzf/blob/master/src/matcher.go for
-        // inspiration
-        auto msg = message->As<Ipc_WorkspaceSymbol>();
-
-        Out_WorkspaceSymbol response;
-        response.id = msg->id;
-
-        LOG_S(INFO) << "[querydb] Considering " << db->detailed_names.size()
-                    << " candidates for query " << msg->params.query;
-
-        std::string query = msg->params.query;
-
-        std::unordered_set<std::string> inserted_results;
-        inserted_results.reserve(config->maxWorkspaceSearchResults);
-
-        for (int i = 0; i < db->detailed_names.size(); ++i) {
-          if (db->detailed_names[i].find(query) != std::string::npos) {
-            // Do not show the same entry twice.
-            if (!inserted_results.insert(db->detailed_names[i]).second)
-              continue;
-
-            InsertSymbolIntoResult(db, working_files, db->symbols[i],
-                                   &response.result);
-            if (response.result.size() >= config->maxWorkspaceSearchResults)
-              break;
-          }
-        }
-
-        if (response.result.size() < config->maxWorkspaceSearchResults) {
-          for (int i = 0; i < db->detailed_names.size(); ++i) {
-            if (SubstringMatch(query, db->detailed_names[i])) {
-              // Do not show the same entry twice.
-              if (!inserted_results.insert(db->detailed_names[i]).second)
-                continue;
-
-              InsertSymbolIntoResult(db, working_files, db->symbols[i],
-                                     &response.result);
-              if (response.result.size() >= config->maxWorkspaceSearchResults)
-                break;
-            }
-          }
-        }
-
-        LOG_S(INFO) << "[querydb] Found " << response.result.size()
-                    << " results for query " << query;
-        ipc->SendOutMessageToClient(IpcId::WorkspaceSymbol, response);
-        break;
-      }
-
       case IpcId::CqueryIndexFile: {
         auto msg = message->As<Ipc_CqueryIndexFile>();
-        queue->index_request.Enqueue(
+        queue->EnqueueIndexRequest(
             Index_Request(NormalizePath(msg->params.path), msg->params.args,
                           msg->params.is_interactive, msg->params.contents));
         break;
@@ -2913,6 +3720,7 @@ bool QueryDbMainLoop(Config* config,
           bool has_work = false;
           has_work |= import_manager->HasActiveQuerydbImports();
           has_work |= queue->HasWork();
+          has_work |= cache_writer->HasWork();
           has_work |= QueryDb_ImportMain(config, db, import_manager, queue,
                                          working_files);
           if (!has_work)
@@ -2932,6 +3740,7 @@ bool QueryDbMainLoop(Config* config,
       case IpcId::CqueryExitWhenIdle: {
         *exit_when_idle = true;
         WorkThread::request_exit_on_idle = true;
+        waiter->Notify();
         break;
       }
 
@@ -2941,10 +3750,22 @@ bool QueryDbMainLoop(Config* config,
         exit(1);
       }
     }
+
+    ++queue->querydb_messages_handled;
   }
+  // Wake up reader threads waiting for the messages to be handled.
+  if (!messages.empty())
+    waiter->Notify();
 
-  // TODO: consider rate-limiting and checking for IPC messages so we don't
-  // block requests / we can serve partial requests.
+  // Index the files which the opened files include first.
+  bool reprioritize = false;
+  for (Index_OnDependencies& response : queue->on_dependencies.DequeueAll()) {
+    did_work = true;
+    reprioritize |= queue->index_request_prioritizer.SetDependencies(
+        response.path, std::move(response.dependencies));
+  }
+  if (reprioritize)
+    queue->ReprioritizeIndexRequests();
 
   if (QueryDb_ImportMain(config, db, import_manager, queue, working_files))
     did_work = true;
@@ -2952,10 +3773,37 @@ bool QueryDbMainLoop(Config* config,
   return did_work;
 }
 
+// Prints a summary of the work done by an --index-only run.
+void PrintIndexOnlySummary(Project* project,
+                           QueueManager* queue,
+                           CacheWriter* cache_writer,
+                           const Timer& time) {
+  double seconds = time.ElapsedMicroseconds() / 1000000.0;
+  int parsed = queue->parsed_file_count;
+  int cached = queue->cached_file_count;
+  int unchanged = cache_writer->unchanged_count();
+  double files_per_second = seconds > 0 ? (parsed + cached) / seconds : 0;
+
+  std::cout << "Indexed " << project->entries.size()
+            << " translation units in " << seconds << "s" << std::endl;
+  std::cout << "  " << parsed << " files parsed, " << cached
+            << " files loaded from cache (" << files_per_second
+            << " files/s)" << std::endl;
+  // Files loaded from cache had an unchanged timestamp or contents and are
+  // not written again either.
+  std::cout << "  " << cached + unchanged << " cache writes skipped ("
+            << cached << " files not reparsed, " << unchanged
+            << " reparsed files unchanged)" << std::endl;
+}
+
+// If |index_only| is set, the thread exits once the project passed to the
+// initialize request has been fully indexed and written to the cache.
 void RunQueryDbThread(const std::string& bin_name,
                       Config* config,
                       MultiQueueWaiter* waiter,
-                      QueueManager* queue) {
+                      QueueManager* queue,
+                      bool index_only) {
+  Timer time;
   bool exit_when_idle = false;
   Project project;
   WorkingFiles working_files;
@@ -2975,30 +3823,65 @@ void RunQueryDbThread(const std::string& bin_name,
   auto signature_cache = MakeUnique<CodeCompleteCache>();
   ImportManager import_manager;
   TimestampManager timestamp_manager;
+  CacheManifest cache_manifest(config);
+  CacheWriter cache_writer(config, &cache_manifest);
 
   // Run query db main loop.
   SetCurrentThreadName("querydb");
   QueryDatabase db;
+  for (int i = 0; i < kNumQueryDbReaders; ++i) {
+    WorkThread::StartThread(
+        "querydb_reader" + std::to_string(i),
+        [config, &db, &working_files, waiter, queue]() {
+          return QueryDbReaderMain(config, &db, &working_files, waiter, queue);
+        });
+  }
   while (true) {
     bool did_work = QueryDbMainLoop(
         config, &db, &exit_when_idle, waiter, queue, &project,
         &file_consumer_shared, &import_manager, &timestamp_manager,
-        &working_files, &clang_complete, &include_complete,
-        global_code_complete_cache.get(), non_global_code_complete_cache.get(),
-        signature_cache.get());
+        &cache_manifest, &cache_writer, &working_files, &clang_complete,
+        &include_complete, global_code_complete_cache.get(),
+        non_global_code_complete_cache.get(), signature_cache.get());
+
+    // Once the project has been loaded and every file has gone through the
+    // pipeline, shut down the indexers and exit.
+    if (index_only && !did_work && !exit_when_idle &&
+        !config->projectRoot.empty() && queue->IsIndexerIdle() &&
+        !import_manager.HasActiveQuerydbImports() &&
+        !cache_writer.HasWork()) {
+      exit_when_idle = true;
+      WorkThread::request_exit_on_idle = true;
+      waiter->Notify();
+    }
 
     // No more work left and exit request. Exit.
     if (!did_work && exit_when_idle && WorkThread::num_active_threads == 0) {
       LOG_S(INFO) << "Exiting; exit_when_idle is set and there is no more work";
+      cache_writer.FlushAll();
+      cache_manifest.Save();
+      FlushCache(config);
+      SaveQueryDatabaseSnapshot(config, &db);
+      if (index_only)
+        PrintIndexOnlySummary(&project, queue, &cache_writer, time);
       exit(0);
     }
 
+    // Persist the manifest once the indexing pipeline has drained. This is a
+    // no-op if nothing has been written to the cache since the last save. The
+    // queues are also empty while the indexers are parsing, so wait for the
+    // indexers too; otherwise the manifest is rewritten after every file.
+    if (!did_work && queue->IsIndexerIdle() && !cache_writer.HasWork()) {
+      cache_manifest.Save();
+      FlushCache(config);
+    }
+
     // Cleanup and free any unused memory.
     FreeUnusedMemory();
 
     if (!did_work) {
       waiter->Wait({IpcManager::instance()->threaded_queue_for_server_.get(),
-                    &queue->do_id_map, &queue->on_indexed});
+                    &queue->on_indexed, &queue->on_dependencies});
     }
   }
 }
@@ -3027,10 +3910,9 @@ void RunQueryDbThread(const std::string& bin_name,
 //
 // |ipc| is connected to a server.
 void LaunchStdinLoop(Config* config,
+                     QueueManager* queue,
                      std::unordered_map<IpcId, Timer>* request_times) {
-  WorkThread::StartThread("stdin", [request_times]() {
-    IpcManager* ipc = IpcManager::instance();
-
+  WorkThread::StartThread("stdin", [queue, request_times]() {
     std::unique_ptr<BaseIpcMessage> message =
         MessageRegistry::instance()->ReadMessageFromStdin(
             g_log_stdin_stdout_to_stderr);
@@ -3040,6 +3922,7 @@ void LaunchStdinLoop(Config* config,
       return WorkThread::Result::MoreWork;
 
     (*request_times)[message->method_id] = Timer();
+    queue->request_cancellation.Track(message.get());
 
     // std::cerr << "[stdin] Got message " << IpcIdToString(message->method_id)
     // << std::endl;
@@ -3050,7 +3933,8 @@ void LaunchStdinLoop(Config* config,
       }
 
       case IpcId::CancelRequest: {
-        // TODO: support cancellation
+        auto msg = message->As<Ipc_CancelRequest>();
+        queue->request_cancellation.Cancel(msg->params.id);
         break;
       }
 
@@ -3065,7 +3949,7 @@ void LaunchStdinLoop(Config* config,
         // loop to exit the thread. If we keep parsing input stdin is likely
         // closed so cquery will exit.
         LOG_S(INFO) << "cquery will exit when all threads are idle";
-        ipc->SendMessage(IpcManager::Destination::Server, std::move(message));
+        queue->SendToQueryDb(std::move(message));
         return WorkThread::Result::ExitThread;
       }
 
@@ -3087,6 +3971,8 @@ void LaunchStdinLoop(Config* config,
       case IpcId::TextDocumentCodeLens:
       case IpcId::WorkspaceSymbol:
       case IpcId::CqueryFreshenIndex:
+      case IpcId::CquerySaveSnapshot:
+      case IpcId::CqueryCollectCache:
       case IpcId::CqueryTypeHierarchyTree:
       case IpcId::CqueryCallTreeInitial:
       case IpcId::CqueryCallTreeExpand:
@@ -3096,7 +3982,7 @@ void LaunchStdinLoop(Config* config,
       case IpcId::CqueryDerived:
       case IpcId::CqueryIndexFile:
       case IpcId::CqueryQueryDbWaitForIdleIndexer: {
-        ipc->SendMessage(IpcManager::Destination::Server, std::move(message));
+        queue->SendToQueryDb(std::move(message));
         break;
       }
 
@@ -3169,7 +4055,7 @@ void LanguageServerMain(const std::string& bin_name,
   std::unordered_map<IpcId, Timer> request_times;
 
   std::cin.tie(NULL);
-  LaunchStdinLoop(config, &request_times);
+  LaunchStdinLoop(config, &queue, &request_times);
 
   // We run a dedicated thread for writing to stdout because there can be an
   // unknown number of delays when output information.
@@ -3177,7 +4063,37 @@ void LanguageServerMain(const std::string& bin_name,
 
   // Start querydb which takes over this thread. The querydb will launch
   // indexer threads as needed.
-  RunQueryDbThread(bin_name, config, waiter, &queue);
+  RunQueryDbThread(bin_name, config, waiter, &queue, false /*index_only*/);
+}
+
+// Indexes |project_directory| without a language client and writes the
+// results to the cache, so that editors opening the project start warm.
+void IndexOnlyMain(const std::string& bin_name,
+                   Config* config,
+                   MultiQueueWaiter* waiter,
+                   const std::string& project_directory) {
+  QueueManager queue(waiter);
+  IpcManager* ipc = IpcManager::instance();
+
+  // There is no client, so drop anything that would be sent to it.
+  WorkThread::StartThread("stdout", [=]() {
+    if (ipc->GetMessages(IpcManager::Destination::Client).empty()) {
+      waiter->Wait({ipc->threaded_queue_for_client_.get()});
+      return WorkThread::Result::NoWork;
+    }
+    return WorkThread::Result::MoreWork;
+  });
+
+  // Drive querydb through the same initialize request an editor would send.
+  config->clientVersion = -1;
+  auto request = MakeUnique<Ipc_InitializeRequest>();
+  request->id.id0 = 0;
+  request->params.rootUri =
+      lsDocumentUri::FromPath(NormalizePath(project_directory));
+  request->params.initializationOptions = *config;
+  queue.SendToQueryDb(std::move(request));
+
+  RunQueryDbThread(bin_name, config, waiter, &queue, true /*index_only*/);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3251,6 +4167,24 @@ int main(int argc, char** argv) {
     return 0;
   }
 
+  if (HasOption(options, "--index-only")) {
+    print_help = false;
+    auto config = MakeUnique<Config>();
+    config->cacheDirectory = options["--cache-directory"];
+    config->compilationDatabaseDirectory =
+        options["--compilation-database-directory"];
+    if (HasOption(options, "--indexer-count"))
+      config->indexerCount = atoi(options["--indexer-count"].c_str());
+    if (options["--index-only"].empty() || config->cacheDirectory.empty()) {
+      std::cerr << "--index-only requires a project directory and "
+                   "--cache-directory"
+                << std::endl;
+      return 1;
+    }
+    IndexOnlyMain(argv[0], config.get(), &waiter, options["--index-only"]);
+    return 0;
+  }
+
   if (print_help) {
     std::cout << R"help(cquery help:
 
@@ -3261,6 +4195,11 @@ int main(int argc, char** argv) {
     --language-server
                   Run as a language server. This implements the language
                   server spec over STDIN and STDOUT.
+    --index-only <project directory>
+                  Index the project without a language client, write the
+                  results to the cache and exit. Requires --cache-directory.
+                  Use this to prewarm the cache, ie, as part of a nightly
+                  build.
     --test-unit   Run unit tests.
     --test-index  Run index tests.
     --log-stdin-stdout-to-stderr
@@ -3268,6 +4207,15 @@ int main(int argc, char** argv) {
                   developing new language clients, as it makes it easier to
                   figure out how the client is interacting with cquery.
 
+  Index only:
+    --cache-directory <directory>
+                  Directory to write the cache to.
+    --compilation-database-directory <directory>
+                  Directory containing compile_commands.json, if it is not in
+                  the project directory.
+    --indexer-count <count>
+                  Number of indexer threads. Defaults to 80% of the cores.
+
   Configuration:
     When opening up a directory, cquery will look for a compile_commands.json
     file emitted by your preferred build system. If not present, cquery will
@@ -3469,3 +4417,122 @@ TEST_SUITE("FindIncludeLine") {
     REQUIRE(FindIncludeLine(lines, "#include <e>") == 7);
   }
 }
+
+TEST_SUITE("IndexRequestPrioritizer") {
+  IndexRequestPriority GetPriority(const IndexRequestPrioritizer& prioritizer,
+                                   const std::string& path) {
+    return prioritizer.GetPriority(
+        Index_Request(path, {} /*args*/, false /*is_interactive*/, nullopt));
+  }
+
+  TEST_CASE("open files and their dependencies go first") {
+    IndexRequestPrioritizer prioritizer;
+    prioritizer.SetProjectRoot("/project/");
+    prioritizer.OnOpen("/project/src/foo.cc");
+    REQUIRE(prioritizer.SetDependencies("/project/src/foo.cc",
+                                        {"/project/include/bar.h"}));
+
+    REQUIRE(GetPriority(prioritizer, "/project/src/foo.cc") ==
+            IndexRequestPriority::OpenFile);
+    REQUIRE(GetPriority(prioritizer, "/project/lib/bar.cc") ==
+            IndexRequestPriority::OpenFileDependency);
+    REQUIRE(GetPriority(prioritizer, "/project/src/baz.cc") ==
+            IndexRequestPriority::OpenFileNeighbor);
+    REQUIRE(GetPriority(prioritizer, "/project/lib/baz.cc") ==
+            IndexRequestPriority::Default);
+
+    prioritizer.OnClose("/project/src/foo.cc");
+    REQUIRE(GetPriority(prioritizer, "/project/lib/bar.cc") ==
+            IndexRequestPriority::Default);
+  }
+
+  TEST_CASE("system headers are not dependencies") {
+    IndexRequestPrioritizer prioritizer;
+    prioritizer.SetProjectRoot("/project/");
+    prioritizer.OnOpen("/project/src/foo.cc");
+    prioritizer.SetDependencies("/project/src/foo.cc",
+                                {"/usr/include/c++/string", "/project/bar.h"});
+
+    REQUIRE(GetPriority(prioritizer, "/project/lib/string.cc") ==
+            IndexRequestPriority::Default);
+    REQUIRE(GetPriority(prioritizer, "/project/lib/bar.cc") ==
+            IndexRequestPriority::OpenFileDependency);
+  }
+
+  TEST_CASE("dependencies of a closed file are ignored") {
+    IndexRequestPrioritizer prioritizer;
+    REQUIRE(!prioritizer.SetDependencies("/project/src/foo.cc",
+                                         {"/project/bar.h"}));
+    prioritizer.OnOpen("/project/src/foo.cc");
+    REQUIRE(prioritizer.SetDependencies("/project/src/foo.cc",
+                                        {"/project/bar.h"}));
+    REQUIRE(!prioritizer.SetDependencies("/project/src/foo.cc",
+                                         {"/project/bar.h"}));
+  }
+}
+
+TEST_SUITE("QueueManager") {
+  Index_Request MakeIndexRequest(const std::string& path,
+                                 bool is_interactive) {
+    return Index_Request(path, {} /*args*/, is_interactive, nullopt);
+  }
+
+  TEST_CASE("a newer request replaces a queued one") {
+    MultiQueueWaiter waiter;
+    QueueManager queue(&waiter);
+    queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", false));
+    queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", true));
+    queue.EnqueueIndexRequest(MakeIndexRequest("bar.cc", false));
+
+    optional<Index_Request> request = queue.DequeueIndexRequest();
+    REQUIRE(request);
+    REQUIRE(request->path == "foo.cc");
+    REQUIRE(request->is_interactive);
+    request = queue.DequeueIndexRequest();
+    REQUIRE(request);
+    REQUIRE(request->path == "bar.cc");
+    REQUIRE(!queue.DequeueIndexRequest());
+  }
+
+  TEST_CASE("a replaced request keeps forcing a reparse") {
+    MultiQueueWaiter waiter;
+    QueueManager queue(&waiter);
+    queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", true));
+    queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", false));
+
+    optional<Index_Request> request = queue.DequeueIndexRequest();
+    REQUIRE(request);
+    REQUIRE(request->is_interactive);
+    REQUIRE(!queue.DequeueIndexRequest());
+  }
+
+  TEST_CASE("only an interactive request aborts a running one") {
+    for (bool is_interactive : {false, true}) {
+      MultiQueueWaiter waiter;
+      QueueManager queue(&waiter);
+      queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", false));
+      optional<Index_Request> running = queue.DequeueIndexRequest();
+      REQUIRE(running);
+
+      // Otherwise the newer request finds the file up to date once the
+      // running parse is done.
+      queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", is_interactive));
+      REQUIRE(running->IsObsolete() == is_interactive);
+    }
+  }
+
+  TEST_CASE("finishing an old request keeps tracking the newer one") {
+    MultiQueueWaiter waiter;
+    QueueManager queue(&waiter);
+    queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", false));
+    optional<Index_Request> old_request = queue.DequeueIndexRequest();
+    REQUIRE(old_request);
+    queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", false));
+    optional<Index_Request> new_request = queue.DequeueIndexRequest();
+    REQUIRE(new_request);
+
+    queue.FinishIndexRequest(*old_request);
+    queue.EnqueueIndexRequest(MakeIndexRequest("foo.cc", true));
+    REQUIRE(new_request->IsObsolete());
+  }
+}
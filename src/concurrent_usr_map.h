@@ -0,0 +1,157 @@
+#pragma once
+
+#include "usr_hash.h"
+
+#include <optional.h>
+#include <sparsepp/spp.h>
+
+#include <array>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::experimental::nullopt;
+using std::experimental::optional;
+
+// Thread-safe mapping from USRs (or file paths) to ids which are allocated on
+// first use. The table is split into independently locked shards, so threads
+// interning different USRs rarely wait on each other.
+//
+// Shards are keyed by UsrHash. Every usr is stored exactly once, in a pool
+// indexed by id, so the owner of the ids does not need to keep a copy; see
+// GetUsr().
+//
+// Ids are dense and handed out in increasing order. The owner of the storage
+// the ids index into collects new ids with TakeNewEntries() and creates the
+// storage for them.
+template <typename TId>
+struct ConcurrentUsrMap {
+  ConcurrentUsrMap() = default;
+
+  // Replaces the contents of this map with |other|. Not thread-safe; neither
+  // map may be in use.
+  ConcurrentUsrMap& operator=(ConcurrentUsrMap&& other) {
+    for (size_t i = 0; i < kNumShards; ++i)
+      shards_[i].ids = std::move(other.shards_[i].ids);
+    // Moving a deque keeps its elements in place, so the shard entries still
+    // point into it.
+    usrs_ = std::move(other.usrs_);
+    new_entries_ = std::move(other.new_entries_);
+    return *this;
+  }
+
+  // Returns the id of |usr|. If |usr| has not been seen before it gets the
+  // next id, and |name| is reported for it by TakeNewEntries().
+  TId Intern(const std::string& usr, const std::string& name) {
+    UsrHash hash = HashUsr(usr);
+    Shard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    UsrHash key;
+    if (const Entry* entry = FindUsr(shard.ids, usr, hash, &UsrOf, &key))
+      return entry->id;
+
+    Entry entry;
+    {
+      std::lock_guard<std::mutex> pool_lock(pool_mutex_);
+      entry.id = TId(usrs_.size());
+      usrs_.push_back(usr);
+      entry.usr = &usrs_.back();
+      new_entries_.emplace_back(entry.id, name);
+    }
+    shard.ids[key] = entry;
+    return entry.id;
+  }
+  TId Intern(const std::string& usr) { return Intern(usr, std::string()); }
+
+  // Returns the id of |usr|, or nullopt if it has not been interned.
+  optional<TId> Find(const std::string& usr) const {
+    UsrHash hash = HashUsr(usr);
+    const Shard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (const Entry* entry = FindUsr(shard.ids, usr, hash, &UsrOf))
+      return entry->id;
+    return nullopt;
+  }
+
+  // Returns the usr |id| was interned for.
+  std::string GetUsr(TId id) const {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    return id.id < usrs_.size() ? usrs_[id.id] : std::string();
+  }
+
+  // Adds |usr| with an id which was allocated earlier, ie, by a previous
+  // session. It is not reported by TakeNewEntries(). Must not be called
+  // concurrently with Intern().
+  void Restore(const std::string& usr, TId id) {
+    UsrHash hash = HashUsr(usr);
+    Shard& shard = GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    std::lock_guard<std::mutex> pool_lock(pool_mutex_);
+    if (id.id >= usrs_.size())
+      usrs_.resize(id.id + 1);
+    usrs_[id.id] = usr;
+
+    UsrHash key;
+    if (!FindUsr(shard.ids, usr, hash, &UsrOf, &key)) {
+      Entry& entry = shard.ids[key];
+      entry.id = id;
+      entry.usr = &usrs_[id.id];
+    }
+  }
+
+  // Returns the ids allocated since the last call in increasing order, along
+  // with the name they were interned with.
+  std::vector<std::pair<TId, std::string>> TakeNewEntries() {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    std::vector<std::pair<TId, std::string>> result;
+    std::swap(result, new_entries_);
+    return result;
+  }
+
+  // Calls |fn| for every entry. Shards are locked one at a time, so entries
+  // which are interned concurrently may or may not be visited. |fn| must not
+  // use this map.
+  void ForEach(
+      const std::function<void(const std::string& usr, TId id)>& fn) const {
+    for (const Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (const auto& entry : shard.ids)
+        fn(*entry.second.usr, entry.second.id);
+    }
+  }
+
+ private:
+  static const size_t kNumShards = 32;
+
+  struct Entry {
+    TId id;
+    // Points into |usrs_|.
+    const std::string* usr = nullptr;
+  };
+
+  struct Shard {
+    mutable std::mutex mutex;
+    spp::sparse_hash_map<UsrHash, Entry> ids;
+  };
+
+  static const std::string& UsrOf(const Entry& entry) { return *entry.usr; }
+
+  // The low bits of the hash pick the bucket inside the shard, so use the high
+  // bits to pick the shard.
+  Shard& GetShard(UsrHash hash) { return shards_[(hash >> 32) % kNumShards]; }
+  const Shard& GetShard(UsrHash hash) const {
+    return shards_[(hash >> 32) % kNumShards];
+  }
+
+  std::array<Shard, kNumShards> shards_;
+
+  // Lock order: a shard's mutex, then |pool_mutex_|.
+  mutable std::mutex pool_mutex_;
+  // The usr of every id, indexed by id. Elements never move, since the deque
+  // only grows at the back.
+  std::deque<std::string> usrs_;
+  std::vector<std::pair<TId, std::string>> new_entries_;
+};
@@ -29,12 +29,49 @@ struct Config {
   // Force a certain number of indexer threads. If less than 1 a default value
   // should be used.
   int indexerCount = 0;
+  // Number of indexer threads which keep running when indexing backs off
+  // because of system load, memory use or code completion. If less than 1 or
+  // not less than |indexerCount| every indexer runs all the time.
+  int minIndexerCount = 0;
+  // If the process uses more memory than this, indexers are stopped one at a
+  // time, down to |minIndexerCount|, until it drops. 0 means no limit. Only
+  // used if |minIndexerCount| is less than |indexerCount|.
+  int indexerMemoryLimitMb = 0;
+  // If true, indexers run at a low CPU and I/O priority so that a large index
+  // does not slow down interactive requests like hover or completion.
+  bool enableIndexerBackgroundPriority = true;
+  // Maximum time in milliseconds querydb spends importing index updates before
+  // it handles pending client messages again. At least one update is imported
+  // in between. 0 means no limit.
+  int indexImportBudgetMs = 20;
+  // Queued index updates are merged into a single update until it has this
+  // many entries, which bounds how long importing one update can take. 0 means
+  // no limit.
+  int indexUpdateMaxSize = 50000;
   // If false, the indexer will be disabled.
   bool enableIndexing = true;
   // If false, indexed files will not be written to disk.
   bool enableCacheWrite = true;
   // If false, the index will not be loaded from a previous run.
   bool enableCacheRead = true;
+  // Format used for the cached index files, either "json" or "binary". json
+  // is easier to inspect; binary is considerably faster to load and smaller.
+  SerializeFormat cacheFormat = SerializeFormat::Json;
+  // If true, the cache is stored in a single append-only pack file instead of
+  // two files per indexed file. Useful for very large projects, where a cache
+  // directory with hundreds of thousands of files is slow to access.
+  bool enablePackedCache = false;
+  // Maximum size of the cache in megabytes. When the cache is larger, the
+  // least recently used files are evicted on startup and on
+  // $cquery/collectCache. 0 means no limit.
+  int cacheSizeLimitMb = 0;
+  // If true, paths in the cache are stored relative to the project root and
+  // |relocatableCacheRoots|, so the cache can be copied to another machine or
+  // checkout, ie, a cache prebuilt by CI. Every user of a cache must list the
+  // same roots in the same order. Changing this causes a full reindex.
+  bool enableRelocatableCache = false;
+  // Additional roots for a relocatable cache, ie, the toolchain directory.
+  std::vector<std::string> relocatableCacheRoots;
 
   // If true, cquery will send progress reports while indexing
   bool enableProgressReports = true;
@@ -87,9 +124,19 @@ MAKE_REFLECT_STRUCT(Config,
 
                     maxWorkspaceSearchResults,
                     indexerCount,
+                    minIndexerCount,
+                    indexerMemoryLimitMb,
+                    enableIndexerBackgroundPriority,
+                    indexImportBudgetMs,
+                    indexUpdateMaxSize,
                     enableIndexing,
                     enableCacheWrite,
                     enableCacheRead,
+                    cacheFormat,
+                    enablePackedCache,
+                    cacheSizeLimitMb,
+                    enableRelocatableCache,
+                    relocatableCacheRoots,
                     enableProgressReports,
 
                     includeCompletionMaximumPathLength,
@@ -5,14 +5,22 @@
 #include "platform.h"
 #include "utils.h"
 
+#include <doctest/doctest.h>
+
 bool operator==(const CXFileUniqueID& a, const CXFileUniqueID& b) {
   return a.data[0] == b.data[0] && a.data[1] == b.data[1] &&
          a.data[2] == b.data[2];
 }
 
-bool FileConsumer::SharedState::Mark(const std::string& file) {
+bool FileConsumer::SharedState::Mark(const std::string& file,
+                                     int64_t* generation) {
   std::lock_guard<std::mutex> lock(mutex);
-  return files.insert(file).second;
+  if (!files.insert(std::make_pair(file, next_generation)).second)
+    return false;
+  if (generation)
+    *generation = next_generation;
+  ++next_generation;
+  return true;
 }
 
 void FileConsumer::SharedState::Reset(const std::string& file) {
@@ -22,6 +30,14 @@ void FileConsumer::SharedState::Reset(const std::string& file) {
     files.erase(it);
 }
 
+void FileConsumer::SharedState::Release(const std::string& file,
+                                        int64_t generation) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = files.find(file);
+  if (it != files.end() && it->second == generation)
+    files.erase(it);
+}
+
 FileConsumer::FileConsumer(SharedState* shared_state,
                            const std::string& parse_file)
     : shared_(shared_state), parse_file_(parse_file) {}
@@ -45,9 +61,12 @@ IndexFile* FileConsumer::TryConsumeFile(CXFile file, bool* is_first_ownership) {
   std::string file_name = FileName(file);
 
   // No result in local; we need to query global.
-  bool did_insert = shared_->Mark(file_name);
+  int64_t generation = 0;
+  bool did_insert = shared_->Mark(file_name, &generation);
   *is_first_ownership = did_insert;
   local_[file_id] = did_insert ? MakeUnique<IndexFile>(file_name) : nullptr;
+  if (did_insert)
+    local_[file_id]->file_consumer_generation_ = generation;
   return local_[file_id].get();
 }
 
@@ -92,4 +111,25 @@ void FileConsumer::EmitError(CXFile file) const {
                                 file_name + " when parsing " + parse_file_;
     std::cerr << error_message << std::endl;
   }
-}
\ No newline at end of file
+}
+
+TEST_SUITE("FileConsumer") {
+  TEST_CASE("release keeps a newer owner") {
+    FileConsumer::SharedState shared;
+    int64_t old_generation = 0;
+    REQUIRE(shared.Mark("foo.h", &old_generation));
+    REQUIRE(!shared.Mark("foo.h"));
+
+    // A newer parse resets the file and takes it again.
+    shared.Reset("foo.h");
+    int64_t new_generation = 0;
+    REQUIRE(shared.Mark("foo.h", &new_generation));
+    REQUIRE(new_generation != old_generation);
+
+    // The older parse giving up the file does not release it.
+    shared.Release("foo.h", old_generation);
+    REQUIRE(!shared.Mark("foo.h"));
+    shared.Release("foo.h", new_generation);
+    REQUIRE(shared.Mark("foo.h"));
+  }
+}
@@ -4,10 +4,10 @@
 
 #include <clang-c/Index.h>
 
+#include <cstdint>
 #include <functional>
 #include <mutex>
 #include <unordered_map>
-#include <unordered_set>
 
 struct IndexFile;
 
@@ -24,13 +24,20 @@ bool operator==(const CXFileUniqueID& a, const CXFileUniqueID& b);
 // units but we still want to index them.
 struct FileConsumer {
   struct SharedState {
-    mutable std::unordered_set<std::string> files;
+    // Used files, mapped to the generation of the Mark() call which took them.
+    mutable std::unordered_map<std::string, int64_t> files;
     mutable std::mutex mutex;
+    int64_t next_generation = 1;
 
     // Mark the file as used. Returns true if the file was not previously used.
-    bool Mark(const std::string& file);
+    // If so and |generation| is given, it receives a number which identifies
+    // this use of the file; see Release().
+    bool Mark(const std::string& file, int64_t* generation = nullptr);
     // Reset the used state (ie, mark the file as unused).
     void Reset(const std::string& file);
+    // Resets the used state of |file| only if it has not been reset and marked
+    // again since the Mark() call which returned |generation|.
+    void Release(const std::string& file, int64_t generation);
   };
 
   FileConsumer(SharedState* shared_state, const std::string& parse_file);
@@ -212,6 +212,10 @@ struct IndexParam {
   NamespaceHelper ns;
   ConstructorCache ctors;
 
+  // May be null. Polled by abortQuery.
+  const std::function<bool()>* is_cancelled = nullptr;
+  bool was_cancelled = false;
+
   IndexParam(ClangTranslationUnit* tu, FileConsumer* file_consumer)
       : tu(tu), file_consumer(file_consumer) {}
 };
@@ -368,51 +372,45 @@ std::string GetDocumentContentInRange(CXTranslationUnit cx_tu,
 }  // namespace
 
 // static
-int IndexFile::kCurrentVersion = 5;
+int IndexFile::kCurrentVersion = 6;
 
 IndexFile::IndexFile(const std::string& path) : id_cache(path), path(path) {
   // TODO: Reconsider if we should still be reusing the same id_cache.
   // Preallocate any existing resolved ids.
-  for (const auto& entry : id_cache.usr_to_type_id)
-    types.push_back(IndexType(entry.second, entry.first));
-  for (const auto& entry : id_cache.usr_to_func_id)
-    funcs.push_back(IndexFunc(entry.second, entry.first));
-  for (const auto& entry : id_cache.usr_to_var_id)
-    vars.push_back(IndexVar(entry.second, entry.first));
+  for (const auto& entry : id_cache.type_id_to_usr)
+    types.push_back(IndexType(entry.first, entry.second));
+  for (const auto& entry : id_cache.func_id_to_usr)
+    funcs.push_back(IndexFunc(entry.first, entry.second));
+  for (const auto& entry : id_cache.var_id_to_usr)
+    vars.push_back(IndexVar(entry.first, entry.second));
 }
 
 // TODO: Optimize for const char*?
 IndexTypeId IndexFile::ToTypeId(const std::string& usr) {
-  auto it = id_cache.usr_to_type_id.find(usr);
-  if (it != id_cache.usr_to_type_id.end())
-    return it->second;
+  if (optional<IndexTypeId> id = id_cache.FindTypeId(usr))
+    return *id;
 
   IndexTypeId id(types.size());
   types.push_back(IndexType(id, usr));
-  id_cache.usr_to_type_id[usr] = id;
-  id_cache.type_id_to_usr[id] = usr;
+  id_cache.AddTypeId(usr, id);
   return id;
 }
 IndexFuncId IndexFile::ToFuncId(const std::string& usr) {
-  auto it = id_cache.usr_to_func_id.find(usr);
-  if (it != id_cache.usr_to_func_id.end())
-    return it->second;
+  if (optional<IndexFuncId> id = id_cache.FindFuncId(usr))
+    return *id;
 
   IndexFuncId id(funcs.size());
   funcs.push_back(IndexFunc(id, usr));
-  id_cache.usr_to_func_id[usr] = id;
-  id_cache.func_id_to_usr[id] = usr;
+  id_cache.AddFuncId(usr, id);
   return id;
 }
 IndexVarId IndexFile::ToVarId(const std::string& usr) {
-  auto it = id_cache.usr_to_var_id.find(usr);
-  if (it != id_cache.usr_to_var_id.end())
-    return it->second;
+  if (optional<IndexVarId> id = id_cache.FindVarId(usr))
+    return *id;
 
   IndexVarId id(vars.size());
   vars.push_back(IndexVar(id, usr));
-  id_cache.usr_to_var_id[usr] = id;
-  id_cache.var_id_to_usr[id] = usr;
+  id_cache.AddVarId(usr, id);
   return id;
 }
 
@@ -439,7 +437,7 @@ IndexVar* IndexFile::Resolve(IndexVarId id) {
 }
 
 std::string IndexFile::ToString() {
-  return Serialize(*this);
+  return Serialize(SerializeFormat::Json, *this);
 }
 
 IndexType::IndexType(IndexTypeId id, const std::string& usr)
@@ -463,6 +461,57 @@ void UniqueAdd(std::vector<T>& values, T value) {
 IdCache::IdCache(const std::string& primary_file)
     : primary_file(primary_file) {}
 
+namespace {
+
+template <typename TId>
+optional<TId> FindId(const std::unordered_map<UsrHash, TId>& usr_to_id,
+                     const std::unordered_map<TId, std::string>& id_to_usr,
+                     const std::string& usr,
+                     UsrHash* insert_key = nullptr) {
+  auto usr_of = [&id_to_usr](TId id) -> const std::string& {
+    return id_to_usr.find(id)->second;
+  };
+  if (const TId* id =
+          FindUsr(usr_to_id, usr, HashUsr(usr), usr_of, insert_key))
+    return *id;
+  return nullopt;
+}
+
+template <typename TId>
+void AddId(std::unordered_map<UsrHash, TId>* usr_to_id,
+           std::unordered_map<TId, std::string>* id_to_usr,
+           const std::string& usr,
+           TId id) {
+  UsrHash key;
+  bool found = static_cast<bool>(FindId(*usr_to_id, *id_to_usr, usr, &key));
+  assert(!found);
+  (void)found;
+  (*usr_to_id)[key] = id;
+  (*id_to_usr)[id] = usr;
+}
+
+}  // namespace
+
+optional<IndexTypeId> IdCache::FindTypeId(const std::string& usr) const {
+  return FindId(usr_to_type_id, type_id_to_usr, usr);
+}
+optional<IndexFuncId> IdCache::FindFuncId(const std::string& usr) const {
+  return FindId(usr_to_func_id, func_id_to_usr, usr);
+}
+optional<IndexVarId> IdCache::FindVarId(const std::string& usr) const {
+  return FindId(usr_to_var_id, var_id_to_usr, usr);
+}
+
+void IdCache::AddTypeId(const std::string& usr, IndexTypeId id) {
+  AddId(&usr_to_type_id, &type_id_to_usr, usr, id);
+}
+void IdCache::AddFuncId(const std::string& usr, IndexFuncId id) {
+  AddId(&usr_to_func_id, &func_id_to_usr, usr, id);
+}
+void IdCache::AddVarId(const std::string& usr, IndexVarId id) {
+  AddId(&usr_to_var_id, &var_id_to_usr, usr, id);
+}
+
 template <typename T>
 bool Contains(const std::vector<T>& vec, const T& element) {
   for (const T& entry : vec) {
@@ -473,8 +522,11 @@ bool Contains(const std::vector<T>& vec, const T& element) {
 }
 
 int abortQuery(CXClientData client_data, void* reserved) {
+  IndexParam* param = static_cast<IndexParam*>(client_data);
+  if (param->is_cancelled && *param->is_cancelled && (*param->is_cancelled)())
+    param->was_cancelled = true;
   // 0 -> continue
-  return 0;
+  return param->was_cancelled ? 1 : 0;
 }
 void diagnostic(CXClientData client_data,
                 CXDiagnosticSet diagnostics,
@@ -1610,7 +1662,8 @@ std::vector<std::unique_ptr<IndexFile>> Parse(
     const std::vector<FileContents>& file_contents,
     PerformanceImportFile* perf,
     ClangIndex* index,
-    bool dump_ast) {
+    bool dump_ast,
+    const std::function<bool()>& is_cancelled) {
   if (!config->enableIndexing)
     return {};
 
@@ -1636,11 +1689,17 @@ std::vector<std::unique_ptr<IndexFile>> Parse(
 
   perf->index_parse = timer.ElapsedMicrosecondsAndReset();
 
+  // Parsing cannot be interrupted, so check before spending time on indexing.
+  if (is_cancelled && is_cancelled()) {
+    LOG_S(INFO) << "Cancelled indexing " << file << " after parsing";
+    return {};
+  }
+
   if (dump_ast)
     Dump(clang_getTranslationUnitCursor(tu->cx_tu));
 
   return ParseWithTu(file_consumer_shared, perf, tu.get(), index, file, args,
-                     unsaved_files);
+                     unsaved_files, is_cancelled);
 }
 
 std::vector<std::unique_ptr<IndexFile>> ParseWithTu(
@@ -1650,7 +1709,8 @@ std::vector<std::unique_ptr<IndexFile>> ParseWithTu(
     ClangIndex* index,
     const std::string& file,
     const std::vector<std::string>& args,
-    const std::vector<CXUnsavedFile>& file_contents) {
+    const std::vector<CXUnsavedFile>& file_contents,
+    const std::function<bool()>& is_cancelled) {
   Timer timer;
 
   IndexerCallbacks callbacks[] = {{&abortQuery, &diagnostic, &enteredMainFile,
@@ -1660,6 +1720,7 @@ std::vector<std::unique_ptr<IndexFile>> ParseWithTu(
 
   FileConsumer file_consumer(file_consumer_shared, file);
   IndexParam param(tu, &file_consumer);
+  param.is_cancelled = &is_cancelled;
   for (const CXUnsavedFile& contents : file_contents) {
     param.file_contents[contents.Filename] =
         std::string(contents.Contents, contents.Length);
@@ -1679,6 +1740,15 @@ std::vector<std::unique_ptr<IndexFile>> ParseWithTu(
   clang_IndexAction_dispose(index_action);
   // std::cerr << "!! [END] Indexing " << file << std::endl;
 
+  if (param.was_cancelled) {
+    // Let the next parse index the files which this one took ownership of.
+    for (std::unique_ptr<IndexFile>& entry :
+         param.file_consumer->TakeLocalState())
+      file_consumer_shared->Reset(entry->path);
+    LOG_S(INFO) << "Cancelled indexing " << file;
+    return {};
+  }
+
   ClangCursor(clang_getTranslationUnitCursor(tu->cx_tu))
       .VisitChildren(&VisitMacroDefinitionAndExpansions, &param);
 
@@ -1704,6 +1774,8 @@ std::vector<std::unique_ptr<IndexFile>> ParseWithTu(
       if (entry->path == contents.Filename)
         entry->file_contents_ = std::string(contents.Contents, contents.Length);
     }
+    if (!entry->file_contents_.empty())
+      entry->content_hash = HashContent(entry->file_contents_);
   }
 
   return result;
@@ -8,6 +8,7 @@
 #include "performance.h"
 #include "position.h"
 #include "serializer.h"
+#include "usr_hash.h"
 #include "utils.h"
 
 #include <optional.h>
@@ -20,6 +21,7 @@
 #include <cassert>
 #include <cstdint>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <unordered_map>
 #include <vector>
@@ -30,12 +32,16 @@ struct IndexVar;
 
 using namespace std::experimental;
 
+// Ids are 32-bit: no project has four billion symbols, and querydb stores
+// hundreds of millions of ids in use lists, where every byte counts.
+using RawId = uint32_t;
+
 template <typename T>
 struct Id {
-  size_t id;
+  RawId id;
 
   Id() : id(0) {}  // Needed for containers. Do not use directly.
-  explicit Id(size_t id) : id(id) {}
+  explicit Id(RawId id) : id(id) {}
 
   // Needed for google::dense_hash_map.
   explicit operator size_t() const { return id; }
@@ -71,6 +77,14 @@ template <typename T>
 void Reflect(Writer& visitor, Id<T>& value) {
   visitor.Uint64(value.id);
 }
+template <typename T>
+void Reflect(BinaryReader& visitor, Id<T>& id) {
+  visitor.Read(&id.id);
+}
+template <typename T>
+void Reflect(BinaryWriter& visitor, Id<T>& value) {
+  visitor.Write<RawId>(value.id);
+}
 
 using IndexTypeId = Id<IndexType>;
 using IndexFuncId = Id<IndexFunc>;
@@ -89,7 +103,7 @@ struct IndexFuncRef {
   IndexFuncRef(IndexFuncId id, Range loc, bool is_implicit)
       : id(id), loc(loc), is_implicit(is_implicit) {}
   IndexFuncRef(Range loc, bool is_implicit)
-      : id(IndexFuncId((size_t)-1)), loc(loc), is_implicit(is_implicit) {}
+      : id(IndexFuncId((RawId)-1)), loc(loc), is_implicit(is_implicit) {}
 
   inline bool operator==(const IndexFuncRef& other) {
     return id == other.id && loc == other.loc &&
@@ -134,7 +148,7 @@ inline void Reflect(Writer& visitor, IndexFuncRef& value) {
     s += "~";
 
   // id.id is unsigned, special case 0 value
-  if (value.id.id == static_cast<size_t>(-1)) {
+  if (value.id.id == static_cast<RawId>(-1)) {
     s += "-1";
   } else {
     s += std::to_string(value.id.id);
@@ -143,6 +157,16 @@ inline void Reflect(Writer& visitor, IndexFuncRef& value) {
   s += "@" + value.loc.ToString();
   visitor.String(s.c_str());
 }
+inline void Reflect(BinaryReader& visitor, IndexFuncRef& value) {
+  Reflect(visitor, value.id);
+  Reflect(visitor, value.loc);
+  Reflect(visitor, value.is_implicit);
+}
+inline void Reflect(BinaryWriter& visitor, IndexFuncRef& value) {
+  Reflect(visitor, value.id);
+  Reflect(visitor, value.loc);
+  Reflect(visitor, value.is_implicit);
+}
 
 template <typename TypeId, typename FuncId, typename VarId, typename Range>
 struct TypeDefDefinitionData {
@@ -446,14 +470,25 @@ MAKE_HASHABLE(IndexVar, t.def.usr);
 
 struct IdCache {
   std::string primary_file;
-  std::unordered_map<std::string, IndexTypeId> usr_to_type_id;
-  std::unordered_map<std::string, IndexFuncId> usr_to_func_id;
-  std::unordered_map<std::string, IndexVarId> usr_to_var_id;
+  // Keyed by the hash of the usr, see usr_hash.h. The usr itself is only kept
+  // by |*_id_to_usr|; use Find*Id() and Add*Id() to access these.
+  std::unordered_map<UsrHash, IndexTypeId> usr_to_type_id;
+  std::unordered_map<UsrHash, IndexFuncId> usr_to_func_id;
+  std::unordered_map<UsrHash, IndexVarId> usr_to_var_id;
   std::unordered_map<IndexTypeId, std::string> type_id_to_usr;
   std::unordered_map<IndexFuncId, std::string> func_id_to_usr;
   std::unordered_map<IndexVarId, std::string> var_id_to_usr;
 
   IdCache(const std::string& primary_file);
+
+  optional<IndexTypeId> FindTypeId(const std::string& usr) const;
+  optional<IndexFuncId> FindFuncId(const std::string& usr) const;
+  optional<IndexVarId> FindVarId(const std::string& usr) const;
+
+  // |usr| must not have an id yet.
+  void AddTypeId(const std::string& usr, IndexTypeId id);
+  void AddFuncId(const std::string& usr, IndexFuncId id);
+  void AddVarId(const std::string& usr, IndexVarId id);
 };
 
 struct IndexInclude {
@@ -463,6 +498,8 @@ struct IndexInclude {
   // Absolute path to the index.
   std::string resolved_path;
 };
+void Reflect(BinaryReader& visitor, IndexInclude& value);
+void Reflect(BinaryWriter& visitor, IndexInclude& value);
 
 // Used to identify the language at a file level. The ordering is important, as
 // a file previously identified as `C`, will be changed to `Cpp` if it
@@ -484,6 +521,10 @@ struct IndexFile {
   std::string path;
   std::vector<std::string> args;
   int64_t last_modification_time = 0;
+  // HashContent of the file contents at the time of index. Used to skip
+  // reparsing files whose timestamp changed but whose contents did not. 0 if
+  // unknown.
+  uint64_t content_hash = 0;
   LanguageId language = LanguageId::Unknown;
 
   // The path to the translation unit cc file which caused the creation of this
@@ -505,6 +546,9 @@ struct IndexFile {
   NonElidedVector<lsDiagnostic> diagnostics_;
   // File contents at the time of index. Not serialized.
   std::string file_contents_;
+  // Generation of the FileConsumer::SharedState::Mark() call which made this
+  // index responsible for the file, or 0. Not serialized.
+  int64_t file_consumer_generation_ = 0;
 
   IndexFile(const std::string& path);
 
@@ -532,6 +576,9 @@ struct FileContents {
 // |desired_index_file| is the (h or cc) file which has actually changed.
 // |dependencies| are the existing dependencies of |import_file| if this is a
 // reparse.
+// |is_cancelled| is polled while indexing. Once it returns true indexing is
+// aborted, ownership of every file claimed in |file_consumer_shared| is
+// released and nothing is returned.
 std::vector<std::unique_ptr<IndexFile>> Parse(
     Config* config,
     FileConsumer::SharedState* file_consumer_shared,
@@ -540,7 +587,8 @@ std::vector<std::unique_ptr<IndexFile>> Parse(
     const std::vector<FileContents>& file_contents,
     PerformanceImportFile* perf,
     ClangIndex* index,
-    bool dump_ast = false);
+    bool dump_ast = false,
+    const std::function<bool()>& is_cancelled = nullptr);
 std::vector<std::unique_ptr<IndexFile>> ParseWithTu(
     FileConsumer::SharedState* file_consumer_shared,
     PerformanceImportFile* perf,
@@ -548,6 +596,7 @@ std::vector<std::unique_ptr<IndexFile>> ParseWithTu(
     ClangIndex* index,
     const std::string& file,
     const std::vector<std::string>& args,
-    const std::vector<CXUnsavedFile>& file_contents);
+    const std::vector<CXUnsavedFile>& file_contents,
+    const std::function<bool()>& is_cancelled = nullptr);
 
 void IndexInit();
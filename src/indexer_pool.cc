@@ -0,0 +1,196 @@
+#include "indexer_pool.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+
+constexpr std::chrono::seconds IndexerPool::kUpdateInterval;
+constexpr double IndexerPool::kEvaluationSeconds;
+constexpr double IndexerPool::kMinGrowGain;
+constexpr double IndexerPool::kGrowCooldownSeconds;
+constexpr double IndexerPool::kShrinkIntervalSeconds;
+
+IndexerPool::IndexerPool(int min_count,
+                         int max_count,
+                         int num_cores,
+                         int memory_limit_mb)
+    : min_count_(std::max(1, std::min(min_count, max_count))),
+      max_count_(std::max(1, max_count)),
+      num_cores_(std::max(1, num_cores)),
+      memory_limit_mb_(memory_limit_mb),
+      active_count_(max_count_),
+      completed_(0) {}
+
+bool IndexerPool::Update(const Sample& sample) {
+  window_completed_ += sample.completed;
+  window_seconds_ += sample.elapsed_seconds;
+  seconds_since_shrink_ += sample.elapsed_seconds;
+  grow_cooldown_seconds_ =
+      std::max(0.0, grow_cooldown_seconds_ - sample.elapsed_seconds);
+  bool is_window_full = window_seconds_ >= kEvaluationSeconds;
+  double rate = window_seconds_ > 0 ? window_completed_ / window_seconds_ : 0;
+
+  bool is_over_memory_limit =
+      memory_limit_mb_ > 0 && sample.memory_used_mb > memory_limit_mb_;
+  // Something else is competing for the cores.
+  bool is_overloaded =
+      sample.load_average && *sample.load_average > num_cores_ + 1;
+
+  int current = active_count_;
+  int target = current;
+  if (is_over_memory_limit || sample.is_foreground_busy || is_overloaded) {
+    // Code completion is what the user is waiting on, so leave it the cores.
+    // Throughput measured meanwhile says nothing about the indexers, so it
+    // is not used to judge a change.
+    if (seconds_since_shrink_ >= kShrinkIntervalSeconds)
+      target = current - 1;
+    window_completed_ = 0;
+    window_seconds_ = 0;
+    rate_before_grow_ = -1;
+  } else if (rate_before_grow_ >= 0) {
+    if (is_window_full) {
+      if (rate < rate_before_grow_ * (1 + kMinGrowGain)) {
+        // The last indexer we added did not make indexing faster, ie,
+        // because indexing is bound by disk or memory bandwidth.
+        target = current - 1;
+        grow_cooldown_seconds_ = kGrowCooldownSeconds;
+      }
+      rate_before_grow_ = -1;
+    }
+  } else if (sample.has_pending_work && is_window_full &&
+             grow_cooldown_seconds_ == 0 &&
+             (!sample.load_average ||
+              *sample.load_average < num_cores_ - 1)) {
+    target = current + 1;
+  }
+
+  target = std::max(min_count_, std::min(max_count_, target));
+  if (target == current)
+    return false;
+  if (target > current) {
+    rate_before_grow_ = rate;
+  } else {
+    rate_before_grow_ = -1;
+    seconds_since_shrink_ = 0;
+  }
+  window_completed_ = 0;
+  window_seconds_ = 0;
+  active_count_ = target;
+  return true;
+}
+
+TEST_SUITE("IndexerPool") {
+  IndexerPool::Sample MakeSample(int completed, double seconds = 2) {
+    IndexerPool::Sample sample;
+    sample.elapsed_seconds = seconds;
+    sample.completed = completed;
+    sample.has_pending_work = true;
+    sample.load_average = 1.0;
+    sample.memory_used_mb = 100;
+    return sample;
+  }
+
+  IndexerPool::Sample MakeBusySample() {
+    IndexerPool::Sample sample = MakeSample(0, 10);
+    sample.is_foreground_busy = true;
+    return sample;
+  }
+
+  TEST_CASE("starts with every indexer active") {
+    IndexerPool pool(1, 4, 8, 0);
+    REQUIRE(pool.active_count() == 4);
+    REQUIRE(pool.IsActive(3));
+    REQUIRE(!pool.IsActive(4));
+  }
+
+  TEST_CASE("is fixed if the minimum is the maximum") {
+    IndexerPool pool(4, 4, 8, 1000);
+    IndexerPool::Sample sample = MakeBusySample();
+    sample.memory_used_mb = 2000;
+    REQUIRE(!pool.Update(sample));
+    REQUIRE(!pool.Update(MakeSample(100, 60)));
+    REQUIRE(pool.active_count() == 4);
+  }
+
+  TEST_CASE("backs off one indexer at a time") {
+    IndexerPool pool(1, 8, 8, 0);
+    IndexerPool::Sample busy = MakeBusySample();
+    REQUIRE(pool.Update(busy));
+    REQUIRE(pool.active_count() == 7);
+    // Not again until the previous step had time to take effect.
+    busy.elapsed_seconds = 2;
+    REQUIRE(!pool.Update(busy));
+    busy.elapsed_seconds = 8;
+    REQUIRE(pool.Update(busy));
+    REQUIRE(pool.active_count() == 6);
+
+    busy.elapsed_seconds = 10;
+    for (int i = 0; i < 10; ++i)
+      pool.Update(busy);
+    // Never below the minimum.
+    REQUIRE(pool.active_count() == 1);
+    REQUIRE(!pool.Update(busy));
+  }
+
+  TEST_CASE("shrinks when memory or load is too high") {
+    IndexerPool pool(2, 4, 4, 1000);
+    IndexerPool::Sample sample = MakeSample(10, 10);
+    sample.memory_used_mb = 2000;
+    REQUIRE(pool.Update(sample));
+    REQUIRE(pool.active_count() == 3);
+
+    sample = MakeSample(10, 10);
+    sample.load_average = 6.0;
+    REQUIRE(pool.Update(sample));
+    REQUIRE(pool.active_count() == 2);
+    REQUIRE(!pool.Update(sample));
+  }
+
+  TEST_CASE("grows while it helps") {
+    IndexerPool pool(1, 4, 8, 0);
+    for (int i = 0; i < 3; ++i)
+      pool.Update(MakeBusySample());
+    REQUIRE(pool.active_count() == 1);
+
+    // A single fast sample is not enough to grow.
+    REQUIRE(!pool.Update(MakeSample(10)));
+    for (int i = 0; i < 13; ++i)
+      REQUIRE(!pool.Update(MakeSample(1)));
+    REQUIRE(pool.Update(MakeSample(1)));
+    REQUIRE(pool.active_count() == 2);
+
+    // The second indexer doubles throughput, so it is kept and a third one is
+    // tried right away.
+    for (int i = 0; i < 15; ++i)
+      REQUIRE(!pool.Update(MakeSample(2)));
+    REQUIRE(pool.active_count() == 2);
+    REQUIRE(pool.Update(MakeSample(2)));
+    REQUIRE(pool.active_count() == 3);
+
+    // Throughput stays about flat, so the third indexer is removed again and
+    // the pool does not try to grow for a while.
+    for (int i = 0; i < 14; ++i)
+      REQUIRE(!pool.Update(MakeSample(2)));
+    REQUIRE(pool.Update(MakeSample(2)));
+    REQUIRE(pool.active_count() == 2);
+    for (int i = 0; i < 20; ++i)
+      REQUIRE(!pool.Update(MakeSample(2)));
+    REQUIRE(pool.active_count() == 2);
+  }
+
+  TEST_CASE("does not grow without work or idle cores") {
+    IndexerPool pool(1, 4, 4, 0);
+    pool.Update(MakeBusySample());
+    pool.Update(MakeBusySample());
+    REQUIRE(pool.active_count() == 2);
+
+    IndexerPool::Sample idle = MakeSample(0, 60);
+    idle.has_pending_work = false;
+    REQUIRE(!pool.Update(idle));
+
+    IndexerPool::Sample loaded = MakeSample(10, 60);
+    loaded.load_average = 3.5;
+    REQUIRE(!pool.Update(loaded));
+    REQUIRE(pool.active_count() == 2);
+  }
+}
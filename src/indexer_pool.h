@@ -0,0 +1,87 @@
+#pragma once
+
+#include <optional.h>
+
+#include <atomic>
+#include <chrono>
+
+using std::experimental::nullopt;
+using std::experimental::optional;
+
+// Decides how many of the indexer threads take new work. Every indexer thread
+// is started up front; the ones above the active count park until they are
+// needed again. The active count is adjusted periodically so that indexing
+// backs off when the machine is busy with other work, when memory use is too
+// high, or while code completion and diagnostics are running, and grows again
+// while that makes indexing faster. Indexers are removed one at a time, and
+// an added indexer is judged over a window much longer than a parse.
+//
+// Indexers are deactivated from the highest index down.
+struct IndexerPool {
+  // How often Update() should be called.
+  static constexpr std::chrono::seconds kUpdateInterval{2};
+
+  struct Sample {
+    // Seconds since the previous sample.
+    double elapsed_seconds = 0;
+    // Index requests finished since the previous sample.
+    int completed = 0;
+    // True if there are index requests waiting for an indexer.
+    bool has_pending_work = false;
+    // See GetSystemLoadAverage().
+    optional<double> load_average;
+    float memory_used_mb = 0;
+    // True if code completion or diagnostics are being computed.
+    bool is_foreground_busy = false;
+  };
+
+  // Between |min_count| and |max_count| indexers are active; all of them are
+  // active initially. |memory_limit_mb| is ignored if it is not positive.
+  IndexerPool(int min_count, int max_count, int num_cores, int memory_limit_mb);
+
+  // Returns true if |indexer| should take new work.
+  bool IsActive(int indexer) const { return indexer < active_count_; }
+  int active_count() const { return active_count_; }
+
+  // Call whenever an indexer finishes an index request.
+  void OnRequestDone() { ++completed_; }
+  // Returns the number of requests finished since the last call.
+  int TakeCompletedCount() { return completed_.exchange(0); }
+
+  // Adjusts the number of active indexers. Returns true if it changed. Must
+  // only be called from one thread.
+  bool Update(const Sample& sample);
+
+ private:
+  // A change is only judged, and the next one only made, once the rate has
+  // been measured over this long. It is much longer than a single parse, so
+  // that the requests which were in flight when the count changed do not
+  // decide the outcome.
+  static constexpr double kEvaluationSeconds = 30;
+  // An added indexer is kept only if it made indexing at least this much
+  // faster.
+  static constexpr double kMinGrowGain = 0.1;
+  // After an added indexer was removed again, wait this long before trying
+  // again.
+  static constexpr double kGrowCooldownSeconds = 60;
+  // Indexers are removed one at a time, at most this often, so that slow
+  // signals such as the load average can catch up with the previous step.
+  static constexpr double kShrinkIntervalSeconds = 10;
+
+  int min_count_;
+  int max_count_;
+  int num_cores_;
+  int memory_limit_mb_;
+
+  std::atomic<int> active_count_;
+  std::atomic<int> completed_;
+
+  // Requests finished and time elapsed since the active count last changed.
+  int window_completed_ = 0;
+  double window_seconds_ = 0;
+  // Rate over the window before the last indexer was added, or a negative
+  // value if that indexer has been judged already.
+  double rate_before_grow_ = -1;
+  double grow_cooldown_seconds_ = 0;
+  double seconds_since_shrink_ = kShrinkIntervalSeconds;
+};
@@ -56,6 +56,10 @@ const char* IpcIdToString(IpcId id) {
 
     case IpcId::CqueryFreshenIndex:
       return "$cquery/freshenIndex";
+    case IpcId::CquerySaveSnapshot:
+      return "$cquery/saveSnapshot";
+    case IpcId::CqueryCollectCache:
+      return "$cquery/collectCache";
     case IpcId::CqueryTypeHierarchyTree:
       return "$cquery/typeHierarchyTree";
     case IpcId::CqueryCallTreeInitial:
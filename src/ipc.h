@@ -3,6 +3,8 @@
 #include "serializer.h"
 #include "utils.h"
 
+#include <atomic>
+#include <memory>
 #include <string>
 
 enum class IpcId : int {
@@ -36,6 +38,8 @@ enum class IpcId : int {
 
   // Custom messages
   CqueryFreshenIndex,
+  CquerySaveSnapshot,
+  CqueryCollectCache,
   // Messages used in tree views.
   CqueryTypeHierarchyTree,
   CqueryCallTreeInitial,
@@ -60,11 +64,26 @@ MAKE_ENUM_HASHABLE(IpcId)
 MAKE_REFLECT_TYPE_PROXY(IpcId, int)
 const char* IpcIdToString(IpcId id);
 
+struct lsRequestId {
+  optional<int> id0;
+  optional<std::string> id1;
+};
+
 struct BaseIpcMessage {
   const IpcId method_id;
   BaseIpcMessage(IpcId method_id);
   virtual ~BaseIpcMessage();
 
+  // Id of a request from the client. Not set for notifications and internal
+  // messages.
+  optional<lsRequestId> request_id;
+  // Set by RequestCancellation::Track(); becomes true once the client has
+  // cancelled the request.
+  std::shared_ptr<std::atomic<bool>> cancelled;
+
+  // Long-running handlers should check this periodically and stop early.
+  bool IsCancelled() const { return cancelled && *cancelled; }
+
   template <typename T>
   T* As() {
     assert(method_id == T::kIpcId);
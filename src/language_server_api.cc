@@ -175,7 +175,13 @@ std::unique_ptr<BaseIpcMessage> MessageRegistry::Parse(Reader& visitor) {
   }
 
   Allocator& allocator = allocators[method];
-  return allocator(visitor);
+  std::unique_ptr<BaseIpcMessage> message = allocator(visitor);
+  if (visitor.HasMember("id")) {
+    lsRequestId id;
+    Reflect(visitor["id"], id);
+    message->request_id = id;
+  }
+  return message;
 }
 
 MessageRegistry* MessageRegistry::instance() {
@@ -25,10 +25,6 @@ using std::experimental::optional;
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
 
-struct lsRequestId {
-  optional<int> id0;
-  optional<std::string> id1;
-};
 void Reflect(Writer& visitor, lsRequestId& value);
 void Reflect(Reader& visitor, lsRequestId& id);
 
@@ -964,10 +960,16 @@ MAKE_REFLECT_STRUCT(Out_Error, jsonrpc, id, error);
 
 // Cancel an existing request.
 struct Ipc_CancelRequest : public IpcMessage<Ipc_CancelRequest> {
+  struct Params {
+    // Id of the request to cancel.
+    lsRequestId id;
+  };
+
   static const IpcId kIpcId = IpcId::CancelRequest;
-  lsRequestId id;
+  Params params;
 };
-MAKE_REFLECT_STRUCT(Ipc_CancelRequest, id);
+MAKE_REFLECT_STRUCT(Ipc_CancelRequest::Params, id);
+MAKE_REFLECT_STRUCT(Ipc_CancelRequest, params);
 
 // Open, update, close file
 struct Ipc_TextDocumentDidOpen : public IpcMessage<Ipc_TextDocumentDidOpen> {
@@ -1473,8 +1475,6 @@ struct Out_Progress : public lsOutMessage<Out_Progress> {
   struct Params {
     int indexRequestCount = 0;
     int doIdMapCount = 0;
-    int loadPreviousIndexCount = 0;
-    int onIdMappedCount = 0;
     int onIndexedCount = 0;
   };
   std::string method = "$cquery/progress";
@@ -1483,8 +1483,6 @@ struct Out_Progress : public lsOutMessage<Out_Progress> {
 MAKE_REFLECT_STRUCT(Out_Progress::Params,
                     indexRequestCount,
                     doIdMapCount,
-                    loadPreviousIndexCount,
-                    onIdMappedCount,
                     onIndexedCount);
 MAKE_REFLECT_STRUCT(Out_Progress, jsonrpc, method, params);
 
@@ -1534,6 +1532,22 @@ struct Ipc_CqueryFreshenIndex : public IpcMessage<Ipc_CqueryFreshenIndex> {
 };
 MAKE_REFLECT_STRUCT(Ipc_CqueryFreshenIndex, id);
 
+// Writes the query database to the cache so the next session can skip
+// importing cached indexes.
+struct Ipc_CquerySaveSnapshot : public IpcMessage<Ipc_CquerySaveSnapshot> {
+  const static IpcId kIpcId = IpcId::CquerySaveSnapshot;
+  lsRequestId id;
+};
+MAKE_REFLECT_STRUCT(Ipc_CquerySaveSnapshot, id);
+
+// Removes cache entries which the project no longer needs and enforces the
+// cache size limit.
+struct Ipc_CqueryCollectCache : public IpcMessage<Ipc_CqueryCollectCache> {
+  const static IpcId kIpcId = IpcId::CqueryCollectCache;
+  lsRequestId id;
+};
+MAKE_REFLECT_STRUCT(Ipc_CqueryCollectCache, id);
+
 // Type Hierarchy Tree
 struct Ipc_CqueryTypeHierarchyTree
     : public IpcMessage<Ipc_CqueryTypeHierarchyTree> {
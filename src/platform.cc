@@ -50,6 +50,8 @@ PlatformScopedMutexLock::~PlatformScopedMutexLock() = default;
 
 PlatformSharedMemory::~PlatformSharedMemory() = default;
 
+PlatformMappedFile::~PlatformMappedFile() = default;
+
 void MakeDirectoryRecursive(std::string path) {
   path = NormalizePath(path);
 
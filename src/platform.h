@@ -21,6 +21,13 @@ struct PlatformSharedMemory {
   size_t capacity;
   std::string name;
 };
+// A read-only view of a file's contents. On platforms that support it the file
+// is mapped into memory instead of being read into a buffer.
+struct PlatformMappedFile {
+  virtual ~PlatformMappedFile();
+  const char* data = nullptr;
+  size_t size = 0;
+};
 
 std::unique_ptr<PlatformMutex> CreatePlatformMutex(const std::string& name);
 std::unique_ptr<PlatformScopedMutexLock> CreatePlatformScopedMutexLock(
@@ -28,10 +35,15 @@ std::unique_ptr<PlatformScopedMutexLock> CreatePlatformScopedMutexLock(
 std::unique_ptr<PlatformSharedMemory> CreatePlatformSharedMemory(
     const std::string& name,
     size_t size);
+// Returns nullptr if |path| cannot be opened or mapped.
+std::unique_ptr<PlatformMappedFile> CreatePlatformMappedFile(
+    const std::string& path);
 
 void PlatformInit();
 
 std::string GetWorkingDirectory();
+// Returns the directory for temporary files, ending in a slash.
+std::string GetTemporaryDirectory();
 std::string NormalizePath(const std::string& path);
 // Creates a directory at |path|. Creates directories recursively if needed.
 void MakeDirectoryRecursive(std::string path);
@@ -41,10 +53,17 @@ void MakeDirectoryRecursive(std::string path);
 bool TryMakeDirectory(const std::string& absolute_path);
 
 void SetCurrentThreadName(const std::string& thread_name);
+// Lowers the CPU and I/O scheduling priority of the calling thread. The
+// thread still gets a share of the machine when it is busy, so it does not
+// hold on to shared locks indefinitely. Best effort; failures are logged and
+// otherwise ignored.
+void SetCurrentThreadBackgroundPriority();
 
 optional<int64_t> GetLastModificationTime(const std::string& absolute_path);
 
-void MoveFileTo(const std::string& destination, const std::string& source);
+// Moves |source| to |destination|, replacing |destination| if it exists.
+// Within a directory the move is atomic. Returns false on failure.
+bool MoveFileTo(const std::string& destination, const std::string& source);
 void CopyFileTo(const std::string& destination, const std::string& source);
 
 bool IsSymLink(const std::string& path);
@@ -54,3 +73,7 @@ std::vector<std::string> GetPlatformClangArguments();
 
 // Free any unused memory and return it to the system.
 void FreeUnusedMemory();
+
+// Returns the average number of runnable threads on the system over the last
+// minute, or nullopt if the platform does not provide it.
+optional<double> GetSystemLoadAverage();
@@ -32,8 +32,11 @@
 #include <semaphore.h>
 #include <sys/mman.h>
 
+#include <sys/resource.h>
+
 #ifndef __APPLE__
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 #endif
 
 #if defined(__linux__)
@@ -190,6 +193,15 @@ struct PlatformSharedMemoryLinux : public PlatformSharedMemory {
   }
 };
 
+struct PlatformMappedFileLinux : public PlatformMappedFile {
+  void* mapping_ = nullptr;
+
+  ~PlatformMappedFileLinux() override {
+    if (mapping_)
+      munmap(mapping_, size);
+  }
+};
+
 std::unique_ptr<PlatformMutex> CreatePlatformMutex(const std::string& name) {
   std::string name2 = "/" + name;
   return MakeUnique<PlatformMutexLinux>(name2);
@@ -208,6 +220,36 @@ std::unique_ptr<PlatformSharedMemory> CreatePlatformSharedMemory(
   return MakeUnique<PlatformSharedMemoryLinux>(name2, size);
 }
 
+std::unique_ptr<PlatformMappedFile> CreatePlatformMappedFile(
+    const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat buf;
+  if (fstat(fd, &buf) != 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  auto result = MakeUnique<PlatformMappedFileLinux>();
+  result->size = (size_t)buf.st_size;
+  // mmap does not support empty mappings.
+  if (result->size > 0) {
+    void* mapping =
+        mmap(nullptr, result->size, PROT_READ, MAP_PRIVATE, fd, 0 /*offset*/);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return nullptr;
+    }
+    result->mapping_ = mapping;
+    result->data = static_cast<const char*>(mapping);
+  }
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  return std::move(result);
+}
+
 void PlatformInit() {}
 
 std::string GetWorkingDirectory() {
@@ -219,6 +261,13 @@ std::string GetWorkingDirectory() {
   return working_dir;
 }
 
+std::string GetTemporaryDirectory() {
+  const char* tmpdir = getenv("TMPDIR");
+  std::string result = tmpdir && *tmpdir ? tmpdir : "/tmp";
+  EnsureEndsInSlash(result);
+  return result;
+}
+
 std::string NormalizePath(const std::string& path) {
   optional<std::string> resolved = RealPathNotExpandSymlink(path);
   return resolved ? *resolved : path;
@@ -240,6 +289,34 @@ void SetCurrentThreadName(const std::string& thread_name) {
 #endif
 }
 
+void SetCurrentThreadBackgroundPriority() {
+#if defined(__APPLE__)
+  // Utility QoS lowers both CPU and I/O priority, but unlike background QoS
+  // it is not throttled indefinitely while the machine is busy.
+  if (pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0) != 0)
+    LOG_S(WARNING) << "Unable to lower thread priority";
+#else
+  // On Linux nice values and I/O priorities are per-thread, so these only
+  // affect the calling thread. SCHED_IDLE and the idle I/O class are not used
+  // on purpose: background threads take locks which querydb and the request
+  // handlers also take, and a thread in those classes can be starved for
+  // seconds while it holds one.
+  pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+  if (setpriority(PRIO_PROCESS, tid, 19) != 0)
+    LOG_S(WARNING) << "Unable to set nice value: " << strerror(errno);
+
+  // glibc has no wrapper for ioprio_set; see linux/ioprio.h.
+  const int kIoprioWhoProcess = 1;
+  const int kIoprioClassBestEffort = 2;
+  const int kIoprioClassShift = 13;
+  const int kIoprioLowestLevel = 7;
+  if (syscall(SYS_ioprio_set, kIoprioWhoProcess, tid,
+              (kIoprioClassBestEffort << kIoprioClassShift) |
+                  kIoprioLowestLevel) != 0)
+    LOG_S(WARNING) << "Unable to set I/O priority: " << strerror(errno);
+#endif
+}
+
 optional<int64_t> GetLastModificationTime(const std::string& absolute_path) {
   struct stat buf;
   if (stat(absolute_path.c_str(), &buf) != 0) {
@@ -262,9 +339,15 @@ optional<int64_t> GetLastModificationTime(const std::string& absolute_path) {
   return buf.st_mtime;
 }
 
-void MoveFileTo(const std::string& dest, const std::string& source) {
-  // TODO/FIXME - do a real move.
+bool MoveFileTo(const std::string& dest, const std::string& source) {
+  if (rename(source.c_str(), dest.c_str()) == 0)
+    return true;
+  if (errno != EXDEV)
+    return false;
+
+  // rename() does not work across filesystems.
   CopyFileTo(dest, source);
+  return unlink(source.c_str()) == 0;
 }
 
 // See http://stackoverflow.com/q/13198627
@@ -273,7 +356,7 @@ void CopyFileTo(const std::string& dest, const std::string& source) {
   if (fd_from < 0)
     return;
 
-  int fd_to = open(dest.c_str(), O_WRONLY | O_CREAT, 0666);
+  int fd_to = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
   if (fd_to < 0)
     goto out_error;
 
@@ -328,4 +411,11 @@ void FreeUnusedMemory() {
 #endif
 }
 
+optional<double> GetSystemLoadAverage() {
+  double load = 0;
+  if (getloadavg(&load, 1) != 1)
+    return nullopt;
+  return load;
+}
+
 #endif
@@ -101,6 +101,20 @@ struct PlatformSharedMemoryWin : public PlatformSharedMemory {
   }
 };
 
+struct PlatformMappedFileWin : public PlatformMappedFile {
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = NULL;
+
+  ~PlatformMappedFileWin() override {
+    if (data)
+      UnmapViewOfFile(data);
+    if (mapping_)
+      CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle(file_);
+  }
+};
+
 }  // namespace
 
 std::unique_ptr<PlatformMutex> CreatePlatformMutex(const std::string& name) {
@@ -119,6 +133,35 @@ std::unique_ptr<PlatformSharedMemory> CreatePlatformSharedMemory(
   return MakeUnique<PlatformSharedMemoryWin>(name, size);
 }
 
+std::unique_ptr<PlatformMappedFile> CreatePlatformMappedFile(
+    const std::string& path) {
+  auto result = MakeUnique<PlatformMappedFileWin>();
+  result->file_ =
+      CreateFileA(path.c_str(), GENERIC_READ,
+                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                  NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (result->file_ == INVALID_HANDLE_VALUE)
+    return nullptr;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(result->file_, &size))
+    return nullptr;
+  result->size = (size_t)size.QuadPart;
+  // Empty files cannot be mapped.
+  if (result->size == 0)
+    return std::move(result);
+
+  result->mapping_ =
+      CreateFileMapping(result->file_, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!result->mapping_)
+    return nullptr;
+  result->data = static_cast<const char*>(
+      MapViewOfFile(result->mapping_, FILE_MAP_READ, 0, 0, 0));
+  if (!result->data)
+    return nullptr;
+  return std::move(result);
+}
+
 void PlatformInit() {
   // We need to write to stdout in binary mode because in Windows, writing
   // \n will implicitly write \r\n. Language server API will ignore a
@@ -134,6 +177,17 @@ std::string GetWorkingDirectory() {
   return binary_path.substr(0, binary_path.find_last_of("\\/") + 1);
 }
 
+std::string GetTemporaryDirectory() {
+  char result[MAX_PATH + 1];
+  DWORD length = GetTempPath(sizeof(result), result);
+  if (length == 0 || length > sizeof(result))
+    return GetWorkingDirectory();
+  std::string temp_dir(result, length);
+  std::replace(temp_dir.begin(), temp_dir.end(), '\\', '/');
+  EnsureEndsInSlash(temp_dir);
+  return temp_dir;
+}
+
 std::string NormalizePath(const std::string& path) {
   DWORD retval = 0;
   TCHAR buffer[MAX_PATH] = TEXT("");
@@ -185,6 +239,14 @@ void SetCurrentThreadName(const std::string& thread_name) {
   }
 }
 
+void SetCurrentThreadBackgroundPriority() {
+  // Background mode (THREAD_MODE_BACKGROUND_BEGIN) is not used since it also
+  // drops I/O to very low priority, which can starve a thread while it holds a
+  // lock that querydb is waiting on.
+  if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST))
+    LOG_S(WARNING) << "Unable to lower thread priority";
+}
+
 optional<int64_t> GetLastModificationTime(const std::string& absolute_path) {
   struct _stat buf;
   if (_stat(absolute_path.c_str(), &buf) != 0) {
@@ -207,8 +269,9 @@ optional<int64_t> GetLastModificationTime(const std::string& absolute_path) {
   return buf.st_mtime;
 }
 
-void MoveFileTo(const std::string& destination, const std::string& source) {
-  MoveFile(source.c_str(), destination.c_str());
+bool MoveFileTo(const std::string& destination, const std::string& source) {
+  return MoveFileEx(source.c_str(), destination.c_str(),
+                    MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED) != 0;
 }
 
 void CopyFileTo(const std::string& destination, const std::string& source) {
@@ -225,4 +288,8 @@ std::vector<std::string> GetPlatformClangArguments() {
 
 void FreeUnusedMemory() {}
 
+optional<double> GetSystemLoadAverage() {
+  return nullopt;
+}
+
 #endif
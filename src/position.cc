@@ -166,4 +166,22 @@ void Reflect(Reader& visitor, Range& value) {
 void Reflect(Writer& visitor, Range& value) {
   std::string output = value.ToString();
   visitor.String(output.c_str(), (rapidjson::SizeType)output.size());
+}
+
+// Binary
+void Reflect(BinaryReader& visitor, Position& value) {
+  Reflect(visitor, value.line);
+  Reflect(visitor, value.column);
+}
+void Reflect(BinaryWriter& visitor, Position& value) {
+  Reflect(visitor, value.line);
+  Reflect(visitor, value.column);
+}
+void Reflect(BinaryReader& visitor, Range& value) {
+  Reflect(visitor, value.start);
+  Reflect(visitor, value.end);
+}
+void Reflect(BinaryWriter& visitor, Range& value) {
+  Reflect(visitor, value.start);
+  Reflect(visitor, value.end);
 }
\ No newline at end of file
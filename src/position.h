@@ -53,3 +53,7 @@ void Reflect(Reader& visitor, Position& value);
 void Reflect(Writer& visitor, Position& value);
 void Reflect(Reader& visitor, Range& value);
 void Reflect(Writer& visitor, Range& value);
+void Reflect(BinaryReader& visitor, Position& value);
+void Reflect(BinaryWriter& visitor, Position& value);
+void Reflect(BinaryReader& visitor, Range& value);
+void Reflect(BinaryWriter& visitor, Range& value);
@@ -6,11 +6,13 @@
 #include <optional.h>
 #include <loguru.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <functional>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -18,12 +20,15 @@
 
 namespace {
 
-optional<QueryType::DefUpdate> ToQuery(const IdMap& id_map,
-                                       const IndexType::Def& type) {
+optional<WithId<QueryTypeId, QueryType::DefUpdate>> ToQuery(
+    const IdMap& id_map,
+    const IndexType& indexed) {
+  const IndexType::Def& type = indexed.def;
   if (type.detailed_name.empty())
     return nullopt;
 
-  QueryType::DefUpdate result(type.usr);
+  // The usr is left empty; the update is keyed by the interned id.
+  QueryType::DefUpdate result;
   result.short_name = type.short_name;
   result.detailed_name = type.detailed_name;
   result.definition_spelling = id_map.ToQuery(type.definition_spelling);
@@ -33,15 +38,18 @@ optional<QueryType::DefUpdate> ToQuery(const IdMap& id_map,
   result.types = id_map.ToQuery(type.types);
   result.funcs = id_map.ToQuery(type.funcs);
   result.vars = id_map.ToQuery(type.vars);
-  return result;
+  return WithId<QueryTypeId, QueryType::DefUpdate>(id_map.ToQuery(indexed.id),
+                                                   result);
 }
 
-optional<QueryFunc::DefUpdate> ToQuery(const IdMap& id_map,
-                                       const IndexFunc::Def& func) {
+optional<WithId<QueryFuncId, QueryFunc::DefUpdate>> ToQuery(
+    const IdMap& id_map,
+    const IndexFunc& indexed) {
+  const IndexFunc::Def& func = indexed.def;
   if (func.detailed_name.empty())
     return nullopt;
 
-  QueryFunc::DefUpdate result(func.usr);
+  QueryFunc::DefUpdate result;
   result.short_name = func.short_name;
   result.detailed_name = func.detailed_name;
   result.definition_spelling = id_map.ToQuery(func.definition_spelling);
@@ -50,15 +58,18 @@ optional<QueryFunc::DefUpdate> ToQuery(const IdMap& id_map,
   result.base = id_map.ToQuery(func.base);
   result.locals = id_map.ToQuery(func.locals);
   result.callees = id_map.ToQuery(func.callees);
-  return result;
+  return WithId<QueryFuncId, QueryFunc::DefUpdate>(id_map.ToQuery(indexed.id),
+                                                   result);
 }
 
-optional<QueryVar::DefUpdate> ToQuery(const IdMap& id_map,
-                                      const IndexVar::Def& var) {
+optional<WithId<QueryVarId, QueryVar::DefUpdate>> ToQuery(
+    const IdMap& id_map,
+    const IndexVar& indexed) {
+  const IndexVar::Def& var = indexed.def;
   if (var.detailed_name.empty())
     return nullopt;
 
-  QueryVar::DefUpdate result(var.usr);
+  QueryVar::DefUpdate result;
   result.short_name = var.short_name;
   result.detailed_name = var.detailed_name;
   result.declaration = id_map.ToQuery(var.declaration);
@@ -68,7 +79,8 @@ optional<QueryVar::DefUpdate> ToQuery(const IdMap& id_map,
   result.declaring_type = id_map.ToQuery(var.declaring_type);
   result.is_local = var.is_local;
   result.is_macro = var.is_macro;
-  return result;
+  return WithId<QueryVarId, QueryVar::DefUpdate>(id_map.ToQuery(indexed.id),
+                                                 result);
 }
 
 // Adds the mergeable updates in |source| to |dest|. If a mergeable update for
@@ -173,6 +185,8 @@ QueryFile::Def BuildFileDef(const IdMap& id_map, const IndexFile& indexed) {
   def.path = indexed.path;
   def.includes = indexed.includes;
   def.inactive_regions = indexed.skipped_by_preprocessor;
+  def.last_modification_time = indexed.last_modification_time;
+  def.content_hash = indexed.content_hash;
 
   // Convert enum to markdown compatible strings
   def.language = [indexed] () {
@@ -245,69 +259,24 @@ QueryFile::Def BuildFileDef(const IdMap& id_map, const IndexFile& indexed) {
 
 }  // namespace
 
-QueryFileId GetQueryFileIdFromPath(QueryDatabase* query_db,
-                                   const std::string& path) {
-  auto it = query_db->usr_to_file.find(LowerPathIfCaseInsensitive(path));
-  if (it != query_db->usr_to_file.end())
-    return QueryFileId(it->second.id);
-
-  size_t idx = query_db->files.size();
-  query_db->usr_to_file[LowerPathIfCaseInsensitive(path)] = QueryFileId(idx);
-  query_db->files.push_back(QueryFile(path));
-  return QueryFileId(idx);
-}
-
-QueryTypeId GetQueryTypeIdFromUsr(QueryDatabase* query_db, const Usr& usr) {
-  auto it = query_db->usr_to_type.find(usr);
-  if (it != query_db->usr_to_type.end())
-    return QueryTypeId(it->second.id);
-
-  size_t idx = query_db->types.size();
-  query_db->usr_to_type[usr] = QueryTypeId(idx);
-  query_db->types.push_back(QueryType(usr));
-  return QueryTypeId(idx);
-}
-
-QueryFuncId GetQueryFuncIdFromUsr(QueryDatabase* query_db, const Usr& usr) {
-  auto it = query_db->usr_to_func.find(usr);
-  if (it != query_db->usr_to_func.end())
-    return QueryFuncId(it->second.id);
-
-  size_t idx = query_db->funcs.size();
-  query_db->usr_to_func[usr] = QueryFuncId(idx);
-  query_db->funcs.push_back(QueryFunc(usr));
-  return QueryFuncId(idx);
-}
-
-QueryVarId GetQueryVarIdFromUsr(QueryDatabase* query_db, const Usr& usr) {
-  auto it = query_db->usr_to_var.find(usr);
-  if (it != query_db->usr_to_var.end())
-    return QueryVarId(it->second.id);
-
-  size_t idx = query_db->vars.size();
-  query_db->usr_to_var[usr] = QueryVarId(idx);
-  query_db->vars.push_back(QueryVar(usr));
-  return QueryVarId(idx);
-}
-
 IdMap::IdMap(QueryDatabase* query_db, const IdCache& local_ids)
     : local_ids(local_ids) {
   // LOG_S(INFO) << "Creating IdMap for " << local_ids.primary_file;
-  primary_file = GetQueryFileIdFromPath(query_db, local_ids.primary_file);
+  primary_file = query_db->usr_to_file.Intern(
+      LowerPathIfCaseInsensitive(local_ids.primary_file),
+      local_ids.primary_file);
 
   cached_type_ids_.resize(local_ids.type_id_to_usr.size());
   for (const auto& entry : local_ids.type_id_to_usr)
-    cached_type_ids_[entry.first] =
-        GetQueryTypeIdFromUsr(query_db, entry.second);
+    cached_type_ids_[entry.first] = query_db->usr_to_type.Intern(entry.second);
 
   cached_func_ids_.resize(local_ids.func_id_to_usr.size());
   for (const auto& entry : local_ids.func_id_to_usr)
-    cached_func_ids_[entry.first] =
-        GetQueryFuncIdFromUsr(query_db, entry.second);
+    cached_func_ids_[entry.first] = query_db->usr_to_func.Intern(entry.second);
 
   cached_var_ids_.resize(local_ids.var_id_to_usr.size());
   for (const auto& entry : local_ids.var_id_to_usr)
-    cached_var_ids_[entry.first] = GetQueryVarIdFromUsr(query_db, entry.second);
+    cached_var_ids_[entry.first] = query_db->usr_to_var.Intern(entry.second);
 }
 
 QueryLocation IdMap::ToQuery(Range range) const {
@@ -318,8 +287,8 @@ QueryTypeId IdMap::ToQuery(IndexTypeId id) const {
   return QueryTypeId(cached_type_ids_.find(id)->second);
 }
 QueryFuncId IdMap::ToQuery(IndexFuncId id) const {
-  if (id.id == -1)
-    return QueryFuncId((size_t)-1);
+  if (id.id == static_cast<RawId>(-1))
+    return QueryFuncId((RawId)-1);
   assert(cached_func_ids_.find(id) != cached_func_ids_.end());
   return QueryFuncId(cached_func_ids_.find(id)->second);
 }
@@ -461,7 +430,7 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       /*onRemoved:*/
       [this, &previous_id_map](IndexType* type) {
         if (type->def.definition_spelling)
-          types_removed.push_back(type->def.usr);
+          types_removed.push_back(previous_id_map.ToQuery(type->id));
         else {
           if (!type->derived.empty())
             types_derived.push_back(QueryType::DerivedUpdate(
@@ -479,8 +448,8 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       },
       /*onAdded:*/
       [this, &current_id_map](IndexType* type) {
-        optional<QueryType::DefUpdate> def_update =
-            ToQuery(current_id_map, type->def);
+        optional<WithId<QueryTypeId, QueryType::DefUpdate>> def_update =
+            ToQuery(current_id_map, *type);
         if (def_update)
           types_def_update.push_back(*def_update);
         if (!type->derived.empty())
@@ -499,13 +468,13 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       /*onFound:*/
       [this, &previous_id_map, &current_id_map](IndexType* previous_def,
                                                 IndexType* current_def) {
-        optional<QueryType::DefUpdate> previous_remapped_def =
-            ToQuery(previous_id_map, previous_def->def);
-        optional<QueryType::DefUpdate> current_remapped_def =
-            ToQuery(current_id_map, current_def->def);
+        optional<WithId<QueryTypeId, QueryType::DefUpdate>>
+            previous_remapped_def = ToQuery(previous_id_map, *previous_def);
+        optional<WithId<QueryTypeId, QueryType::DefUpdate>>
+            current_remapped_def = ToQuery(current_id_map, *current_def);
         if (current_remapped_def &&
             previous_remapped_def != current_remapped_def &&
-            !current_remapped_def->detailed_name.empty())
+            !current_remapped_def->value.detailed_name.empty())
           types_def_update.push_back(*current_remapped_def);
 
         PROCESS_UPDATE_DIFF(QueryTypeId, types_derived, derived, QueryTypeId);
@@ -520,7 +489,7 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       /*onRemoved:*/
       [this, &previous_id_map](IndexFunc* func) {
         if (func->def.definition_spelling) {
-          funcs_removed.push_back(func->def.usr);
+          funcs_removed.push_back(previous_id_map.ToQuery(func->id));
         } else {
           if (!func->declarations.empty())
             funcs_declarations.push_back(QueryFunc::DeclarationsUpdate(
@@ -538,8 +507,8 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       },
       /*onAdded:*/
       [this, &current_id_map](IndexFunc* func) {
-        optional<QueryFunc::DefUpdate> def_update =
-            ToQuery(current_id_map, func->def);
+        optional<WithId<QueryFuncId, QueryFunc::DefUpdate>> def_update =
+            ToQuery(current_id_map, *func);
         if (def_update)
           funcs_def_update.push_back(*def_update);
         if (!func->declarations.empty())
@@ -558,13 +527,13 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       /*onFound:*/
       [this, &previous_id_map, &current_id_map](IndexFunc* previous_def,
                                                 IndexFunc* current_def) {
-        optional<QueryFunc::DefUpdate> previous_remapped_def =
-            ToQuery(previous_id_map, previous_def->def);
-        optional<QueryFunc::DefUpdate> current_remapped_def =
-            ToQuery(current_id_map, current_def->def);
+        optional<WithId<QueryFuncId, QueryFunc::DefUpdate>>
+            previous_remapped_def = ToQuery(previous_id_map, *previous_def);
+        optional<WithId<QueryFuncId, QueryFunc::DefUpdate>>
+            current_remapped_def = ToQuery(current_id_map, *current_def);
         if (current_remapped_def &&
             previous_remapped_def != current_remapped_def &&
-            !current_remapped_def->detailed_name.empty())
+            !current_remapped_def->value.detailed_name.empty())
           funcs_def_update.push_back(*current_remapped_def);
 
         PROCESS_UPDATE_DIFF(QueryFuncId, funcs_declarations, declarations,
@@ -579,7 +548,7 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       /*onRemoved:*/
       [this, &previous_id_map](IndexVar* var) {
         if (var->def.definition_spelling) {
-          vars_removed.push_back(var->def.usr);
+          vars_removed.push_back(previous_id_map.ToQuery(var->id));
         } else {
           if (!var->uses.empty())
             vars_uses.push_back(
@@ -589,8 +558,8 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       },
       /*onAdded:*/
       [this, &current_id_map](IndexVar* var) {
-        optional<QueryVar::DefUpdate> def_update =
-            ToQuery(current_id_map, var->def);
+        optional<WithId<QueryVarId, QueryVar::DefUpdate>> def_update =
+            ToQuery(current_id_map, *var);
         if (def_update)
           vars_def_update.push_back(*def_update);
         if (!var->uses.empty())
@@ -601,13 +570,13 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
       /*onFound:*/
       [this, &previous_id_map, &current_id_map](IndexVar* previous_def,
                                                 IndexVar* current_def) {
-        optional<QueryVar::DefUpdate> previous_remapped_def =
-            ToQuery(previous_id_map, previous_def->def);
-        optional<QueryVar::DefUpdate> current_remapped_def =
-            ToQuery(current_id_map, current_def->def);
+        optional<WithId<QueryVarId, QueryVar::DefUpdate>>
+            previous_remapped_def = ToQuery(previous_id_map, *previous_def);
+        optional<WithId<QueryVarId, QueryVar::DefUpdate>>
+            current_remapped_def = ToQuery(current_id_map, *current_def);
         if (current_remapped_def &&
             previous_remapped_def != current_remapped_def &&
-            !current_remapped_def->detailed_name.empty())
+            !current_remapped_def->value.detailed_name.empty())
           vars_def_update.push_back(*current_remapped_def);
 
         PROCESS_UPDATE_DIFF(QueryVarId, vars_uses, uses, QueryLocation);
@@ -616,6 +585,20 @@ IndexUpdate::IndexUpdate(const IdMap& previous_id_map,
 #undef PROCESS_UPDATE_DIFF
 }
 
+namespace {
+
+// Returns the number of entries added or removed by |merge_updates|.
+template <typename TId, typename TValue>
+size_t MergeableUpdateSize(
+    const std::vector<MergeableUpdate<TId, TValue>>& merge_updates) {
+  size_t size = 0;
+  for (const auto& merge_update : merge_updates)
+    size += merge_update.to_add.size() + merge_update.to_remove.size();
+  return size;
+}
+
+}  // namespace
+
 void IndexUpdate::Merge(const IndexUpdate& update) {
 // This function runs on an indexer thread.
 
@@ -645,6 +628,18 @@ void IndexUpdate::Merge(const IndexUpdate& update) {
 #undef INDEX_UPDATE_MERGE
 }
 
+size_t IndexUpdate::Size() const {
+  return files_removed.size() + files_def_update.size() +
+         types_removed.size() + types_def_update.size() +
+         MergeableUpdateSize(types_derived) +
+         MergeableUpdateSize(types_instances) +
+         MergeableUpdateSize(types_uses) + funcs_removed.size() +
+         funcs_def_update.size() + MergeableUpdateSize(funcs_declarations) +
+         MergeableUpdateSize(funcs_derived) +
+         MergeableUpdateSize(funcs_callers) + vars_removed.size() +
+         vars_def_update.size() + MergeableUpdateSize(vars_uses);
+}
+
 std::string IndexUpdate::ToString() {
   rapidjson::StringBuffer output;
   Writer writer(output);
@@ -657,8 +652,131 @@ std::string IndexUpdate::ToString() {
 // QUERYDB THREAD FUNCTIONS
 // ------------------------
 
-void QueryDatabase::RemoveUsrs(SymbolKind usr_kind,
-                               const std::vector<Usr>& to_remove) {
+namespace {
+
+template <typename TId, typename TStorage>
+void CreateStorage(ConcurrentUsrMap<TId>* usr_to_id,
+                   std::vector<TStorage>* storage) {
+  for (auto& entry : usr_to_id->TakeNewEntries()) {
+    assert(entry.first.id == storage->size());
+    storage->emplace_back();
+  }
+}
+
+void CreateStorage(ConcurrentUsrMap<QueryFileId>* usr_to_file,
+                   std::vector<QueryFile>* files) {
+  // Files are interned with their original path as the name.
+  for (auto& entry : usr_to_file->TakeNewEntries()) {
+    assert(entry.first.id == files->size());
+    files->push_back(QueryFile(entry.second));
+  }
+}
+
+template <typename TId, typename TStorage>
+void RemoveDefs(const std::vector<TId>& to_remove,
+                std::vector<TStorage>* storage) {
+  for (TId id : to_remove) {
+    if (id.id < storage->size())
+      (*storage)[id.id].def = nullopt;
+  }
+}
+
+// Orders uses by location, so the uses of a symbol in one file are next to
+// each other.
+bool LocationLess(const QueryLocation& a, const QueryLocation& b) {
+  return a < b;
+}
+bool LocationLess(const QueryFuncRef& a, const QueryFuncRef& b) {
+  if (a.loc != b.loc)
+    return a.loc < b.loc;
+  if (a.id_ != b.id_)
+    return a.id_ < b.id_;
+  return a.is_implicit < b.is_implicit;
+}
+
+// Applies a mergeable update to a list of ids. These lists are short, so the
+// order they were added in is kept.
+template <typename T>
+void ApplyMergeableUpdate(std::vector<T>* values,
+                          const std::vector<T>& to_add,
+                          const std::vector<T>& to_remove) {
+  AddRange(values, to_add);
+  RemoveRange(values, to_remove);
+}
+
+// Applies a mergeable update to a use list. Use lists can be very long, so they
+// are kept sorted by LocationLess; this lets the update be merged in one pass
+// instead of searching |to_remove| for every use.
+template <typename T>
+void MergeSortedUses(std::vector<T>* uses,
+                     std::vector<T> to_add,
+                     std::vector<T> to_remove) {
+  auto less = [](const T& a, const T& b) { return LocationLess(a, b); };
+  auto removed = [&](const T& use) {
+    return std::binary_search(to_remove.begin(), to_remove.end(), use, less);
+  };
+
+  std::sort(to_remove.begin(), to_remove.end(), less);
+  if (!to_remove.empty()) {
+    uses->erase(std::remove_if(uses->begin(), uses->end(), removed),
+                uses->end());
+    to_add.erase(std::remove_if(to_add.begin(), to_add.end(), removed),
+                 to_add.end());
+  }
+
+  std::sort(to_add.begin(), to_add.end(), less);
+  size_t old_size = uses->size();
+  uses->insert(uses->end(), to_add.begin(), to_add.end());
+  std::inplace_merge(uses->begin(), uses->begin() + old_size, uses->end(),
+                     less);
+}
+void ApplyMergeableUpdate(std::vector<QueryLocation>* uses,
+                          const std::vector<QueryLocation>& to_add,
+                          const std::vector<QueryLocation>& to_remove) {
+  MergeSortedUses(uses, to_add, to_remove);
+}
+void ApplyMergeableUpdate(std::vector<QueryFuncRef>* callers,
+                          const std::vector<QueryFuncRef>& to_add,
+                          const std::vector<QueryFuncRef>& to_remove) {
+  MergeSortedUses(callers, to_add, to_remove);
+}
+
+template <typename TId, typename TStorage>
+optional<TId> FindWithStorage(const ConcurrentUsrMap<TId>& usr_to_id,
+                              const std::vector<TStorage>& storage,
+                              const Usr& usr) {
+  optional<TId> id = usr_to_id.Find(usr);
+  if (id && id->id < storage.size())
+    return id;
+  return nullopt;
+}
+
+}  // namespace
+
+void QueryDatabase::CreateInternedSymbols() {
+  // This function runs on the querydb thread.
+
+  CreateStorage(&usr_to_file, &files);
+  CreateStorage(&usr_to_type, &types);
+  CreateStorage(&usr_to_func, &funcs);
+  CreateStorage(&usr_to_var, &vars);
+}
+
+optional<QueryFileId> QueryDatabase::GetQueryFileId(
+    const std::string& path) const {
+  return FindWithStorage(usr_to_file, files, LowerPathIfCaseInsensitive(path));
+}
+optional<QueryTypeId> QueryDatabase::GetQueryTypeId(const Usr& usr) const {
+  return FindWithStorage(usr_to_type, types, usr);
+}
+optional<QueryFuncId> QueryDatabase::GetQueryFuncId(const Usr& usr) const {
+  return FindWithStorage(usr_to_func, funcs, usr);
+}
+optional<QueryVarId> QueryDatabase::GetQueryVarId(const Usr& usr) const {
+  return FindWithStorage(usr_to_var, vars, usr);
+}
+
+void QueryDatabase::RemoveSymbols(const std::vector<QueryFileId>& to_remove) {
   // This function runs on the querydb thread.
 
   // When we remove an element, we just erase the state from the storage. We do
@@ -671,31 +789,16 @@ void QueryDatabase::RemoveUsrs(SymbolKind usr_kind,
   //
   // TODO: Add "cquery: Reload Index" command which unloads all querydb state
   // and fully reloads from cache. This will address the memory leak above.
-
-  switch (usr_kind) {
-    case SymbolKind::File: {
-      for (const Usr& usr : to_remove)
-        files[usr_to_file[LowerPathIfCaseInsensitive(usr)].id].def = nullopt;
-      break;
-    }
-    case SymbolKind::Type: {
-      for (const Usr& usr : to_remove)
-        types[usr_to_type[usr].id].def = nullopt;
-      break;
-    }
-    case SymbolKind::Func: {
-      for (const Usr& usr : to_remove)
-        funcs[usr_to_func[usr].id].def = nullopt;
-      break;
-    }
-    case SymbolKind::Var: {
-      for (const Usr& usr : to_remove)
-        vars[usr_to_var[usr].id].def = nullopt;
-      break;
-    }
-    case SymbolKind::Invalid:
-      break;
-  }
+  RemoveDefs(to_remove, &files);
+}
+void QueryDatabase::RemoveSymbols(const std::vector<QueryTypeId>& to_remove) {
+  RemoveDefs(to_remove, &types);
+}
+void QueryDatabase::RemoveSymbols(const std::vector<QueryFuncId>& to_remove) {
+  RemoveDefs(to_remove, &funcs);
+}
+void QueryDatabase::RemoveSymbols(const std::vector<QueryVarId>& to_remove) {
+  RemoveDefs(to_remove, &vars);
 }
 
 void QueryDatabase::ApplyIndexUpdate(IndexUpdate* update) {
@@ -707,28 +810,31 @@ void QueryDatabase::ApplyIndexUpdate(IndexUpdate* update) {
 //  MergeableUpdate<QueryTypeId, QueryTypeId> def                =>  QueryType
 //  def->def_var_name  =>  std::vector<QueryTypeId>
 #define HANDLE_MERGEABLE(update_var_name, def_var_name, storage_name) \
-  for (auto merge_update : update->update_var_name) {                 \
+  for (const auto& merge_update : update->update_var_name) {          \
     auto& def = storage_name[merge_update.id.id];                     \
-    AddRange(&def.def_var_name, merge_update.to_add);                 \
-    RemoveRange(&def.def_var_name, merge_update.to_remove);           \
+    ApplyMergeableUpdate(&def.def_var_name, merge_update.to_add,      \
+                         merge_update.to_remove);                     \
   }
 
-  RemoveUsrs(SymbolKind::File, update->files_removed);
+  // The ids in |update| were interned when its IdMaps were built.
+  CreateInternedSymbols();
+
+  RemoveSymbols(update->files_removed);
   ImportOrUpdate(update->files_def_update);
 
-  RemoveUsrs(SymbolKind::Type, update->types_removed);
+  RemoveSymbols(update->types_removed);
   ImportOrUpdate(update->types_def_update);
   HANDLE_MERGEABLE(types_derived, derived, types);
   HANDLE_MERGEABLE(types_instances, instances, types);
   HANDLE_MERGEABLE(types_uses, uses, types);
 
-  RemoveUsrs(SymbolKind::Func, update->funcs_removed);
+  RemoveSymbols(update->funcs_removed);
   ImportOrUpdate(update->funcs_def_update);
   HANDLE_MERGEABLE(funcs_declarations, declarations, funcs);
   HANDLE_MERGEABLE(funcs_derived, derived, funcs);
   HANDLE_MERGEABLE(funcs_callers, callers, funcs);
 
-  RemoveUsrs(SymbolKind::Var, update->vars_removed);
+  RemoveSymbols(update->vars_removed);
   ImportOrUpdate(update->vars_def_update);
   HANDLE_MERGEABLE(vars_uses, uses, vars);
 
@@ -740,29 +846,27 @@ void QueryDatabase::ImportOrUpdate(
   // This function runs on the querydb thread.
 
   for (auto& def : updates) {
-    auto it = usr_to_file.find(LowerPathIfCaseInsensitive(def.path));
-    assert(it != usr_to_file.end());
+    optional<QueryFileId> id = GetQueryFileId(def.path);
+    assert(id);
 
-    QueryFile& existing = files[it->second.id];
+    QueryFile& existing = files[id->id];
 
     existing.def = def;
-    UpdateDetailedNames(&existing.detailed_name_idx, SymbolKind::File,
-                        it->second.id, def.path);
+    UpdateDetailedNames(&existing.detailed_name_idx, SymbolKind::File, id->id,
+                        def.path);
   }
 }
 
 void QueryDatabase::ImportOrUpdate(
-    const std::vector<QueryType::DefUpdate>& updates) {
+    const std::vector<WithId<QueryTypeId, QueryType::DefUpdate>>& updates) {
   // This function runs on the querydb thread.
 
-  for (auto& def : updates) {
+  for (auto& update : updates) {
+    const QueryType::DefUpdate& def = update.value;
     assert(!def.detailed_name.empty());
 
-    auto it = usr_to_type.find(def.usr);
-    assert(it != usr_to_type.end());
-
-    assert(it->second.id >= 0 && it->second.id < types.size());
-    QueryType& existing = types[it->second.id];
+    QueryTypeId id = update.id;
+    QueryType& existing = types[id.id];
 
     // Keep the existing definition if it is higher quality.
     if (existing.def && existing.def->definition_spelling &&
@@ -771,22 +875,20 @@ void QueryDatabase::ImportOrUpdate(
 
     existing.def = def;
     UpdateDetailedNames(&existing.detailed_name_idx, SymbolKind::Type,
-                        it->second.id, def.detailed_name);
+                        id.id, def.detailed_name);
   }
 }
 
 void QueryDatabase::ImportOrUpdate(
-    const std::vector<QueryFunc::DefUpdate>& updates) {
+    const std::vector<WithId<QueryFuncId, QueryFunc::DefUpdate>>& updates) {
   // This function runs on the querydb thread.
 
-  for (auto& def : updates) {
+  for (auto& update : updates) {
+    const QueryFunc::DefUpdate& def = update.value;
     assert(!def.detailed_name.empty());
 
-    auto it = usr_to_func.find(def.usr);
-    assert(it != usr_to_func.end());
-
-    assert(it->second.id >= 0 && it->second.id < funcs.size());
-    QueryFunc& existing = funcs[it->second.id];
+    QueryFuncId id = update.id;
+    QueryFunc& existing = funcs[id.id];
 
     // Keep the existing definition if it is higher quality.
     if (existing.def && existing.def->definition_spelling &&
@@ -795,22 +897,20 @@ void QueryDatabase::ImportOrUpdate(
 
     existing.def = def;
     UpdateDetailedNames(&existing.detailed_name_idx, SymbolKind::Func,
-                        it->second.id, def.detailed_name);
+                        id.id, def.detailed_name);
   }
 }
 
 void QueryDatabase::ImportOrUpdate(
-    const std::vector<QueryVar::DefUpdate>& updates) {
+    const std::vector<WithId<QueryVarId, QueryVar::DefUpdate>>& updates) {
   // This function runs on the querydb thread.
 
-  for (auto& def : updates) {
+  for (auto& update : updates) {
+    const QueryVar::DefUpdate& def = update.value;
     assert(!def.detailed_name.empty());
 
-    auto it = usr_to_var.find(def.usr);
-    assert(it != usr_to_var.end());
-
-    assert(it->second.id >= 0 && it->second.id < vars.size());
-    QueryVar& existing = vars[it->second.id];
+    QueryVarId id = update.id;
+    QueryVar& existing = vars[id.id];
 
     // Keep the existing definition if it is higher quality.
     if (existing.def && existing.def->definition_spelling &&
@@ -820,7 +920,7 @@ void QueryDatabase::ImportOrUpdate(
     existing.def = def;
     if (!def.is_local)
       UpdateDetailedNames(&existing.detailed_name_idx, SymbolKind::Var,
-                          it->second.id, def.detailed_name);
+                          id.id, def.detailed_name);
   }
 }
 
@@ -859,9 +959,9 @@ TEST_SUITE("query") {
 
     IndexUpdate update = GetDelta(previous, current);
 
-    REQUIRE(update.types_removed == std::vector<Usr>{"usr1"});
-    REQUIRE(update.funcs_removed == std::vector<Usr>{"usr2"});
-    REQUIRE(update.vars_removed == std::vector<Usr>{"usr3"});
+    REQUIRE(update.types_removed == std::vector<QueryTypeId>{QueryTypeId(0)});
+    REQUIRE(update.funcs_removed == std::vector<QueryFuncId>{QueryFuncId(0)});
+    REQUIRE(update.vars_removed == std::vector<QueryVarId>{QueryVarId(0)});
   }
 
   TEST_CASE("do not remove ref-only defs") {
@@ -878,9 +978,9 @@ TEST_SUITE("query") {
 
     IndexUpdate update = GetDelta(previous, current);
 
-    REQUIRE(update.types_removed == std::vector<Usr>{});
-    REQUIRE(update.funcs_removed == std::vector<Usr>{});
-    REQUIRE(update.vars_removed == std::vector<Usr>{});
+    REQUIRE(update.types_removed.empty());
+    REQUIRE(update.funcs_removed.empty());
+    REQUIRE(update.vars_removed.empty());
   }
 
   TEST_CASE("func callers") {
@@ -897,7 +997,7 @@ TEST_SUITE("query") {
 
     IndexUpdate update = GetDelta(previous, current);
 
-    REQUIRE(update.funcs_removed == std::vector<Usr>{});
+    REQUIRE(update.funcs_removed.empty());
     REQUIRE(update.funcs_callers.size() == 1);
     REQUIRE(update.funcs_callers[0].id == QueryFuncId(0));
     REQUIRE(update.funcs_callers[0].to_remove.size() == 1);
@@ -920,8 +1020,8 @@ TEST_SUITE("query") {
 
     IndexUpdate update = GetDelta(previous, current);
 
-    REQUIRE(update.types_removed == std::vector<Usr>{});
-    REQUIRE(update.types_def_update == std::vector<QueryType::DefUpdate>{});
+    REQUIRE(update.types_removed.empty());
+    REQUIRE(update.types_def_update.empty());
     REQUIRE(update.types_uses.size() == 1);
     REQUIRE(update.types_uses[0].to_remove.size() == 1);
     REQUIRE(update.types_uses[0].to_remove[0].range == Range(Position(1, 0)));
@@ -947,6 +1047,7 @@ TEST_SUITE("query") {
     QueryDatabase db;
     IdMap previous_map(&db, previous.id_cache);
     IdMap current_map(&db, current.id_cache);
+    db.CreateInternedSymbols();
     REQUIRE(db.funcs.size() == 1);
 
     IndexUpdate import_update =
@@ -964,4 +1065,86 @@ TEST_SUITE("query") {
     REQUIRE(db.funcs[0].callers[0].loc.range == Range(Position(4, 0)));
     REQUIRE(db.funcs[0].callers[1].loc.range == Range(Position(5, 0)));
   }
+
+  TEST_CASE("build id maps concurrently") {
+    const int kFileCount = 8;
+    const int kUsrCount = 1000;
+
+    // Every file refers to the same usrs, so the threads race to intern them.
+    std::vector<std::unique_ptr<IndexFile>> files;
+    for (int i = 0; i < kFileCount; ++i) {
+      files.push_back(MakeUnique<IndexFile>("foo" + std::to_string(i) + ".cc"));
+      for (int j = 0; j < kUsrCount; ++j)
+        files.back()->ToFuncId("usr" + std::to_string((i * 7 + j) % kUsrCount));
+    }
+
+    QueryDatabase db;
+    std::vector<std::unique_ptr<IdMap>> id_maps(kFileCount);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kFileCount; ++i) {
+      threads.emplace_back([&, i]() {
+        id_maps[i] = MakeUnique<IdMap>(&db, files[i]->id_cache);
+      });
+    }
+    for (std::thread& thread : threads)
+      thread.join();
+
+    // Nothing has storage until querydb creates it.
+    REQUIRE(db.funcs.empty());
+    REQUIRE(!db.GetQueryFuncId("usr0"));
+    db.CreateInternedSymbols();
+    REQUIRE(db.files.size() == kFileCount);
+    REQUIRE(db.funcs.size() == kUsrCount);
+
+    for (int i = 0; i < kFileCount; ++i) {
+      REQUIRE(db.files[id_maps[i]->primary_file.id].def->path ==
+              files[i]->path);
+      for (const auto& entry : files[i]->id_cache.func_id_to_usr) {
+        QueryFuncId id = id_maps[i]->ToQuery(entry.first);
+        REQUIRE(db.GetQueryFuncId(entry.second) == id);
+        REQUIRE(db.usr_to_func.GetUsr(id) == entry.second);
+      }
+    }
+  }
+
+  TEST_CASE("use lists are grouped by file") {
+    REQUIRE(sizeof(QueryLocation) == 12);
+
+    IndexFile foo("foo.cc");
+    IndexFile bar("bar.cc");
+    IndexFile foo_changed("foo.cc");
+    for (int line : {5, 1, 3})
+      foo.Resolve(foo.ToTypeId("usr"))
+          ->uses.push_back(Range(Position(line, 0)));
+    for (int line : {4, 2})
+      bar.Resolve(bar.ToTypeId("usr"))
+          ->uses.push_back(Range(Position(line, 0)));
+    for (int line : {6, 1})
+      foo_changed.Resolve(foo_changed.ToTypeId("usr"))
+          ->uses.push_back(Range(Position(line, 0)));
+
+    QueryDatabase db;
+    IdMap foo_map(&db, foo.id_cache);
+    IdMap bar_map(&db, bar.id_cache);
+    IdMap foo_changed_map(&db, foo_changed.id_cache);
+    IndexUpdate foo_import =
+        IndexUpdate::CreateDelta(nullptr, &foo_map, nullptr, &foo);
+    IndexUpdate bar_import =
+        IndexUpdate::CreateDelta(nullptr, &bar_map, nullptr, &bar);
+    IndexUpdate foo_delta = IndexUpdate::CreateDelta(
+        &foo_map, &foo_changed_map, &foo, &foo_changed);
+    db.ApplyIndexUpdate(&foo_import);
+    db.ApplyIndexUpdate(&bar_import);
+    db.ApplyIndexUpdate(&foo_delta);
+
+    QueryFileId foo_id = foo_map.primary_file;
+    QueryFileId bar_id = bar_map.primary_file;
+    REQUIRE(foo_id.id == 0);
+    std::vector<QueryLocation> expected = {
+        QueryLocation(foo_id, Range(Position(1, 0))),
+        QueryLocation(foo_id, Range(Position(6, 0))),
+        QueryLocation(bar_id, Range(Position(2, 0))),
+        QueryLocation(bar_id, Range(Position(4, 0)))};
+    REQUIRE(db.types[0].uses == expected);
+  }
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "concurrent_usr_map.h"
 #include "indexer.h"
 #include "serializer.h"
 
@@ -110,7 +111,7 @@ struct QueryFuncRef {
   QueryLocation loc;
   bool is_implicit = false;
 
-  bool has_id() const { return id_.id != static_cast<size_t>(-1); }
+  bool has_id() const { return id_.id != static_cast<RawId>(-1); }
 
   QueryFuncRef() {}  // Do not use, needed for reflect.
   QueryFuncRef(QueryFuncId id, QueryLocation loc, bool is_implicit)
@@ -166,6 +167,31 @@ void Reflect(TVisitor& visitor, MergeableUpdate<TId, TValue>& value) {
   REFLECT_MEMBER_END();
 }
 
+// A definition update together with the id of the symbol it belongs to. The
+// id was interned when the IdMap was built, so the update carries neither the
+// usr nor needs it to be looked up again when it is applied.
+template <typename TId, typename TValue>
+struct WithId {
+  TId id;
+  TValue value;
+
+  WithId(TId id, const TValue& value) : id(id), value(value) {}
+
+  bool operator==(const WithId<TId, TValue>& other) const {
+    return id == other.id && value == other.value;
+  }
+  bool operator!=(const WithId<TId, TValue>& other) const {
+    return !(*this == other);
+  }
+};
+template <typename TVisitor, typename TId, typename TValue>
+void Reflect(TVisitor& visitor, WithId<TId, TValue>& value) {
+  REFLECT_MEMBER_START();
+  REFLECT_MEMBER(id);
+  REFLECT_MEMBER(value);
+  REFLECT_MEMBER_END();
+}
+
 struct QueryFile {
   struct Def {
     std::string path;
@@ -179,6 +205,10 @@ struct QueryFile {
     std::vector<SymbolRef> all_symbols;
     // Parts of the file which are disabled.
     std::vector<Range> inactive_regions;
+    // State of the file on disk when it was indexed. Used to check if a
+    // snapshot of the database is still valid.
+    int64_t last_modification_time = 0;
+    uint64_t content_hash = 0;
   };
 
   using DefUpdate = Def;
@@ -186,6 +216,7 @@ struct QueryFile {
   optional<DefUpdate> def;
   size_t detailed_name_idx = (size_t)-1;
 
+  QueryFile() {}  // Do not use, needed for reflect.
   QueryFile(const std::string& path) {
     def = DefUpdate();
     def->path = path;
@@ -213,7 +244,8 @@ struct QueryType {
   std::vector<QueryLocation> uses;
   size_t detailed_name_idx = (size_t)-1;
 
-  QueryType(const Usr& usr) : def(usr) {}
+  // |def->usr| is always empty; the usr is kept by QueryDatabase::usr_to_type.
+  QueryType() : def(DefUpdate()) {}
 };
 
 struct QueryFunc {
@@ -232,7 +264,8 @@ struct QueryFunc {
   std::vector<QueryFuncRef> callers;
   size_t detailed_name_idx = (size_t)-1;
 
-  QueryFunc(const Usr& usr) : def(usr) {}
+  // |def->usr| is always empty; the usr is kept by QueryDatabase::usr_to_func.
+  QueryFunc() : def(DefUpdate()) {}
 };
 
 struct QueryVar {
@@ -244,7 +277,8 @@ struct QueryVar {
   std::vector<QueryLocation> uses;
   size_t detailed_name_idx = (size_t)-1;
 
-  QueryVar(const Usr& usr) : def(usr) {}
+  // |def->usr| is always empty; the usr is kept by QueryDatabase::usr_to_var.
+  QueryVar() : def(DefUpdate()) {}
 };
 
 struct IndexUpdate {
@@ -259,30 +293,37 @@ struct IndexUpdate {
   // work can be parallelized.
   void Merge(const IndexUpdate& update);
 
+  // Returns the number of entries in this update, which is roughly
+  // proportional to the time it takes to apply it.
+  size_t Size() const;
+
   // Dump the update to a string.
   std::string ToString();
 
+  // Symbols are removed by id; the ids were interned by the IdMap of the
+  // previous index.
+
   // File updates.
-  std::vector<Usr> files_removed;
+  std::vector<QueryFileId> files_removed;
   std::vector<QueryFile::DefUpdate> files_def_update;
 
   // Type updates.
-  std::vector<Usr> types_removed;
-  std::vector<QueryType::DefUpdate> types_def_update;
+  std::vector<QueryTypeId> types_removed;
+  std::vector<WithId<QueryTypeId, QueryType::DefUpdate>> types_def_update;
   std::vector<QueryType::DerivedUpdate> types_derived;
   std::vector<QueryType::InstancesUpdate> types_instances;
   std::vector<QueryType::UsesUpdate> types_uses;
 
   // Function updates.
-  std::vector<Usr> funcs_removed;
-  std::vector<QueryFunc::DefUpdate> funcs_def_update;
+  std::vector<QueryFuncId> funcs_removed;
+  std::vector<WithId<QueryFuncId, QueryFunc::DefUpdate>> funcs_def_update;
   std::vector<QueryFunc::DeclarationsUpdate> funcs_declarations;
   std::vector<QueryFunc::DerivedUpdate> funcs_derived;
   std::vector<QueryFunc::CallersUpdate> funcs_callers;
 
   // Variable updates.
-  std::vector<Usr> vars_removed;
-  std::vector<QueryVar::DefUpdate> vars_def_update;
+  std::vector<QueryVarId> vars_removed;
+  std::vector<WithId<QueryVarId, QueryVar::DefUpdate>> vars_def_update;
   std::vector<QueryVar::UsesUpdate> vars_uses;
 
  private:
@@ -325,22 +366,39 @@ struct QueryDatabase {
   std::vector<QueryFunc> funcs;
   std::vector<QueryVar> vars;
 
-  // Lookup symbol based on a usr.
+  // Lookup symbol based on a usr. These are the only members which may be
+  // used off the querydb thread; IdMaps are built on the indexer threads and
+  // intern new usrs here. An id may be interned before the storage above has
+  // an entry for it, so the querydb thread should use the Get*Id methods.
   // NOTE: For usr_to_file make sure to call LowerPathIfCaseInsensitive on key.
   // TODO: add type wrapper to enforce we call it
-  spp::sparse_hash_map<Usr, QueryFileId> usr_to_file;
-  spp::sparse_hash_map<Usr, QueryTypeId> usr_to_type;
-  spp::sparse_hash_map<Usr, QueryFuncId> usr_to_func;
-  spp::sparse_hash_map<Usr, QueryVarId> usr_to_var;
-
-  // Marks the given Usrs as invalid.
-  void RemoveUsrs(SymbolKind usr_kind, const std::vector<Usr>& to_remove);
+  ConcurrentUsrMap<QueryFileId> usr_to_file;
+  ConcurrentUsrMap<QueryTypeId> usr_to_type;
+  ConcurrentUsrMap<QueryFuncId> usr_to_func;
+  ConcurrentUsrMap<QueryVarId> usr_to_var;
+
+  // Creates storage for every id which was interned since the last call.
+  void CreateInternedSymbols();
+  // Returns the id of |path| or |usr| if there is storage for it.
+  optional<QueryFileId> GetQueryFileId(const std::string& path) const;
+  optional<QueryTypeId> GetQueryTypeId(const Usr& usr) const;
+  optional<QueryFuncId> GetQueryFuncId(const Usr& usr) const;
+  optional<QueryVarId> GetQueryVarId(const Usr& usr) const;
+
+  // Marks the given symbols as invalid.
+  void RemoveSymbols(const std::vector<QueryFileId>& to_remove);
+  void RemoveSymbols(const std::vector<QueryTypeId>& to_remove);
+  void RemoveSymbols(const std::vector<QueryFuncId>& to_remove);
+  void RemoveSymbols(const std::vector<QueryVarId>& to_remove);
   // Insert the contents of |update| into |db|.
   void ApplyIndexUpdate(IndexUpdate* update);
   void ImportOrUpdate(const std::vector<QueryFile::DefUpdate>& updates);
-  void ImportOrUpdate(const std::vector<QueryType::DefUpdate>& updates);
-  void ImportOrUpdate(const std::vector<QueryFunc::DefUpdate>& updates);
-  void ImportOrUpdate(const std::vector<QueryVar::DefUpdate>& updates);
+  void ImportOrUpdate(
+      const std::vector<WithId<QueryTypeId, QueryType::DefUpdate>>& updates);
+  void ImportOrUpdate(
+      const std::vector<WithId<QueryFuncId, QueryFunc::DefUpdate>>& updates);
+  void ImportOrUpdate(
+      const std::vector<WithId<QueryVarId, QueryVar::DefUpdate>>& updates);
   void UpdateDetailedNames(size_t* qualified_name_index,
                            SymbolKind kind,
                            size_t symbol_index,
@@ -351,6 +409,8 @@ struct IdMap {
   const IdCache& local_ids;
   QueryFileId primary_file;
 
+  // Interns every usr in |local_ids|. This is thread-safe; see
+  // QueryDatabase::usr_to_file.
   IdMap(QueryDatabase* query_db, const IdCache& local_ids);
 
   QueryLocation ToQuery(Range range) const;
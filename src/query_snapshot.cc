@@ -0,0 +1,249 @@
+#include "query_snapshot.h"
+
+#include "cache_manifest.h"
+#include "config.h"
+#include "platform.h"
+#include "query.h"
+#include "timer.h"
+#include "utils.h"
+
+#include <loguru/loguru.hpp>
+
+namespace {
+
+// Bump this when the snapshot layout changes, or when what querydb expects of
+// the stored data does (ie, use lists being sorted). Snapshots are also
+// discarded when IndexFile::kCurrentVersion changes.
+const int kSnapshotVersion = 2;
+
+std::string GetSnapshotFileName(Config* config) {
+  return config->cacheDirectory + "@querydb" +
+         SerializeFormatExtension(SerializeFormat::Binary);
+}
+
+// The snapshot must contain every member of the query structs, so it does not
+// reuse the json reflection, which skips members to keep logs small.
+
+void ReflectSize(BinaryWriter& visitor, size_t& value) {
+  uint64_t value64 = value;
+  Reflect(visitor, value64);
+}
+void ReflectSize(BinaryReader& visitor, size_t& value) {
+  uint64_t value64 = 0;
+  Reflect(visitor, value64);
+  value = static_cast<size_t>(value64);
+}
+
+template <typename TVisitor, typename TDef>
+void ReflectDef(TVisitor& visitor, TDef& def) {
+  Reflect(visitor, def);
+}
+template <typename TVisitor>
+void ReflectDef(TVisitor& visitor, QueryFile::Def& def) {
+  Reflect(visitor, def.path);
+  Reflect(visitor, def.language);
+  Reflect(visitor, def.includes);
+  Reflect(visitor, def.outline);
+  Reflect(visitor, def.all_symbols);
+  Reflect(visitor, def.inactive_regions);
+  Reflect(visitor, def.last_modification_time);
+  Reflect(visitor, def.content_hash);
+}
+template <typename TVisitor>
+void ReflectDef(TVisitor& visitor, QueryVar::DefUpdate& def) {
+  Reflect(visitor, def);
+  Reflect(visitor, def.declaration);
+}
+
+template <typename TDef>
+void ReflectOptionalDef(BinaryWriter& visitor, optional<TDef>& def) {
+  bool has_def = static_cast<bool>(def);
+  Reflect(visitor, has_def);
+  if (def)
+    ReflectDef(visitor, *def);
+}
+template <typename TDef>
+void ReflectOptionalDef(BinaryReader& visitor, optional<TDef>& def) {
+  bool has_def = false;
+  Reflect(visitor, has_def);
+  if (!has_def) {
+    def = nullopt;
+    return;
+  }
+  def = TDef();
+  ReflectDef(visitor, *def);
+}
+
+template <typename TVisitor>
+void ReflectSymbol(TVisitor& visitor, QueryFile& value) {
+  ReflectOptionalDef(visitor, value.def);
+  ReflectSize(visitor, value.detailed_name_idx);
+}
+template <typename TVisitor>
+void ReflectSymbol(TVisitor& visitor, QueryType& value) {
+  ReflectOptionalDef(visitor, value.def);
+  Reflect(visitor, value.derived);
+  Reflect(visitor, value.instances);
+  Reflect(visitor, value.uses);
+  ReflectSize(visitor, value.detailed_name_idx);
+}
+template <typename TVisitor>
+void ReflectSymbol(TVisitor& visitor, QueryFunc& value) {
+  ReflectOptionalDef(visitor, value.def);
+  Reflect(visitor, value.declarations);
+  Reflect(visitor, value.derived);
+  Reflect(visitor, value.callers);
+  ReflectSize(visitor, value.detailed_name_idx);
+}
+template <typename TVisitor>
+void ReflectSymbol(TVisitor& visitor, QueryVar& value) {
+  ReflectOptionalDef(visitor, value.def);
+  Reflect(visitor, value.uses);
+  ReflectSize(visitor, value.detailed_name_idx);
+}
+
+// The query structs are reflected member by member, so they cannot go through
+// the generic vector reflection.
+template <typename T>
+void ReflectSymbols(BinaryWriter& visitor, std::vector<T>& values) {
+  visitor.Write<uint32_t>((uint32_t)values.size());
+  for (T& value : values)
+    ReflectSymbol(visitor, value);
+}
+template <typename T>
+void ReflectSymbols(BinaryReader& visitor, std::vector<T>& values) {
+  uint32_t count = 0;
+  if (!visitor.ReadCount(&count))
+    return;
+  values.reserve(count);
+  for (uint32_t i = 0; i < count && !visitor.failed; ++i) {
+    values.emplace_back();
+    ReflectSymbol(visitor, values.back());
+  }
+}
+
+// Only usrs which have storage in |storage| are written; others may have
+// been interned by an indexer since the last index update was applied.
+template <typename TId, typename TStorage>
+void ReflectUsrMap(BinaryWriter& visitor,
+                   ConcurrentUsrMap<TId>& usr_to_id,
+                   const std::vector<TStorage>& storage) {
+  std::vector<std::pair<Usr, TId>> entries;
+  usr_to_id.ForEach([&](const Usr& usr, TId id) {
+    if (id.id < storage.size())
+      entries.emplace_back(usr, id);
+  });
+  visitor.Write<uint32_t>((uint32_t)entries.size());
+  for (auto& entry : entries) {
+    Reflect(visitor, entry.first);
+    Reflect(visitor, entry.second);
+  }
+}
+template <typename TId, typename TStorage>
+void ReflectUsrMap(BinaryReader& visitor,
+                   ConcurrentUsrMap<TId>& usr_to_id,
+                   const std::vector<TStorage>& storage) {
+  uint32_t count = 0;
+  if (!visitor.ReadCount(&count))
+    return;
+  for (uint32_t i = 0; i < count && !visitor.failed; ++i) {
+    Usr usr;
+    TId id;
+    Reflect(visitor, usr);
+    Reflect(visitor, id);
+    usr_to_id.Restore(usr, id);
+  }
+}
+
+template <typename TVisitor>
+void ReflectDatabase(TVisitor& visitor, QueryDatabase& db) {
+  ReflectSymbols(visitor, db.files);
+  ReflectSymbols(visitor, db.types);
+  ReflectSymbols(visitor, db.funcs);
+  ReflectSymbols(visitor, db.vars);
+  Reflect(visitor, db.detailed_names);
+  Reflect(visitor, db.symbols);
+  ReflectUsrMap(visitor, db.usr_to_file, db.files);
+  ReflectUsrMap(visitor, db.usr_to_type, db.types);
+  ReflectUsrMap(visitor, db.usr_to_func, db.funcs);
+  ReflectUsrMap(visitor, db.usr_to_var, db.vars);
+}
+
+// Returns true if |def| was imported from the cache entry described by
+// |entry|.
+bool IsSameFile(const QueryFile::Def& def, const CacheManifest::Entry& entry) {
+  if (def.last_modification_time == entry.last_modification_time)
+    return true;
+  return def.content_hash != 0 && def.content_hash == entry.content_hash;
+}
+
+}  // namespace
+
+bool SaveQueryDatabaseSnapshot(Config* config, QueryDatabase* db) {
+  if (!config->enableCacheWrite || config->cacheDirectory.empty())
+    return false;
+
+  Timer timer;
+  BinaryWriter writer;
+  int version = kSnapshotVersion;
+  Reflect(writer, version);
+  ReflectDatabase(writer, *db);
+  std::string content = writer.Finish(IndexFile::kCurrentVersion);
+
+  // The snapshot is loaded at startup instead of the per-file caches, so it
+  // must never be observed half written.
+  if (!WriteFileAtomically(GetSnapshotFileName(config), content)) {
+    LOG_S(ERROR) << "Unable to write querydb snapshot "
+                 << GetSnapshotFileName(config);
+    return false;
+  }
+  timer.ResetAndPrint("[perf] Saved querydb snapshot (" +
+                      std::to_string(db->files.size()) + " files, " +
+                      std::to_string(content.size()) + " bytes)");
+  return true;
+}
+
+bool LoadQueryDatabaseSnapshot(Config* config,
+                               CacheManifest* cache_manifest,
+                               QueryDatabase* db) {
+  if (!config->enableCacheRead)
+    return false;
+
+  Timer timer;
+  std::unique_ptr<PlatformMappedFile> content =
+      CreatePlatformMappedFile(GetSnapshotFileName(config));
+  if (!content)
+    return false;
+
+  BinaryReader reader;
+  int version = 0;
+  if (reader.Start(content->data, content->size, IndexFile::kCurrentVersion)) {
+    Reflect(reader, version);
+    if (version == kSnapshotVersion)
+      ReflectDatabase(reader, *db);
+  }
+  if (reader.failed || version != kSnapshotVersion) {
+    LOG_S(WARNING) << "Ignoring invalid querydb snapshot "
+                   << GetSnapshotFileName(config);
+    *db = QueryDatabase();
+    return false;
+  }
+
+  // The snapshot is only consistent with the cache if nothing has been
+  // indexed since it was written.
+  for (const QueryFile& file : db->files) {
+    if (!file.def)
+      continue;
+    optional<CacheManifest::Entry> entry = cache_manifest->Find(file.def->path);
+    if (!entry || !IsSameFile(*file.def, *entry)) {
+      LOG_S(INFO) << "Ignoring querydb snapshot; it does not match the cache "
+                  << "for " << file.def->path;
+      *db = QueryDatabase();
+      return false;
+    }
+  }
+
+  timer.ResetAndPrint("[perf] Loaded querydb snapshot (" +
+                      std::to_string(db->files.size()) + " files)");
+  return true;
+}
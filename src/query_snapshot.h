@@ -0,0 +1,23 @@
+#pragma once
+
+struct CacheManifest;
+struct Config;
+struct QueryDatabase;
+
+// Writes all of |db| to the cache directory so it can be restored on the next
+// startup instead of importing every cached index again. Returns false if the
+// snapshot could not be written.
+bool SaveQueryDatabaseSnapshot(Config* config, QueryDatabase* db);
+
+// Restores the snapshot written by SaveQueryDatabaseSnapshot into |db|, which
+// must be empty. The snapshot is only used if every file in it matches the
+// state recorded in |cache_manifest|, ie, no file has been written to the
+// cache since the snapshot was taken. Returns false and leaves |db| empty if
+// there is no usable snapshot.
+//
+// This must be called before the manifest is used to scan the project, since
+// the scan may update the timestamps stored in the manifest, and before any
+// IdMap is built, since the snapshot determines the ids of interned usrs.
+bool LoadQueryDatabaseSnapshot(Config* config,
+                               CacheManifest* cache_manifest,
+                               QueryDatabase* db);
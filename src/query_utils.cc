@@ -784,7 +784,7 @@ NonElidedVector<Out_CqueryCallTree::CallEntry> BuildInitialCallTree(
 
   Out_CqueryCallTree::CallEntry entry;
   entry.name = root_func.def->short_name;
-  entry.usr = root_func.def->usr;
+  entry.usr = db->usr_to_func.GetUsr(root);
   entry.location = *def_loc;
   entry.hasCallers = HasCallersOnSelfOrBaseOrDerived(db, root_func);
   NonElidedVector<Out_CqueryCallTree::CallEntry> result;
@@ -858,7 +858,7 @@ NonElidedVector<Out_CqueryCallTree::CallEntry> BuildExpandCallTree(
       call_entry.name =
           call_func.def->short_name + " (" +
           format_location(*call_location, call_func.def->declaring_type) + ")";
-      call_entry.usr = call_func.def->usr;
+      call_entry.usr = db->usr_to_func.GetUsr(caller.id_);
       call_entry.location = *call_location;
       call_entry.hasCallers = HasCallersOnSelfOrBaseOrDerived(db, call_func);
       call_entry.callType = call_type;
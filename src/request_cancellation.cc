@@ -0,0 +1,99 @@
+#include "request_cancellation.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+
+namespace {
+
+// Integer and string ids are distinct, so they get distinct keys.
+std::string ToKey(const lsRequestId& id) {
+  if (id.id0)
+    return "i" + std::to_string(*id.id0);
+  return "s" + id.id1.value_or("");
+}
+
+}  // namespace
+
+void RequestCancellation::Track(BaseIpcMessage* message) {
+  if (!message->request_id)
+    return;
+
+  message->cancelled = std::make_shared<std::atomic<bool>>(false);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (requests_.size() >= prune_size_) {
+    for (auto it = requests_.begin(); it != requests_.end();) {
+      if (it->second.expired())
+        it = requests_.erase(it);
+      else
+        ++it;
+    }
+    prune_size_ = std::max<size_t>(64, requests_.size() * 2);
+  }
+  requests_[ToKey(*message->request_id)] = message->cancelled;
+}
+
+bool RequestCancellation::Cancel(const lsRequestId& id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = requests_.find(ToKey(id));
+  if (it == requests_.end())
+    return false;
+
+  std::shared_ptr<std::atomic<bool>> cancelled = it->second.lock();
+  requests_.erase(it);
+  if (!cancelled)
+    return false;
+  *cancelled = true;
+  return true;
+}
+
+TEST_SUITE("RequestCancellation") {
+  struct TestMessage : public BaseIpcMessage {
+    explicit TestMessage(int id) : BaseIpcMessage(IpcId::TextDocumentHover) {
+      request_id = lsRequestId();
+      request_id->id0 = id;
+    }
+  };
+
+  lsRequestId MakeId(int id) {
+    lsRequestId result;
+    result.id0 = id;
+    return result;
+  }
+
+  TEST_CASE("cancels tracked requests") {
+    RequestCancellation cancellation;
+    TestMessage first(1);
+    TestMessage second(2);
+    cancellation.Track(&first);
+    cancellation.Track(&second);
+    REQUIRE(!first.IsCancelled());
+
+    REQUIRE(cancellation.Cancel(MakeId(1)));
+    REQUIRE(first.IsCancelled());
+    REQUIRE(!second.IsCancelled());
+
+    // Unknown ids and string ids which look like a tracked integer id are
+    // ignored.
+    lsRequestId string_id;
+    string_id.id1 = std::string("2");
+    REQUIRE(!cancellation.Cancel(string_id));
+    REQUIRE(!cancellation.Cancel(MakeId(3)));
+    REQUIRE(!second.IsCancelled());
+  }
+
+  TEST_CASE("forgets answered requests") {
+    RequestCancellation cancellation;
+    for (int i = 0; i < 1000; ++i) {
+      TestMessage message(i);
+      cancellation.Track(&message);
+    }
+    REQUIRE(!cancellation.Cancel(MakeId(999)));
+
+    // Notifications are not tracked.
+    BaseIpcMessage notification(IpcId::TextDocumentDidChange);
+    cancellation.Track(&notification);
+    REQUIRE(!notification.cancelled);
+  }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "ipc.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Keeps track of the requests the client has sent so that they can be
+// cancelled with $/cancelRequest. Cancelling a request only sets its
+// BaseIpcMessage::cancelled flag; queued requests are dropped when they are
+// dequeued, and long-running handlers check the flag while they run.
+//
+// A request is forgotten once its message has been destroyed.
+struct RequestCancellation {
+  // Starts tracking |message| if it is a request.
+  void Track(BaseIpcMessage* message);
+  // Cancels the request with |id|. Returns false if it is not being handled
+  // anymore, ie, because it has already been answered.
+  bool Cancel(const lsRequestId& id);
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::weak_ptr<std::atomic<bool>>> requests_;
+  // Answered requests are removed from |requests_| once it grows this large.
+  size_t prune_size_ = 64;
+};
@@ -1,8 +1,10 @@
 #include "serializer.h"
 
 #include "indexer.h"
+#include "timer.h"
 
 #include <doctest/doctest.h>
+#include <loguru/loguru.hpp>
 
 namespace {
 bool gTestOutputMode = false;
@@ -73,6 +75,186 @@ void ReflectMember(Writer& visitor, const char* name, std::string& value) {
   Reflect(visitor, value);
 }
 
+// Binary
+namespace {
+const char kBinaryMagic[4] = {'C', 'Q', 'B', 'I'};
+// Bump this when the binary layout changes independently of the index
+// contents (which are versioned by IndexFile::kCurrentVersion).
+const uint32_t kBinaryFormatVersion = 1;
+}  // namespace
+
+uint32_t BinaryWriter::InternString(const std::string& value) {
+  auto it = string_ids.find(value);
+  if (it != string_ids.end())
+    return it->second;
+  uint32_t id = (uint32_t)strings.size();
+  it = string_ids.insert(std::make_pair(value, id)).first;
+  strings.push_back(&it->first);
+  return id;
+}
+
+std::string BinaryWriter::Finish(int index_version) {
+  size_t string_bytes = 0;
+  for (const std::string* str : strings)
+    string_bytes += sizeof(uint32_t) + str->size();
+
+  std::string output;
+  output.reserve(sizeof(kBinaryMagic) + 3 * sizeof(uint32_t) + string_bytes +
+                 payload.size());
+  auto append = [&output](const void* data, size_t size) {
+    output.append(reinterpret_cast<const char*>(data), size);
+  };
+  append(kBinaryMagic, sizeof(kBinaryMagic));
+  append(&kBinaryFormatVersion, sizeof(kBinaryFormatVersion));
+  int32_t version = index_version;
+  append(&version, sizeof(version));
+  uint32_t string_count = (uint32_t)strings.size();
+  append(&string_count, sizeof(string_count));
+  for (const std::string* str : strings) {
+    uint32_t length = (uint32_t)str->size();
+    append(&length, sizeof(length));
+    output += *str;
+  }
+  output += payload;
+  return output;
+}
+
+bool BinaryReader::Start(const char* data,
+                         size_t size,
+                         optional<int> expected_index_version) {
+  data_ = data;
+  size_ = size;
+  offset_ = 0;
+  failed = false;
+  strings_.clear();
+
+  if (size_ < sizeof(kBinaryMagic) ||
+      memcmp(data_, kBinaryMagic, sizeof(kBinaryMagic)) != 0) {
+    failed = true;
+    return false;
+  }
+  offset_ = sizeof(kBinaryMagic);
+
+  uint32_t format_version = 0;
+  int32_t index_version = 0;
+  if (!Read(&format_version) || format_version != kBinaryFormatVersion ||
+      !Read(&index_version) ||
+      (expected_index_version && index_version != *expected_index_version)) {
+    failed = true;
+    return false;
+  }
+
+  uint32_t string_count = 0;
+  if (!ReadCount(&string_count))
+    return false;
+  strings_.reserve(string_count);
+  for (uint32_t i = 0; i < string_count; ++i) {
+    uint32_t length = 0;
+    if (!Read(&length) || size_ - offset_ < length) {
+      failed = true;
+      return false;
+    }
+    strings_.push_back(std::make_pair(data_ + offset_, length));
+    offset_ += length;
+  }
+  return true;
+}
+
+bool BinaryReader::ReadString(std::string* value) {
+  uint32_t id = 0;
+  if (!Read(&id))
+    return false;
+  if (id >= strings_.size()) {
+    failed = true;
+    return false;
+  }
+  value->assign(strings_[id].first, strings_[id].second);
+  return true;
+}
+
+bool BinaryReader::ReadCount(uint32_t* count) {
+  // Every element takes at least one byte, so a count larger than the
+  // remaining data means the input is corrupted.
+  if (!Read(count) || *count > size_ - offset_) {
+    failed = true;
+    return false;
+  }
+  return true;
+}
+
+void Reflect(BinaryReader& visitor, int16_t& value) {
+  visitor.Read(&value);
+}
+void Reflect(BinaryWriter& visitor, int16_t& value) {
+  visitor.Write(value);
+}
+void Reflect(BinaryReader& visitor, int32_t& value) {
+  visitor.Read(&value);
+}
+void Reflect(BinaryWriter& visitor, int32_t& value) {
+  visitor.Write(value);
+}
+void Reflect(BinaryReader& visitor, int64_t& value) {
+  visitor.Read(&value);
+}
+void Reflect(BinaryWriter& visitor, int64_t& value) {
+  visitor.Write(value);
+}
+void Reflect(BinaryReader& visitor, uint64_t& value) {
+  visitor.Read(&value);
+}
+void Reflect(BinaryWriter& visitor, uint64_t& value) {
+  visitor.Write(value);
+}
+void Reflect(BinaryReader& visitor, bool& value) {
+  uint8_t byte = 0;
+  if (visitor.Read(&byte))
+    value = byte != 0;
+}
+void Reflect(BinaryWriter& visitor, bool& value) {
+  visitor.Write<uint8_t>(value ? 1 : 0);
+}
+void Reflect(BinaryReader& visitor, std::string& value) {
+  visitor.ReadString(&value);
+}
+void Reflect(BinaryWriter& visitor, std::string& value) {
+  visitor.Write(visitor.InternString(value));
+}
+
+// SerializeFormat
+void Reflect(Reader& visitor, SerializeFormat& value) {
+  if (!visitor.IsString())
+    return;
+  std::string name = visitor.GetString();
+  if (name == "json")
+    value = SerializeFormat::Json;
+  else if (name == "binary")
+    value = SerializeFormat::Binary;
+  else
+    LOG_S(WARNING) << "Unknown cache format " << name << "; using default";
+}
+void Reflect(Writer& visitor, SerializeFormat& value) {
+  switch (value) {
+    case SerializeFormat::Json:
+      visitor.String("json");
+      break;
+    case SerializeFormat::Binary:
+      visitor.String("binary");
+      break;
+  }
+}
+
+const char* SerializeFormatExtension(SerializeFormat format) {
+  switch (format) {
+    case SerializeFormat::Json:
+      return ".json";
+    case SerializeFormat::Binary:
+      return ".bin";
+  }
+  assert(false);
+  return ".json";
+}
+
 // TODO: Move this to indexer.cc
 void Reflect(Reader& visitor, IndexInclude& value) {
   REFLECT_MEMBER_START();
@@ -93,6 +275,17 @@ void Reflect(Writer& visitor, IndexInclude& value) {
   }
   REFLECT_MEMBER_END();
 }
+template <typename TVisitor>
+void ReflectBinaryIndexInclude(TVisitor& visitor, IndexInclude& value) {
+  Reflect(visitor, value.line);
+  Reflect(visitor, value.resolved_path);
+}
+void Reflect(BinaryReader& visitor, IndexInclude& value) {
+  ReflectBinaryIndexInclude(visitor, value);
+}
+void Reflect(BinaryWriter& visitor, IndexInclude& value) {
+  ReflectBinaryIndexInclude(visitor, value);
+}
 
 template <typename TVisitor>
 void Reflect(TVisitor& visitor, IndexType& value) {
@@ -152,23 +345,33 @@ void Reflect(TVisitor& visitor, IndexVar& value) {
 }
 
 // IndexFile
-bool ReflectMemberStart(Writer& visitor, IndexFile& value) {
-  auto it = value.id_cache.usr_to_type_id.find("");
-  if (it != value.id_cache.usr_to_type_id.end()) {
-    value.Resolve(it->second)->def.short_name = "<fundamental>";
-    assert(value.Resolve(it->second)->uses.size() == 0);
+namespace {
+void PrepareIndexFileForWrite(IndexFile& value) {
+  if (optional<IndexTypeId> id = value.id_cache.FindTypeId("")) {
+    value.Resolve(*id)->def.short_name = "<fundamental>";
+    assert(value.Resolve(*id)->uses.size() == 0);
   }
 
   value.version = IndexFile::kCurrentVersion;
+}
+}  // namespace
+
+bool ReflectMemberStart(Writer& visitor, IndexFile& value) {
+  PrepareIndexFileForWrite(value);
   DefaultReflectMemberStart(visitor);
   return true;
 }
+bool ReflectMemberStart(BinaryWriter& visitor, IndexFile& value) {
+  PrepareIndexFileForWrite(value);
+  return true;
+}
 template <typename TVisitor>
 void Reflect(TVisitor& visitor, IndexFile& value) {
   REFLECT_MEMBER_START();
   if (!gTestOutputMode) {
     REFLECT_MEMBER(version);
     REFLECT_MEMBER(last_modification_time);
+    REFLECT_MEMBER(content_hash);
     REFLECT_MEMBER(language);
     REFLECT_MEMBER(import_file);
     REFLECT_MEMBER(args);
@@ -183,59 +386,96 @@ void Reflect(TVisitor& visitor, IndexFile& value) {
   REFLECT_MEMBER_END();
 }
 
-std::string Serialize(IndexFile& file) {
-  rapidjson::StringBuffer output;
-  rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(output);
-  // Writer writer(output);
-  writer.SetFormatOptions(
-      rapidjson::PrettyFormatOptions::kFormatSingleLineArray);
-  writer.SetIndent(' ', 2);
+std::string Serialize(SerializeFormat format, IndexFile& file) {
+  switch (format) {
+    case SerializeFormat::Json: {
+      rapidjson::StringBuffer output;
+      rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(output);
+      // Writer writer(output);
+      writer.SetFormatOptions(
+          rapidjson::PrettyFormatOptions::kFormatSingleLineArray);
+      writer.SetIndent(' ', 2);
 
-  Reflect(writer, file);
+      Reflect(writer, file);
 
-  return output.GetString();
+      return output.GetString();
+    }
+    case SerializeFormat::Binary: {
+      BinaryWriter writer;
+      Reflect(writer, file);
+      return writer.Finish(IndexFile::kCurrentVersion);
+    }
+  }
+  assert(false);
+  return "";
 }
 
-std::unique_ptr<IndexFile> Deserialize(std::string path,
-                                       std::string serialized,
+std::unique_ptr<IndexFile> Deserialize(SerializeFormat format,
+                                       const std::string& path,
+                                       const char* serialized,
+                                       size_t size,
                                        optional<int> expected_version) {
-  rapidjson::Document reader;
-  reader.Parse(serialized.c_str());
-  if (reader.HasParseError())
-    return nullptr;
-
-  // Do not deserialize a document with a bad version. Doing so could cause a
-  // crash because the file format may have changed.
-  if (expected_version) {
-    auto actual_version = reader.FindMember("version");
-    if (actual_version == reader.MemberEnd() ||
-        actual_version->value.GetInt() != expected_version) {
-      return nullptr;
+  auto file = MakeUnique<IndexFile>(path);
+
+  switch (format) {
+    case SerializeFormat::Json: {
+      rapidjson::Document reader;
+      reader.Parse(serialized, size);
+      if (reader.HasParseError())
+        return nullptr;
+
+      // Do not deserialize a document with a bad version. Doing so could cause
+      // a crash because the file format may have changed.
+      if (expected_version) {
+        auto actual_version = reader.FindMember("version");
+        if (actual_version == reader.MemberEnd() ||
+            actual_version->value.GetInt() != expected_version) {
+          return nullptr;
+        }
+      }
+
+      Reflect(reader, *file);
+      break;
+    }
+    case SerializeFormat::Binary: {
+      // The version is stored in the header, so it is checked before any of
+      // the payload is decoded.
+      BinaryReader reader;
+      if (!reader.Start(serialized, size, expected_version))
+        return nullptr;
+      Reflect(reader, *file);
+      if (reader.failed) {
+        LOG_S(WARNING) << "Corrupted binary cache for " << path;
+        return nullptr;
+      }
+      break;
     }
   }
 
-  auto file = MakeUnique<IndexFile>(path);
-  Reflect(reader, *file);
-
   // Restore non-serialized state.
   file->path = path;
   file->id_cache.primary_file = file->path;
   for (const auto& type : file->types) {
-    file->id_cache.type_id_to_usr[type.id] = type.def.usr;
-    file->id_cache.usr_to_type_id[type.def.usr] = type.id;
+    file->id_cache.AddTypeId(type.def.usr, type.id);
   }
   for (const auto& func : file->funcs) {
-    file->id_cache.func_id_to_usr[func.id] = func.def.usr;
-    file->id_cache.usr_to_func_id[func.def.usr] = func.id;
+    file->id_cache.AddFuncId(func.def.usr, func.id);
   }
   for (const auto& var : file->vars) {
-    file->id_cache.var_id_to_usr[var.id] = var.def.usr;
-    file->id_cache.usr_to_var_id[var.def.usr] = var.id;
+    file->id_cache.AddVarId(var.def.usr, var.id);
   }
 
   return file;
 }
 
+std::unique_ptr<IndexFile> Deserialize(SerializeFormat format,
+                                       const std::string& path,
+                                       const std::string& serialized,
+                                       optional<int> expected_version) {
+  return Deserialize(format, path, serialized.data(), serialized.size(),
+                     expected_version);
+}
+
 void SetTestOutputMode() {
   gTestOutputMode = true;
 }
@@ -251,3 +491,118 @@ TEST_SUITE("Serializer utils") {
             "foobar/bar/");  // TODO: Should be bar, but good enough.
   }
 }
+
+namespace {
+std::unique_ptr<IndexFile> MakeSerializerTestFile(int symbol_count) {
+  auto file = MakeUnique<IndexFile>("foo.cc");
+  file->last_modification_time = 1234;
+  file->content_hash = 0xfedcba9876543210ULL;
+  file->language = LanguageId::Cpp;
+  file->import_file = "foo.cc";
+  file->args = {"clang", "-std=c++11"};
+  file->dependencies = {"foo.h", "bar.h"};
+  IndexInclude include;
+  include.line = 1;
+  include.resolved_path = "/foo.h";
+  file->includes.push_back(include);
+  file->skipped_by_preprocessor.push_back(
+      Range(Position(3, 1), Position(5, 7)));
+
+  for (int i = 0; i < symbol_count; ++i) {
+    std::string suffix = std::to_string(i);
+    IndexTypeId type_id = file->ToTypeId("c:@S@Type" + suffix);
+    IndexFuncId func_id = file->ToFuncId("c:@F@func" + suffix + "#");
+    IndexVarId var_id = file->ToVarId("c:@var" + suffix);
+    int16_t line = (int16_t)(i % 30000);
+
+    IndexType* type = file->Resolve(type_id);
+    type->def.short_name = "Type" + suffix;
+    type->def.detailed_name = "ns::Type" + suffix;
+    type->def.definition_spelling = Range(Position(line, 7));
+    type->def.funcs.push_back(func_id);
+    type->instances.push_back(var_id);
+    type->uses.push_back(Range(Position(line, 7)));
+
+    IndexFunc* func = file->Resolve(func_id);
+    func->def.short_name = "func" + suffix;
+    func->def.detailed_name = "void func" + suffix + "()";
+    func->def.declaring_type = type_id;
+    func->callers.push_back(IndexFuncRef(Range(Position(line, 3)), true));
+    func->callers.push_back(
+        IndexFuncRef(func_id, Range(Position(line, 4)), false));
+
+    IndexVar* var = file->Resolve(var_id);
+    var->def.short_name = "var" + suffix;
+    var->def.detailed_name = "int var" + suffix;
+    var->def.variable_type = type_id;
+    var->def.is_local = i % 2 == 0;
+    var->uses.push_back(Range(Position(line, 12)));
+  }
+  return file;
+}
+}  // namespace
+
+TEST_SUITE("Serializer binary") {
+  TEST_CASE("round trip") {
+    std::unique_ptr<IndexFile> file = MakeSerializerTestFile(10);
+    std::string expected = file->ToString();
+    std::string binary = Serialize(SerializeFormat::Binary, *file);
+
+    std::unique_ptr<IndexFile> result =
+        Deserialize(SerializeFormat::Binary, "foo.cc", binary,
+                    IndexFile::kCurrentVersion);
+    REQUIRE(result);
+    REQUIRE(result->ToString() == expected);
+    REQUIRE(result->last_modification_time == 1234);
+    REQUIRE(result->content_hash == 0xfedcba9876543210ULL);
+    REQUIRE(result->import_file == "foo.cc");
+    REQUIRE(result->dependencies == file->dependencies);
+    REQUIRE(result->funcs[0].callers[0].id.id == static_cast<RawId>(-1));
+    REQUIRE(result->id_cache.FindFuncId("c:@F@func3#")->id == 3);
+  }
+
+  TEST_CASE("rejects bad input") {
+    std::unique_ptr<IndexFile> file = MakeSerializerTestFile(3);
+    std::string binary = Serialize(SerializeFormat::Binary, *file);
+
+    // Wrong version.
+    REQUIRE(!Deserialize(SerializeFormat::Binary, "foo.cc", binary,
+                         IndexFile::kCurrentVersion + 1));
+    // Truncated input.
+    for (size_t size : {size_t(0), size_t(3), binary.size() / 2,
+                        binary.size() - 1}) {
+      REQUIRE(!Deserialize(SerializeFormat::Binary, "foo.cc", binary.data(),
+                           size, nullopt));
+    }
+    // Json is not binary.
+    REQUIRE(!Deserialize(SerializeFormat::Binary, "foo.cc", file->ToString(),
+                         nullopt));
+  }
+
+  TEST_CASE("large index loads from json and binary") {
+    std::unique_ptr<IndexFile> file = MakeSerializerTestFile(2000);
+    std::string expected = file->ToString();
+    // The load times are only logged; they vary too much between machines to
+    // be compared. Best of a few runs, so a single slow run is not reported.
+    const int kRuns = 3;
+    SerializeFormat formats[2] = {SerializeFormat::Json,
+                                  SerializeFormat::Binary};
+    for (SerializeFormat format : formats) {
+      std::string serialized = Serialize(format, *file);
+      long long best = 0;
+      for (int run = 0; run < kRuns; ++run) {
+        Timer timer;
+        std::unique_ptr<IndexFile> result =
+            Deserialize(format, "foo.cc", serialized, nullopt);
+        long long elapsed = timer.ElapsedMicroseconds();
+        REQUIRE(result);
+        REQUIRE(result->ToString() == expected);
+        if (run == 0 || elapsed < best)
+          best = elapsed;
+      }
+      LOG_S(INFO) << "Loading " << serialized.size() << " bytes of "
+                  << SerializeFormatExtension(format) << " took "
+                  << FormatMicroseconds(best);
+    }
+  }
+}
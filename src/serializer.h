@@ -5,8 +5,11 @@
 #include <rapidjson/document.h>
 #include <rapidjson/prettywriter.h>
 
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 using std::experimental::nullopt;
@@ -16,6 +19,10 @@ using Reader = rapidjson::GenericValue<rapidjson::UTF8<>>;
 using Writer = rapidjson::Writer<rapidjson::StringBuffer>;
 struct IndexFile;
 
+// On-disk format used for cached indexes. Json is human readable and is what
+// the index tests use; Binary is much faster to load.
+enum class SerializeFormat { Json, Binary };
+
 #define REFLECT_MEMBER_START()             \
   if (!ReflectMemberStart(visitor, value)) \
   return
@@ -200,9 +207,205 @@ void ReflectMember(Reader& visitor, const char* name, T& value) {
   }
 }
 
-std::string Serialize(IndexFile& file);
-std::unique_ptr<IndexFile> Deserialize(std::string path,
-                                       std::string serialized,
+// Binary:
+//
+// The binary format is a flat, length-prefixed encoding of the same data the
+// json format contains. All integers are fixed-width and stored in host
+// (little-endian) byte order, ids are stored as 32-bit values and every string
+// is stored once in a string table and referenced by index. The format is
+// decoded directly from a memory buffer (ie, a mmap'd file) without building
+// an intermediate DOM.
+//
+// Layout:
+//   char[4]  magic ("CQBI")
+//   uint32   binary layout version (kBinaryFormatVersion)
+//   int32    IndexFile::kCurrentVersion
+//   uint32   string count
+//   ...      strings (uint32 length followed by bytes)
+//   ...      payload
+struct BinaryWriter {
+  // Returns the string table index for |value|, adding it if needed.
+  uint32_t InternString(const std::string& value);
+
+  template <typename T>
+  void Write(T value) {
+    payload.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  // Returns the final serialized output (header, string table and payload).
+  std::string Finish(int index_version);
+
+  std::unordered_map<std::string, uint32_t> string_ids;
+  std::vector<const std::string*> strings;
+  std::string payload;
+};
+
+struct BinaryReader {
+  // Reads the header and string table. Returns false if the data is invalid
+  // or was written with a different |expected_index_version|.
+  bool Start(const char* data,
+             size_t size,
+             optional<int> expected_index_version);
+
+  // Reads a fixed-width value. Marks the reader as failed on overflow.
+  template <typename T>
+  bool Read(T* value) {
+    if (failed || size_ - offset_ < sizeof(T)) {
+      failed = true;
+      return false;
+    }
+    memcpy(value, data_ + offset_, sizeof(T));
+    offset_ += sizeof(T);
+    return true;
+  }
+
+  bool ReadString(std::string* value);
+
+  // Reads a 32-bit element count. The count is validated against the
+  // remaining data so a corrupted count cannot cause a huge allocation.
+  bool ReadCount(uint32_t* count);
+
+  bool failed = false;
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t offset_ = 0;
+  std::vector<std::pair<const char*, uint32_t>> strings_;
+};
+
+void Reflect(BinaryReader& visitor, int16_t& value);
+void Reflect(BinaryWriter& visitor, int16_t& value);
+void Reflect(BinaryReader& visitor, int32_t& value);
+void Reflect(BinaryWriter& visitor, int32_t& value);
+void Reflect(BinaryReader& visitor, int64_t& value);
+void Reflect(BinaryWriter& visitor, int64_t& value);
+void Reflect(BinaryReader& visitor, uint64_t& value);
+void Reflect(BinaryWriter& visitor, uint64_t& value);
+void Reflect(BinaryReader& visitor, bool& value);
+void Reflect(BinaryWriter& visitor, bool& value);
+void Reflect(BinaryReader& visitor, std::string& value);
+void Reflect(BinaryWriter& visitor, std::string& value);
+
+template <typename T>
+void Reflect(BinaryWriter& visitor, std::vector<T>& values) {
+  visitor.Write<uint32_t>((uint32_t)values.size());
+  for (auto& value : values)
+    Reflect(visitor, value);
+}
+template <typename T>
+void Reflect(BinaryReader& visitor, std::vector<T>& values) {
+  uint32_t count = 0;
+  if (!visitor.ReadCount(&count))
+    return;
+  values.reserve(values.size() + count);
+  for (uint32_t i = 0; i < count && !visitor.failed; ++i) {
+    T entry_value{};
+    Reflect(visitor, entry_value);
+    values.push_back(entry_value);
+  }
+}
+template <typename T>
+void Reflect(BinaryWriter& visitor, optional<T>& value) {
+  visitor.Write<uint8_t>(value ? 1 : 0);
+  if (value)
+    Reflect(visitor, value.value());
+}
+template <typename T>
+void Reflect(BinaryReader& visitor, optional<T>& value) {
+  uint8_t has_value = 0;
+  if (!visitor.Read(&has_value) || !has_value)
+    return;
+  T real_value{};
+  Reflect(visitor, real_value);
+  value = real_value;
+}
+inline void DefaultReflectMemberStart(BinaryWriter& visitor) {}
+inline void DefaultReflectMemberStart(BinaryReader& visitor) {}
+template <typename T>
+bool ReflectMemberStart(BinaryWriter& visitor, T& value) {
+  return true;
+}
+template <typename T>
+bool ReflectMemberStart(BinaryReader& visitor, T& value) {
+  return !visitor.failed;
+}
+template <typename T>
+void ReflectMemberEnd(BinaryWriter& visitor, T& value) {}
+template <typename T>
+void ReflectMemberEnd(BinaryReader& visitor, T& value) {}
+// Members are stored positionally, so the name is not used. Unlike the json
+// writer, empty values are never elided.
+template <typename T>
+void ReflectMember(BinaryWriter& visitor, const char* name, T& value) {
+  Reflect(visitor, value);
+}
+template <typename T>
+void ReflectMember(BinaryReader& visitor, const char* name, T& value) {
+  Reflect(visitor, value);
+}
+
+void Reflect(Reader& visitor, SerializeFormat& value);
+void Reflect(Writer& visitor, SerializeFormat& value);
+
+// Returns the file extension used for caches in |format|, ie, ".json".
+const char* SerializeFormatExtension(SerializeFormat format);
+
+std::string Serialize(SerializeFormat format, IndexFile& file);
+std::unique_ptr<IndexFile> Deserialize(SerializeFormat format,
+                                       const std::string& path,
+                                       const char* serialized,
+                                       size_t size,
+                                       optional<int> expected_version);
+std::unique_ptr<IndexFile> Deserialize(SerializeFormat format,
+                                       const std::string& path,
+                                       const std::string& serialized,
                                        optional<int> expected_version);
 
+// Serializes a small standalone value, ie, cache metadata, in |format|. For
+// the binary format |version| is stored in the header and checked by
+// DeserializeValue; json values should carry their own version member.
+template <typename T>
+std::string SerializeValue(SerializeFormat format, int version, T& value) {
+  switch (format) {
+    case SerializeFormat::Json: {
+      rapidjson::StringBuffer output;
+      Writer writer(output);
+      Reflect(writer, value);
+      return output.GetString();
+    }
+    case SerializeFormat::Binary: {
+      BinaryWriter writer;
+      Reflect(writer, value);
+      return writer.Finish(version);
+    }
+  }
+  return "";
+}
+template <typename T>
+bool DeserializeValue(SerializeFormat format,
+                      const char* serialized,
+                      size_t size,
+                      int version,
+                      T* value) {
+  switch (format) {
+    case SerializeFormat::Json: {
+      rapidjson::Document reader;
+      reader.Parse(serialized, size);
+      if (reader.HasParseError() || !reader.IsObject())
+        return false;
+      Reflect(reader, *value);
+      return true;
+    }
+    case SerializeFormat::Binary: {
+      BinaryReader reader;
+      if (!reader.Start(serialized, size, version))
+        return false;
+      Reflect(reader, *value);
+      return !reader.failed;
+    }
+  }
+  return false;
+}
+
 void SetTestOutputMode();
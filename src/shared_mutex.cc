@@ -0,0 +1,110 @@
+#include "shared_mutex.h"
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+void SharedMutex::lock() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ++waiting_writers_;
+  cv_.wait(lock, [this]() {
+    return !writer_ && readers_ == 0 && !readers_turn_;
+  });
+  --waiting_writers_;
+  writer_ = true;
+}
+
+void SharedMutex::unlock() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writer_ = false;
+    readers_turn_ = waiting_readers_ > 0;
+  }
+  cv_.notify_all();
+}
+
+void SharedMutex::lock_shared() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ++waiting_readers_;
+  cv_.wait(lock, [this]() {
+    return !writer_ && (waiting_writers_ == 0 || readers_turn_);
+  });
+  --waiting_readers_;
+  ++readers_;
+  if (waiting_readers_ == 0)
+    readers_turn_ = false;
+}
+
+void SharedMutex::unlock_shared() {
+  bool notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    notify = --readers_ == 0;
+  }
+  if (notify)
+    cv_.notify_all();
+}
+
+int SharedMutex::waiting_readers() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return waiting_readers_;
+}
+
+TEST_SUITE("SharedMutex") {
+  TEST_CASE("readers share the lock") {
+    SharedMutex mutex;
+    SharedLock a(mutex);
+    // A second reader does not block while the first one holds the lock.
+    SharedLock b(mutex);
+  }
+
+  TEST_CASE("writers exclude readers") {
+    SharedMutex mutex;
+    int value = 0;
+    std::atomic<bool> torn(false);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+      threads.emplace_back([&]() {
+        for (int j = 0; j < 1000; ++j) {
+          std::lock_guard<SharedMutex> lock(mutex);
+          ++value;
+          ++value;
+        }
+      });
+      threads.emplace_back([&]() {
+        for (int j = 0; j < 1000; ++j) {
+          SharedLock lock(mutex);
+          if (value % 2 != 0)
+            torn = true;
+        }
+      });
+    }
+    for (std::thread& thread : threads)
+      thread.join();
+
+    REQUIRE(value == 8000);
+    REQUIRE(!torn);
+  }
+
+  TEST_CASE("waiting readers go before the next writer") {
+    SharedMutex mutex;
+    std::atomic<bool> did_read(false);
+
+    mutex.lock();
+    std::thread reader([&]() {
+      SharedLock lock(mutex);
+      did_read = true;
+    });
+    // Wait until the reader is blocked on the lock.
+    while (mutex.waiting_readers() == 0)
+      std::this_thread::yield();
+    mutex.unlock();
+    mutex.lock();
+    REQUIRE(did_read);
+    mutex.unlock();
+    reader.join();
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+
+// A reader-writer lock. Any number of threads can hold it shared, or a single
+// thread can hold it exclusively. Waiting writers take precedence over new
+// readers, so a steady stream of reads cannot starve a writer. Readers which
+// are waiting when a writer releases the lock get it before the next writer,
+// so a writer which locks repeatedly cannot starve readers either.
+//
+// lock()/unlock() make this usable with std::lock_guard; use SharedLock to
+// hold it shared.
+struct SharedMutex {
+  void lock();
+  void unlock();
+
+  void lock_shared();
+  void unlock_shared();
+
+  // Returns the number of threads blocked in lock_shared(). For tests.
+  int waiting_readers();
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  int readers_ = 0;
+  int waiting_readers_ = 0;
+  int waiting_writers_ = 0;
+  bool writer_ = false;
+  // True after a writer released the lock while readers were waiting, until
+  // they have all acquired it.
+  bool readers_turn_ = false;
+};
+
+// Holds a SharedMutex shared for the lifetime of the object.
+struct SharedLock {
+  explicit SharedLock(SharedMutex& mutex) : mutex_(mutex) {
+    mutex_.lock_shared();
+  }
+  ~SharedLock() { mutex_.unlock_shared(); }
+
+  SharedLock(const SharedLock&) = delete;
+  SharedLock& operator=(const SharedLock&) = delete;
+
+ private:
+  SharedMutex& mutex_;
+};
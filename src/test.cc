@@ -74,12 +74,16 @@ void DiffDocuments(std::string path,
 
 void VerifySerializeToFrom(IndexFile* file) {
   std::string expected = file->ToString();
-  std::unique_ptr<IndexFile> result =
-      Deserialize("--.cc", Serialize(*file), nullopt /*expected_version*/);
-  std::string actual = result->ToString();
-  if (expected != actual) {
-    std::cerr << "Serialization failure" << std::endl;
-    assert(false);
+  for (SerializeFormat format :
+       {SerializeFormat::Json, SerializeFormat::Binary}) {
+    std::unique_ptr<IndexFile> result =
+        Deserialize(format, "--.cc", Serialize(format, *file),
+                    nullopt /*expected_version*/);
+    std::string actual = result ? result->ToString() : "";
+    if (expected != actual) {
+      std::cerr << "Serialization failure" << std::endl;
+      assert(false);
+    }
   }
 }
 
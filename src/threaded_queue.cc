@@ -0,0 +1,177 @@
+#include "threaded_queue.h"
+
+#include "utils.h"
+
+#include <doctest/doctest.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+bool MultiQueueWaiter::HasState(
+    std::initializer_list<BaseThreadQueue*> queues) {
+  for (BaseThreadQueue* queue : queues) {
+    if (!queue->IsEmpty())
+      return true;
+  }
+  return false;
+}
+
+void MultiQueueWaiter::Notify() {
+  // Acquire the mutex so that a waiter cannot check the queues, miss this
+  // update, and then start waiting after the notification has been sent.
+  std::lock_guard<std::mutex> lock(mutex_);
+  cv_.notify_all();
+}
+
+void MultiQueueWaiter::Wait(std::initializer_list<BaseThreadQueue*> queues) {
+  WaitUntil([&]() {
+    return HasState(queues) || WorkThread::request_exit_on_idle;
+  });
+}
+
+TEST_SUITE("MultiQueueWaiter") {
+  // Wait() never times out, so a lost wakeup shows up as a thread which never
+  // finishes. The threads only use state owned by |shared| so they can be
+  // abandoned if that happens.
+  const std::chrono::seconds kDeadline(60);
+
+  TEST_CASE("ping pong") {
+    struct Shared {
+      MultiQueueWaiter waiter;
+      ThreadedQueue<int> ping{&waiter};
+      ThreadedQueue<int> pong{&waiter};
+    };
+    auto shared = std::make_shared<Shared>();
+    const int kRounds = 20000;
+
+    // Every round requires each thread to be woken up by the other one.
+    auto bounce = [shared, kRounds](ThreadedQueue<int>* from,
+                                    ThreadedQueue<int>* to,
+                                    std::promise<int> done) {
+      int last = 0;
+      while (last < kRounds) {
+        optional<int> value = from->TryDequeue();
+        if (!value) {
+          shared->waiter.Wait({from});
+          continue;
+        }
+        last = *value;
+        to->Enqueue(last + 1);
+      }
+      done.set_value(last);
+    };
+
+    std::promise<int> ping_done, pong_done;
+    std::future<int> ping_result = ping_done.get_future();
+    std::future<int> pong_result = pong_done.get_future();
+    std::thread(bounce, &shared->ping, &shared->pong, std::move(ping_done))
+        .detach();
+    std::thread(bounce, &shared->pong, &shared->ping, std::move(pong_done))
+        .detach();
+    shared->ping.Enqueue(1);
+
+    REQUIRE(ping_result.wait_for(kDeadline) == std::future_status::ready);
+    REQUIRE(pong_result.wait_for(kDeadline) == std::future_status::ready);
+    REQUIRE(ping_result.get() >= kRounds);
+    REQUIRE(pong_result.get() >= kRounds);
+  }
+
+  TEST_CASE("many producers and consumers") {
+    struct Shared {
+      MultiQueueWaiter waiter;
+      ThreadedQueue<int> a{&waiter};
+      ThreadedQueue<int> b{&waiter};
+      std::atomic<int> consumed{0};
+    };
+    auto shared = std::make_shared<Shared>();
+    const int kProducers = 4;
+    const int kConsumers = 4;
+    const int kItemsPerProducer = 20000;
+    const int kTotal = kProducers * kItemsPerProducer;
+
+    // Producers enqueue one element at a time, alternating between queues,
+    // which maximizes the number of notifications that can race with a
+    // consumer going to sleep.
+    for (int i = 0; i < kProducers; ++i) {
+      std::thread([shared, kItemsPerProducer]() {
+        for (int j = 0; j < kItemsPerProducer; ++j) {
+          if (j % 2 == 0)
+            shared->a.Enqueue(1);
+          else
+            shared->b.Enqueue(1);
+        }
+      }).detach();
+    }
+
+    std::vector<std::future<void>> consumers;
+    for (int i = 0; i < kConsumers; ++i) {
+      std::promise<void> done;
+      consumers.push_back(done.get_future());
+      std::thread(
+          [shared, kTotal](std::promise<void> done) {
+            while (true) {
+              optional<int> value = shared->a.TryDequeue();
+              if (!value)
+                value = shared->b.TryDequeue();
+              if (!value) {
+                shared->waiter.Wait({&shared->a, &shared->b});
+                continue;
+              }
+              // 0 marks the end. Put it back so it also wakes up the
+              // consumers which are still waiting.
+              if (*value == 0) {
+                shared->a.Enqueue(0);
+                break;
+              }
+              if (++shared->consumed == kTotal)
+                shared->a.Enqueue(0);
+            }
+            done.set_value();
+          },
+          std::move(done))
+          .detach();
+    }
+
+    for (std::future<void>& consumer : consumers)
+      REQUIRE(consumer.wait_for(kDeadline) == std::future_status::ready);
+    REQUIRE(shared->consumed == kTotal);
+  }
+}
+
+TEST_SUITE("PriorityThreadedQueue") {
+  TEST_CASE("dequeues by level, then in insertion order") {
+    MultiQueueWaiter waiter;
+    PriorityThreadedQueue<int> queue(&waiter, 3);
+    queue.Enqueue(2, 20);
+    queue.Enqueue(0, 0);
+    queue.Enqueue(1, 10);
+    queue.Enqueue(0, 1);
+    // Out of range levels are clamped.
+    queue.Enqueue(5, 21);
+    REQUIRE(queue.Size() == 5);
+
+    std::vector<int> order;
+    while (optional<int> value = queue.TryDequeue())
+      order.push_back(*value);
+    REQUIRE(order == std::vector<int>({0, 1, 10, 20, 21}));
+    REQUIRE(queue.IsEmpty());
+  }
+
+  TEST_CASE("reprioritize") {
+    MultiQueueWaiter waiter;
+    PriorityThreadedQueue<int> queue(&waiter, 3);
+    for (int i = 0; i < 6; ++i)
+      queue.Enqueue(2, int(i));
+
+    // Promote odd elements.
+    queue.Reprioritize([](int value) { return value % 2 ? 0 : 2; });
+
+    std::vector<int> order;
+    while (optional<int> value = queue.TryDequeue())
+      order.push_back(*value);
+    REQUIRE(order == std::vector<int>({1, 3, 5, 0, 2, 4}));
+  }
+}
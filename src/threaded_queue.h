@@ -1,13 +1,17 @@
 #pragma once
 
 #include <optional.h>
+#include "utils.h"
 #include "work_thread.h"
 
 #include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <queue>
+#include <vector>
 
 using std::experimental::nullopt;
 using std::experimental::optional;
@@ -19,39 +23,37 @@ struct BaseThreadQueue {
   virtual ~BaseThreadQueue() = default;
 };
 
+// Blocks until one of a set of queues has data. Every queue sharing the waiter
+// calls Notify() after it has been modified.
+//
+// We cannot have a single condition variable wait on all of the different
+// queue mutexes, so waiting happens on the waiter's own mutex instead. Queue
+// sizes can be read without a lock, and Notify() acquires the waiter mutex
+// before signaling, so a notification either happens before a waiter checks
+// the queues (and the waiter sees the data) or after it has started to wait
+// (and the waiter is woken up). Notifications are never lost.
 struct MultiQueueWaiter {
-  std::mutex m;
-  std::condition_variable cv;
+  bool HasState(std::initializer_list<BaseThreadQueue*> queues);
 
-  bool HasState(std::initializer_list<BaseThreadQueue*> queues) {
-    for (BaseThreadQueue* queue : queues) {
-      if (!queue->IsEmpty())
-        return true;
-    }
-    return false;
-  }
+  // Wakes up every waiting thread. Call this after adding data to a queue, or
+  // after setting WorkThread::request_exit_on_idle.
+  void Notify();
 
-  void Wait(std::initializer_list<BaseThreadQueue*> queues) {
-    // We cannot have a single condition variable wait on all of the different
-    // mutexes, so we have a global condition variable that every queue will
-    // notify. After it is notified we check to see if any of the queues have
-    // data; if they do, we return.
-    //
-    // We repoll every 5 seconds because it's not possible to atomically check
-    // the state of every queue and then setup the condition variable. So, if
-    // Wait() is called, HasState() returns false, and then in the time after
-    // HasState() is called data gets posted but before we begin waiting for
-    // the condition variable, we will miss the notification. The timeout of 5
-    // means that if this happens we will delay operation for 5 seconds.
-    //
-    // If we're trying to exit (WorkThread::request_exit_on_idle), do not
-    // bother waiting.
-
-    while (!HasState(queues) && !WorkThread::request_exit_on_idle) {
-      std::unique_lock<std::mutex> l(m);
-      cv.wait_for(l, std::chrono::seconds(5));
-    }
+  // Returns once one of |queues| is not empty. If we're trying to exit
+  // (WorkThread::request_exit_on_idle), do not bother waiting.
+  void Wait(std::initializer_list<BaseThreadQueue*> queues);
+
+  // Returns once |predicate| is true. |predicate| is called with the waiter
+  // mutex held, so it must only read state which is followed by a Notify().
+  template <typename TPredicate>
+  void WaitUntil(TPredicate predicate) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, predicate);
   }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
 };
 
 // A threadsafe-queue. http://stackoverflow.com/a/16075550
@@ -71,32 +73,38 @@ struct ThreadedQueue : public BaseThreadQueue {
 
   // Add an element to the front of the queue.
   void PriorityEnqueue(T&& t) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    priority_.push(std::move(t));
-    ++total_count_;
-    waiter_->cv.notify_all();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      priority_.push(std::move(t));
+      ++total_count_;
+    }
+    waiter_->Notify();
   }
 
   // Add an element to the queue.
   void Enqueue(T&& t) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.push(std::move(t));
-    ++total_count_;
-    waiter_->cv.notify_all();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push(std::move(t));
+      ++total_count_;
+    }
+    waiter_->Notify();
   }
 
   // Add a set of elements to the queue.
   void EnqueueAll(std::vector<T>&& elements) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
 
-    total_count_ += elements.size();
+      total_count_ += elements.size();
 
-    for (T& element : elements) {
-      queue_.push(std::move(element));
+      for (T& element : elements) {
+        queue_.push(std::move(element));
+      }
+      elements.clear();
     }
-    elements.clear();
 
-    waiter_->cv.notify_all();
+    waiter_->Notify();
   }
 
   // Return all elements in the queue.
@@ -122,29 +130,17 @@ struct ThreadedQueue : public BaseThreadQueue {
   // Returns true if the queue is empty. This is lock-free.
   bool IsEmpty() { return total_count_ == 0; }
 
-  // TODO: Unify code between DequeuePlusAction with TryDequeuePlusAction.
-  // Probably have opt<T> Dequeue(bool wait_for_element);
-
   // Get the first element from the queue. Blocks until one is available.
   // Executes |action| with an acquired |mutex_|.
   template <typename TAction>
   T DequeuePlusAction(TAction action) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    waiter_->cv.wait(lock,
-                     [&]() { return !priority_.empty() || !queue_.empty(); });
-
-    auto execute = [&](std::queue<T>* q) {
-      auto val = std::move(q->front());
-      q->pop();
-      --total_count_;
-
-      action();
-
-      return std::move(val);
-    };
-    if (!priority_.empty())
-      return execute(&priority_);
-    return execute(&queue_);
+    while (true) {
+      optional<T> result = TryDequeuePlusAction([&](const T&) { action(); });
+      if (result)
+        return std::move(*result);
+      // Another consumer may take the element first, so check again.
+      waiter_->WaitUntil([this]() { return !IsEmpty(); });
+    }
   }
 
   // Get the first element from the queue. Blocks until one is available.
@@ -186,3 +182,73 @@ struct ThreadedQueue : public BaseThreadQueue {
   MultiQueueWaiter* waiter_;
   std::unique_ptr<MultiQueueWaiter> owned_waiter_;
 };
+
+// A threadsafe queue with a fixed number of priority levels. Elements are
+// dequeued from the highest priority (lowest numbered) level first, and in
+// insertion order within a level. The priority of queued elements can be
+// changed in place with Reprioritize().
+template <class T>
+struct PriorityThreadedQueue : public BaseThreadQueue {
+ public:
+  PriorityThreadedQueue(MultiQueueWaiter* waiter, int num_levels)
+      : total_count_(0), levels_(num_levels), waiter_(waiter) {
+    assert(num_levels > 0);
+  }
+
+  // Returns the number of elements in the queue. This is lock-free.
+  size_t Size() const { return total_count_; }
+
+  // Returns true if the queue is empty. This is lock-free.
+  bool IsEmpty() override { return total_count_ == 0; }
+
+  // Add an element to the back of |level|.
+  void Enqueue(int level, T&& t) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      levels_[ClampLevel(level)].push_back(std::move(t));
+      ++total_count_;
+    }
+    waiter_->Notify();
+  }
+
+  // Moves every element to the level returned by |get_level|. Elements keep
+  // their relative order if they stay in the same level. |get_level| is
+  // called with the queue mutex held.
+  template <typename TGetLevel>
+  void Reprioritize(TGetLevel get_level) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::deque<T>> levels(levels_.size());
+    for (std::deque<T>& level : levels_) {
+      for (T& element : level) {
+        int new_level = ClampLevel(get_level(static_cast<const T&>(element)));
+        levels[new_level].push_back(std::move(element));
+      }
+    }
+    levels_ = std::move(levels);
+  }
+
+  // Get the first element of the highest priority level without blocking.
+  // Returns a null value if the queue is empty.
+  optional<T> TryDequeue() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::deque<T>& level : levels_) {
+      if (level.empty())
+        continue;
+      optional<T> result(std::move(level.front()));
+      level.pop_front();
+      --total_count_;
+      return result;
+    }
+    return nullopt;
+  }
+
+ private:
+  int ClampLevel(int level) const {
+    return std::max(0, std::min(level, static_cast<int>(levels_.size()) - 1));
+  }
+
+  std::atomic<int> total_count_;
+  mutable std::mutex mutex_;
+  std::vector<std::deque<T>> levels_;
+  MultiQueueWaiter* waiter_;
+};
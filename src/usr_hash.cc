@@ -0,0 +1,40 @@
+#include "usr_hash.h"
+
+#include "utils.h"
+
+#include <doctest/doctest.h>
+
+#include <unordered_map>
+
+UsrHash HashUsr(const std::string& usr) {
+  return HashContent(usr);
+}
+
+TEST_SUITE("UsrHash") {
+  TEST_CASE("resolves collisions") {
+    std::unordered_map<UsrHash, std::string> map;
+    auto usr_of = [](const std::string& value) -> const std::string& {
+      return value;
+    };
+    auto insert = [&](const std::string& usr, UsrHash hash) {
+      UsrHash key = 0;
+      REQUIRE(!FindUsr(map, usr, hash, usr_of, &key));
+      map[key] = usr;
+      return key;
+    };
+
+    // Three usrs with the same hash, and one which hashes to a key that is
+    // already taken by one of them.
+    REQUIRE(insert("a", 10) == 10);
+    REQUIRE(insert("b", 10) == 11);
+    REQUIRE(insert("c", 11) == 12);
+    REQUIRE(insert("d", 10) == 13);
+
+    REQUIRE(*FindUsr(map, "a", 10, usr_of) == "a");
+    REQUIRE(*FindUsr(map, "b", 10, usr_of) == "b");
+    REQUIRE(*FindUsr(map, "c", 11, usr_of) == "c");
+    REQUIRE(*FindUsr(map, "d", 10, usr_of) == "d");
+    REQUIRE(!FindUsr(map, "e", 10, usr_of));
+    REQUIRE(!FindUsr(map, "a", 20, usr_of));
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Usrs are long, especially for templates, and there are millions of them in
+// a large project, so maps from usr to id are keyed by a 64-bit hash of the
+// usr instead of the usr itself. The usr is kept once, next to the id.
+//
+// If two usrs hash to the same value, the one inserted later is stored under
+// the next key which is not taken; lookups probe keys the same way until they
+// find the usr or a key which is not in the map. Nothing is ever erased from
+// these maps, so a probe sequence is never interrupted.
+using UsrHash = uint64_t;
+
+UsrHash HashUsr(const std::string& usr);
+
+// Looks up |usr| in |map|, a map keyed by UsrHash. |hash| is HashUsr(usr) and
+// |usr_of| returns the usr of a mapped value. Returns nullptr if |usr| is not
+// in |map|; |insert_key| is then set to the key to insert it under.
+template <typename TMap, typename TUsrOf>
+const typename TMap::mapped_type* FindUsr(const TMap& map,
+                                          const std::string& usr,
+                                          UsrHash hash,
+                                          TUsrOf usr_of,
+                                          UsrHash* insert_key = nullptr) {
+  for (UsrHash key = hash;; ++key) {
+    auto it = map.find(key);
+    if (it == map.end()) {
+      if (insert_key)
+        *insert_key = key;
+      return nullptr;
+    }
+    if (usr_of(it->second) == usr)
+      return &it->second;
+  }
+}
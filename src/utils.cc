@@ -6,12 +6,16 @@
 #include <loguru/loguru.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <locale>
+#include <random>
 #include <sstream>
 #include <unordered_map>
 
@@ -355,6 +359,40 @@ void WriteToFile(const std::string& filename, const std::string& content) {
   file << content;
 }
 
+namespace {
+
+// Returns a temporary file name next to |path| which no other write, in this
+// process or another one sharing the cache directory, is using. Entries such
+// as blobs are shared by many files, so they can be written concurrently.
+std::string GetUniqueTempPath(const std::string& path) {
+  static const uint32_t process_token = std::random_device()();
+  static std::atomic<uint64_t> counter(0);
+  return path + "." + std::to_string(process_token) + "." +
+         std::to_string(counter++) + ".tmp";
+}
+
+}  // namespace
+
+bool WriteFileAtomically(const std::string& path, const std::string& content) {
+  std::string temp_path = GetUniqueTempPath(path);
+  {
+    std::ofstream output(temp_path,
+                         std::ios::out | std::ios::binary | std::ios::trunc);
+    output << content;
+    if (!output.good()) {
+      LOG_S(ERROR) << "Unable to write " << temp_path;
+      return false;
+    }
+  }
+
+  if (!MoveFileTo(path, temp_path)) {
+    LOG_S(ERROR) << "Unable to move " << temp_path << " to " << path;
+    std::remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
 float GetProcessMemoryUsedInMb() {
 #if defined(__APPLE__)
   return 0.f;
@@ -365,6 +403,63 @@ float GetProcessMemoryUsedInMb() {
 #endif
 }
 
+// MurmurHash64A, see https://github.com/aappleby/smhasher.
+uint64_t HashContent(const char* content, size_t size) {
+  const uint64_t kMultiplier = 0xc6a4a7935bd1e995ULL;
+  const int kShift = 47;
+  const uint64_t kSeed = 0x2f693a0c7e5b4d31ULL;
+
+  uint64_t h = kSeed ^ (size * kMultiplier);
+  const char* end = content + (size / 8) * 8;
+  for (const char* it = content; it != end; it += 8) {
+    uint64_t k;
+    memcpy(&k, it, sizeof(k));
+    k *= kMultiplier;
+    k ^= k >> kShift;
+    k *= kMultiplier;
+    h ^= k;
+    h *= kMultiplier;
+  }
+
+  const unsigned char* tail = reinterpret_cast<const unsigned char*>(end);
+  switch (size & 7) {
+    case 7:
+      h ^= uint64_t(tail[6]) << 48;
+    case 6:
+      h ^= uint64_t(tail[5]) << 40;
+    case 5:
+      h ^= uint64_t(tail[4]) << 32;
+    case 4:
+      h ^= uint64_t(tail[3]) << 24;
+    case 3:
+      h ^= uint64_t(tail[2]) << 16;
+    case 2:
+      h ^= uint64_t(tail[1]) << 8;
+    case 1:
+      h ^= uint64_t(tail[0]);
+      h *= kMultiplier;
+  }
+
+  h ^= h >> kShift;
+  h *= kMultiplier;
+  h ^= h >> kShift;
+  return h;
+}
+
+uint64_t HashContent(const std::string& content) {
+  return HashContent(content.data(), content.size());
+}
+
+optional<uint64_t> HashFileContent(const std::string& path) {
+  // Binary, so line endings are hashed as clang reads them.
+  std::ifstream input(path, std::ios::binary);
+  if (!input.good())
+    return nullopt;
+  std::string content((std::istreambuf_iterator<char>(input)),
+                      std::istreambuf_iterator<char>());
+  return HashContent(content);
+}
+
 std::string FormatMicroseconds(long long microseconds) {
   long long milliseconds = microseconds / 1000;
   long long remaining = microseconds - milliseconds;
@@ -3,6 +3,7 @@
 #include <optional.h>
 
 #include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <queue>
@@ -83,6 +84,10 @@ void UpdateTestExpectation(const std::string& filename,
 void Fail(const std::string& message);
 
 void WriteToFile(const std::string& filename, const std::string& content);
+// Writes |content| to a temporary file which is then renamed to |path|, so that
+// a reader never observes a partially written file. Concurrent writes of the
+// same |path| are safe; the last rename wins.
+bool WriteFileAtomically(const std::string& path, const std::string& content);
 
 // note: this implementation does not disable this overload for array types
 // See
@@ -158,4 +163,12 @@ inline void hash_combine(std::size_t& seed, const T& v, Rest... rest) {
 
 float GetProcessMemoryUsedInMb();
 
+// Returns a fast, non-cryptographic 64-bit hash of |content|. Used to detect
+// if file contents have changed.
+uint64_t HashContent(const char* content, size_t size);
+uint64_t HashContent(const std::string& content);
+// Returns the HashContent of the file at |path|, or nullopt if it cannot be
+// read.
+optional<uint64_t> HashFileContent(const std::string& path);
+
 std::string FormatMicroseconds(long long microseconds);
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "threaded_queue.h"
+#include "utils.h"
+
+#include <optional.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using std::experimental::nullopt;
+using std::experimental::optional;
+
+// Distributes tasks over a pool of workers. Every worker owns a deque; it pops
+// its own tasks from the back, so the most recently scheduled (and most likely
+// cache-hot) work runs first, and once its deque is empty it steals the oldest
+// task from another worker. A task is therefore never stuck behind a worker
+// which is busy with something long running.
+//
+// Workers are identified by index. The number of deques is fixed at
+// construction; if there are more workers than deques, workers share a deque.
+template <class T>
+struct WorkStealingQueue : public BaseThreadQueue {
+  WorkStealingQueue(MultiQueueWaiter* waiter, size_t num_deques)
+      : total_count_(0), next_deque_(0), waiter_(waiter) {
+    if (num_deques == 0)
+      num_deques = 1;
+    for (size_t i = 0; i < num_deques; ++i)
+      deques_.push_back(MakeUnique<Deque>());
+  }
+
+  // Returns the number of tasks in every deque. This is lock-free.
+  size_t Size() const { return total_count_; }
+
+  // Returns true if there are no tasks. This is lock-free.
+  bool IsEmpty() override { return total_count_ == 0; }
+
+  // Adds |t| to the back of |worker|'s deque. If |worker| is negative the task
+  // is not tied to a worker and the deques are picked round-robin.
+  void Enqueue(int worker, T&& t) {
+    Deque* deque = worker < 0 ? deques_[next_deque_++ % deques_.size()].get()
+                              : GetDeque(worker);
+    {
+      std::lock_guard<std::mutex> lock(deque->mutex);
+      deque->tasks.push_back(std::move(t));
+      ++total_count_;
+    }
+    waiter_->Notify();
+  }
+
+  // Returns the newest task in |worker|'s deque or, if it is empty, the oldest
+  // task of another worker. Returns a null value if there are no tasks.
+  optional<T> TryDequeue(int worker) {
+    if (IsEmpty())
+      return nullopt;
+
+    Deque* own = GetDeque(worker);
+    {
+      std::lock_guard<std::mutex> lock(own->mutex);
+      if (!own->tasks.empty()) {
+        optional<T> result(std::move(own->tasks.back()));
+        own->tasks.pop_back();
+        --total_count_;
+        return result;
+      }
+    }
+
+    size_t own_index = static_cast<size_t>(worker) % deques_.size();
+    for (size_t i = 1; i < deques_.size(); ++i) {
+      Deque* victim = deques_[(own_index + i) % deques_.size()].get();
+      std::lock_guard<std::mutex> lock(victim->mutex);
+      if (!victim->tasks.empty()) {
+        optional<T> result(std::move(victim->tasks.front()));
+        victim->tasks.pop_front();
+        --total_count_;
+        return result;
+      }
+    }
+
+    return nullopt;
+  }
+
+ private:
+  struct Deque {
+    std::mutex mutex;
+    std::deque<T> tasks;
+  };
+
+  Deque* GetDeque(int worker) {
+    return deques_[static_cast<size_t>(worker) % deques_.size()].get();
+  }
+
+  std::atomic<int> total_count_;
+  std::atomic<size_t> next_deque_;
+  // Never resized after construction, so it can be read without a lock.
+  std::vector<std::unique_ptr<Deque>> deques_;
+  MultiQueueWaiter* waiter_;
+};
@@ -7,9 +7,12 @@ std::atomic<bool> WorkThread::request_exit_on_idle;
 
 // static
 void WorkThread::StartThread(const std::string& thread_name,
-                             const std::function<Result()>& entry_point) {
-  new std::thread([thread_name, entry_point]() {
+                             const std::function<Result()>& entry_point,
+                             Priority priority) {
+  new std::thread([thread_name, entry_point, priority]() {
     SetCurrentThreadName(thread_name);
+    if (priority == Priority::Background)
+      SetCurrentThreadBackgroundPriority();
 
     ++num_active_threads;
 
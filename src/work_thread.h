@@ -10,6 +10,9 @@
 // wait for all work to complete.
 struct WorkThread {
   enum class Result { MoreWork, NoWork, ExitThread };
+  // Background threads only get CPU time and disk I/O when interactive
+  // threads do not need it.
+  enum class Priority { Normal, Background };
 
   // The number of active worker threads.
   static std::atomic<int> num_active_threads;
@@ -19,7 +22,8 @@ struct WorkThread {
   // Launch a new thread. |entry_point| will be called continously. It should
   // return true if it there is still known work to be done.
   static void StartThread(const std::string& thread_name,
-                          const std::function<Result()>& entry_point);
+                          const std::function<Result()>& entry_point,
+                          Priority priority = Priority::Normal);
 
   // Static-only class.
   WorkThread() = delete;
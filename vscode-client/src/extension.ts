@@ -130,9 +130,20 @@ function getClientConfig(context: vscode.ExtensionContext) {
     resourceDirectory: config.get('misc.resourceDirectory'),
     maxWorkspaceSearchResults: config.get('misc.maxWorkspaceSearchResults'),
     indexerCount: config.get('misc.indexerCount'),
+    minIndexerCount: config.get('misc.minIndexerCount'),
+    indexerMemoryLimitMb: config.get('misc.indexerMemoryLimitMb'),
+    enableIndexerBackgroundPriority:
+        config.get('misc.enableIndexerBackgroundPriority'),
+    indexImportBudgetMs: config.get('misc.indexImportBudgetMs'),
+    indexUpdateMaxSize: config.get('misc.indexUpdateMaxSize'),
     enableIndexing: config.get('misc.enableIndexing'),
     enableCacheWrite: config.get('misc.enableCacheWrite'),
     enableCacheRead: config.get('misc.enableCacheRead'),
+    cacheFormat: config.get('misc.cacheFormat'),
+    enablePackedCache: config.get('misc.enablePackedCache'),
+    cacheSizeLimitMb: config.get('misc.cacheSizeLimitMb'),
+    enableRelocatableCache: config.get('misc.enableRelocatableCache'),
+    relocatableCacheRoots: config.get('misc.relocatableCacheRoots'),
     compilationDatabaseDirectory: config.get('misc.compilationDatabaseDirectory'),
     includeCompletionMaximumPathLength:
         config.get('completion.include.maximumPathLength'),
@@ -400,6 +411,14 @@ export function activate(context: vscode.ExtensionContext) {
     languageClient.sendNotification('$cquery/freshenIndex');
   });
 
+  vscode.commands.registerCommand('cquery.saveSnapshot', () => {
+    languageClient.sendNotification('$cquery/saveSnapshot');
+  });
+
+  vscode.commands.registerCommand('cquery.collectCache', () => {
+    languageClient.sendNotification('$cquery/collectCache');
+  });
+
   function makeRefHandler(methodName, autoGotoIfSingle = false) {
     return () => {
       let position = vscode.window.activeTextEditor.selection.active;
@@ -562,17 +581,12 @@ export function activate(context: vscode.ExtensionContext) {
       languageClient.onNotification('$cquery/progress', (args) => {
         let indexRequestCount = args.indexRequestCount;
         let doIdMapCount = args.doIdMapCount;
-        let loadPreviousIndexCount = args.loadPreviousIndexCount;
-        let onIdMappedCount = args.onIdMappedCount;
         let onIndexedCount = args.onIndexedCount;
-        let total = indexRequestCount + doIdMapCount + loadPreviousIndexCount +
-            onIdMappedCount + onIndexedCount;
+        let total = indexRequestCount + doIdMapCount + onIndexedCount;
 
 
         let detailedJobString = `indexRequest: ${indexRequestCount}, ` +
             `doIdMap: ${doIdMapCount}, ` +
-            `loadPreviousIndex: ${loadPreviousIndexCount}, ` +
-            `onIdMapped: ${onIdMappedCount}, ` +
             `onIndexed: ${onIndexedCount}`;
 
         if (total == 0 && statusStyle == 'short') {